@@ -0,0 +1,61 @@
+// Lox arithmetic in millions of loop iterations per second, on whole numbers,
+// which the VM keeps as integers, against the same loops on fractions, which
+// stay doubles.
+//   bazel run -c opt //bench:arithmetic [millions]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "main/vm.hpp"
+
+// each loop runs inside a function, so its variables are locals. `start` is
+// 0 or 0.5, which keeps every value in the loop whole or makes it a fraction,
+// and the loop runs n times either way.
+struct Loop {
+  const char* name;
+  const char* body;
+};
+
+static const Loop loops[] = {
+    {"count", "for (var i = start; i < n; i = i + 1) {}"},
+    {"while", "var i = start; while (i < n) i = i + 1;"},
+    {"add", "var t = 0; for (var i = start; i < n; i = i + 1) t = i - t + 1;"},
+    {"multiply",
+     "var t = 0; for (var i = start; i < n; i = i + 1) t = i * 3 - t;"},
+    {"compare",
+     "var t = 0; for (var i = start; i < n; i = i + 1) {"
+     "  if (i > t) t = t + 2; }"},
+};
+
+// returns the best rate of a few runs of `body` over `count` iterations.
+double measure(size_t count, const Loop& loop, const char* start) {
+  std::string source = std::string("fun run(start, n) {") + loop.body +
+                       "} run(" + start + ", " + std::to_string(count) + ");";
+  double best = 0;
+  for (int pass = 0; pass < 5; pass++) {
+    VM vm{};
+    vm.initVM();
+    auto begin = std::chrono::steady_clock::now();
+    if (vm.interpret(source.c_str()) != INTERPRET_OK) exit(1);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    double rate = count / elapsed.count() / 1e6;
+    if (rate > best) best = rate;
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = (argc > 1 ? atoi(argv[1]) : 20) * 1000000;
+
+  printf("%zu iterations, M/s\n", count);
+  printf("%-10s %8s %8s %8s\n", "", "integer", "double", "speedup");
+  for (auto& loop : loops) {
+    double integer = measure(count, loop, "0");
+    double fraction = measure(count, loop, "0.5");
+    printf("%-10s %8.1f %8.1f %7.2fx\n", loop.name, integer, fraction,
+           integer / fraction);
+  }
+  return 0;
+}
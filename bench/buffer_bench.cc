@@ -0,0 +1,77 @@
+// buffer kernels in millions of elements per second: every kernel set this
+// CPU supports, and a Lox loop summing an array against sum() on a buffer.
+//   bazel run -c opt //bench:buffer [elements]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "main/buffer.hpp"
+#include "main/vm.hpp"
+
+// returns the best rate of a few passes of `run` over `count` elements.
+template <typename F>
+double measure(size_t count, F run) {
+  double best = 0;
+  for (int pass = 0; pass < 5; pass++) {
+    auto begin = std::chrono::steady_clock::now();
+    run();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    double rate = count / elapsed.count() / 1e6;
+    if (rate > best) best = rate;
+  }
+  return best;
+}
+
+// the same numbers as an array and as a buffer, set up once. globals outlive
+// a single interpret() call.
+void setUp(VM* vm, size_t count) {
+  std::string source = "var a = buffer(" + std::to_string(count) +
+                       "); fill(a, 1); var items = [];"
+                       "for (var i = 0; i < a.length; i = i + 1) "
+                       "append(items, 1);";
+  if (vm->interpret(source.c_str()) != INTERPRET_OK) exit(1);
+}
+
+double measureScript(VM* vm, size_t count, const char* source) {
+  return measure(count, [&] {
+    if (vm->interpret(source) != INTERPRET_OK) exit(1);
+  });
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = argc > 1 ? atoi(argv[1]) : 1 << 20;
+  std::vector<double> a(count, 1.5), b(count, 2.0), c(count, 0.5),
+      out(count);
+
+  printf("%zu elements, M/s\n", count);
+  printf("%-8s %8s %8s %8s %8s %8s\n", "", "add", "fma", "sum", "max", "dot");
+  volatile double sink = 0;
+  for (auto set : supportedKernels()) {
+    printf("%-8s", set->name);
+    printf(" %8.0f", measure(count, [&] {
+             set->add(out.data(), a.data(), b.data(), count);
+           }));
+    printf(" %8.0f", measure(count, [&] {
+             set->fma(out.data(), a.data(), b.data(), c.data(), count);
+           }));
+    printf(" %8.0f", measure(count, [&] { sink = set->sum(a.data(), count); }));
+    printf(" %8.0f", measure(count, [&] { sink = set->max(a.data(), count); }));
+    printf(" %8.0f\n", measure(count, [&] {
+             sink = set->dot(a.data(), b.data(), count);
+           }));
+  }
+
+  VM vm{};
+  vm.initVM();
+  setUp(&vm, count);
+  double loop = measureScript(
+      &vm, count,
+      "var total = 0;"
+      "for (var i = 0; i < items.length; i = i + 1) total = total + items[i];");
+  double native = measureScript(&vm, count, "var total = sum(a);");
+  printf("lox loop %8.1f\nsum()    %8.1f\n", loop, native);
+  return 0;
+}
@@ -0,0 +1,83 @@
+// compiler front end throughput in MB/s: scanning on demand against a
+// pre-scanned token stream, and the scan pass on its own.
+//   bazel run -c opt //bench:frontend [megabytes]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+
+#include "main/compiler.hpp"
+#include "main/token_stream.hpp"
+
+// a hundred functions, each a long run of statements over locals only so no
+// chunk runs out of constants.
+std::string generateSource(size_t size) {
+  std::string source;
+  for (int i = 0; i < 100; i++) {
+    source += "fun f" + std::to_string(i) + "(x, y) {\n  var a = x;\n";
+    while (source.size() < size / 100 * (i + 1)) {
+      source += "  a = a * x + a - y / a;\n";
+      source += "  // keep the front end honest\n";
+      source += "  if (a > x and a < y) print a; else { var b = a; a = b; }\n";
+    }
+    source += "  return a;\n}\n";
+  }
+  return source;
+}
+
+double measure(const std::string& source, std::function<void()> run) {
+  double best = 0;
+  for (int pass = 0; pass < 3; pass++) {
+    auto begin = std::chrono::steady_clock::now();
+    run();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    double rate = source.size() / elapsed.count() / (1 << 20);
+    if (rate > best) best = rate;
+  }
+  return best;
+}
+
+// compiles `source` and drops the result.
+void compile(const std::string& source, TokenStream* tokens) {
+  Table strings{};
+  Obj* objects = nullptr;
+  auto compiler = Compiler(source.data(), source.size(), &strings, &objects);
+  compiler.parser->tokens = tokens;
+  if (compiler.compile() == nullptr) exit(1);
+  compiler.freeCompiler();
+  while (objects != nullptr) {
+    Obj* next = objects->next;
+    delete objects;
+    objects = next;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  size_t megabytes = argc > 1 ? atoi(argv[1]) : 16;
+  std::string source = generateSource(megabytes << 20);
+
+  double scan = measure(source, [&] {
+    TokenStream tokens(source.data(), source.size());
+    tokens.scan();
+  });
+  double onDemand = measure(source, [&] { compile(source, nullptr); });
+  double prescanned = measure(source, [&] {
+    TokenStream tokens(source.data(), source.size());
+    tokens.scan();
+    compile(source, &tokens);
+  });
+  double overlapped = measure(source, [&] {
+    TokenStream tokens(source.data(), source.size());
+    tokens.scanInBackground();
+    compile(source, &tokens);
+  });
+
+  printf("%zu MB\n", megabytes);
+  printf("scan into token stream   %8.1f MB/s\n", scan);
+  printf("compile, scan on demand  %8.1f MB/s\n", onDemand);
+  printf("compile, pre-scanned     %8.1f MB/s\n", prescanned);
+  printf("compile, scan overlapped %8.1f MB/s\n", overlapped);
+  return 0;
+}
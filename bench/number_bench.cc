@@ -0,0 +1,83 @@
+// number literal parsing and number printing in millions per second, the libc
+// routines against parseNumber and formatNumber.
+//   bazel run -c opt //bench:number [millions]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "main/number.hpp"
+
+// returns the best rate of a few passes, in millions of numbers per second.
+double measure(size_t count, std::function<double()> run, double* checksum) {
+  double best = 0;
+  for (int pass = 0; pass < 5; pass++) {
+    auto begin = std::chrono::steady_clock::now();
+    *checksum = run();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    double rate = count / elapsed.count() / 1e6;
+    if (rate > best) best = rate;
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  size_t count = (argc > 1 ? atoi(argv[1]) : 2) * 1000000;
+
+  // literals like the ones in numeric tables: integers and fractions.
+  std::mt19937_64 random(1);
+  std::vector<std::string> literals;
+  std::vector<double> values;
+  for (size_t i = 0; i < count; i++) {
+    auto literal = std::to_string(random() % 100000000);
+    if (i % 2) literal += "." + std::to_string(random() % 1000000);
+    literals.push_back(literal);
+    values.push_back(strtod(literal.c_str(), nullptr) / 7);
+  }
+
+  double strtodSum, parseSum;
+  double strtodRate = measure(count, [&] {
+    double sum = 0;
+    for (auto& literal : literals) sum += strtod(literal.c_str(), nullptr);
+    return sum;
+  }, &strtodSum);
+  double parseRate = measure(count, [&] {
+    double sum = 0, value;
+    for (auto& literal : literals) {
+      parseNumber(literal.data(), literal.size(), &value);
+      sum += value;
+    }
+    return sum;
+  }, &parseSum);
+  if (strtodSum != parseSum) {
+    fprintf(stderr, "parsed values differ\n");
+    return 1;
+  }
+
+  double printfLength, formatLength;
+  double printfRate = measure(count, [&] {
+    char buffer[NUMBER_BUFFER_SIZE];
+    double length = 0;
+    for (double value : values) {
+      length += snprintf(buffer, sizeof(buffer), "%.17g", value);
+    }
+    return length;
+  }, &printfLength);
+  double formatRate = measure(count, [&] {
+    char buffer[NUMBER_BUFFER_SIZE];
+    double length = 0;
+    for (double value : values) length += formatNumber(value, buffer);
+    return length;
+  }, &formatLength);
+
+  printf("%zu numbers\n", count);
+  printf("strtod        %8.1f M/s\n", strtodRate);
+  printf("parseNumber   %8.1f M/s\n", parseRate);
+  printf("printf %%.17g  %8.1f M/s\n", printfRate);
+  printf("formatNumber  %8.1f M/s\n", formatRate);
+  return 0;
+}
@@ -0,0 +1,58 @@
+// parallelMap() scaling on an embarrassingly parallel workload: the same
+// recursive fib for every item, on pools of 1, 2, 4 ... up to every core.
+//   bazel run -c opt //bench:parallel_map [items] [n]
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "main/parallel_map.hpp"
+#include "main/vm.hpp"
+
+std::string generateSource(int items, int n) {
+  return "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+         "fun work(i) { return fib(" +
+         std::to_string(n) +
+         "); }\n"
+         "var results = parallelMap(work, " +
+         std::to_string(items) +
+         ");\n"
+         "receive(results);\n";
+}
+
+// `workers` counts the calling thread, so the pool gets one thread less.
+double measure(const std::string& source, int workers) {
+  MapPool pool(workers - 1);
+  double best = 0;
+  for (int pass = 0; pass < 3; pass++) {
+    VM vm{};
+    vm.initVM();
+    vm.mapPool = &pool;
+    auto begin = std::chrono::steady_clock::now();
+    if (vm.interpret(source.c_str()) != INTERPRET_OK) exit(1);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    if (best == 0 || elapsed.count() < best) best = elapsed.count();
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  int items = argc > 1 ? atoi(argv[1]) : 256;
+  int n = argc > 2 ? atoi(argv[2]) : 20;
+  std::string source = generateSource(items, n);
+
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  printf("%d items of fib(%d)\n", items, n);
+  double single = 0;
+  for (int workers = 1;; workers = std::min(workers * 2, cores)) {
+    double seconds = measure(source, workers);
+    if (workers == 1) single = seconds;
+    printf("%3d workers  %8.3f s  %5.2fx\n", workers, seconds,
+           single / seconds);
+    if (workers == cores) break;
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+// scanner throughput in MB/s, scalar against vectorized.
+//   bazel run -c opt //bench:scanner [megabytes]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "main/scanner.hpp"
+
+std::string generateSource(size_t size) {
+  std::string source;
+  for (int i = 0; source.size() < size; i++) {
+    auto n = std::to_string(i);
+    source += "fun function_" + n + "(argument, other_argument) {\n";
+    source += "  // compute something " + n + " times over\n";
+    source += "  var local_value = argument * " + n + ".25 + other_argument;\n";
+    source += "  print \"a string literal of some length " + n + "\";\n";
+    source += "  return local_value;\n}\n\n";
+  }
+  return source;
+}
+
+// returns the best throughput of a few passes over the whole source.
+double measure(const std::string& source, bool vectorized, int* tokens) {
+  double best = 0;
+  for (int pass = 0; pass < 5; pass++) {
+    auto begin = std::chrono::steady_clock::now();
+    auto scanner = Scanner(source.data(), source.data() + source.size());
+    scanner.vectorized = vectorized;
+    *tokens = 0;
+    while (scanner.scanToken().type != TOKEN_EOF) (*tokens)++;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    double rate = source.size() / elapsed.count() / (1 << 20);
+    if (rate > best) best = rate;
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  size_t megabytes = argc > 1 ? atoi(argv[1]) : 64;
+  std::string source = generateSource(megabytes << 20);
+
+  int scalarTokens, vectorizedTokens;
+  double scalar = measure(source, false, &scalarTokens);
+  double vectorized = measure(source, true, &vectorizedTokens);
+  if (scalarTokens != vectorizedTokens) {
+    fprintf(stderr, "token counts differ: %d vs %d\n", scalarTokens,
+            vectorizedTokens);
+    return 1;
+  }
+
+  printf("%zu MB, %d tokens\n", megabytes, scalarTokens);
+  printf("scalar      %8.1f MB/s\n", scalar);
+  printf("vectorized  %8.1f MB/s\n", vectorized);
+  return 0;
+}
@@ -0,0 +1,62 @@
+// work-stealing scheduler scaling: the same batch of recursive fib tasks on
+// 1, 2, 4 ... up to every core, as wall time and speedup over one worker.
+//   bazel run -c opt //bench:scheduler [tasks] [n]
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include "main/scheduler.hpp"
+
+// spawns every task before joining any, holding the handles in the frames of
+// a recursion since there are no lists.
+std::string generateSource(int tasks, int n) {
+  return "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+         "fun sum(count) {\n"
+         "  if (count == 0) return 0;\n"
+         "  var task = spawn(fib, " +
+         std::to_string(n) +
+         ");\n"
+         "  var rest = sum(count - 1);\n"
+         "  return join(task) + rest;\n"
+         "}\n"
+         "sum(" +
+         std::to_string(tasks) + ");\n";
+}
+
+double measure(std::shared_ptr<const Program> program, int workers) {
+  double best = 0;
+  for (int pass = 0; pass < 3; pass++) {
+    Scheduler scheduler(program, workers);
+    auto begin = std::chrono::steady_clock::now();
+    if (!scheduler.run()) exit(1);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+    if (best == 0 || elapsed.count() < best) best = elapsed.count();
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  int tasks = argc > 1 ? atoi(argv[1]) : 48;
+  int n = argc > 2 ? atoi(argv[2]) : 22;
+  // every pending task holds a frame of the script's recursion.
+  tasks = std::min(tasks, 60);
+  std::string source = generateSource(tasks, n);
+  auto program = Program::compile(source.data(), source.size());
+  if (program == nullptr) exit(1);
+
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  printf("%d tasks of fib(%d)\n", tasks, n);
+  double single = 0;
+  for (int workers = 1;; workers = std::min(workers * 2, cores)) {
+    double seconds = measure(program, workers);
+    if (workers == 1) single = seconds;
+    printf("%3d workers  %8.3f s  %5.2fx\n", workers, seconds,
+           single / seconds);
+    if (workers == cores) break;
+  }
+  return 0;
+}
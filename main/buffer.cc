@@ -0,0 +1,443 @@
+#include "buffer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include "object.hpp"
+#include "vm.hpp"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define BUFFER_SIMD
+#endif
+
+static void addScalar(double* out, const double* a, const double* b,
+                      size_t count) {
+  for (size_t i = 0; i < count; i++) out[i] = a[i] + b[i];
+}
+
+static void mulScalar(double* out, const double* a, const double* b,
+                      size_t count) {
+  for (size_t i = 0; i < count; i++) out[i] = a[i] * b[i];
+}
+
+static void fmaScalar(double* out, const double* a, const double* b,
+                      const double* c, size_t count) {
+  for (size_t i = 0; i < count; i++) out[i] = std::fma(a[i], b[i], c[i]);
+}
+
+static double sumScalar(const double* a, size_t count) {
+  double sum = 0;
+  for (size_t i = 0; i < count; i++) sum += a[i];
+  return sum;
+}
+
+// NaN if either is, and -0 below 0, so that a reduction gives the same
+// answer whatever order the lanes take the elements in.
+static double lesser(double a, double b) {
+  if (std::isnan(a) || std::isnan(b)) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  return a < b || (a == b && std::signbit(a)) ? a : b;
+}
+
+static double greater(double a, double b) {
+  if (std::isnan(a) || std::isnan(b)) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  return a > b || (a == b && !std::signbit(a)) ? a : b;
+}
+
+static double minScalar(const double* a, size_t count) {
+  double min = a[0];
+  for (size_t i = 1; i < count; i++) min = lesser(min, a[i]);
+  return min;
+}
+
+static double maxScalar(const double* a, size_t count) {
+  double max = a[0];
+  for (size_t i = 1; i < count; i++) max = greater(max, a[i]);
+  return max;
+}
+
+static double dotScalar(const double* a, const double* b, size_t count) {
+  double sum = 0;
+  for (size_t i = 0; i < count; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+static const Kernels scalarKernels = {
+    "scalar",  addScalar, mulScalar, fmaScalar,
+    sumScalar, minScalar, maxScalar, dotScalar,
+};
+
+#ifdef BUFFER_SIMD
+// two registers of 2 lanes each, so that a reduction doesn't wait on the
+// latency of its previous addition. the tails are left to the scalar loops.
+static void addSse2(double* out, const double* a, const double* b,
+                    size_t count) {
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(out + i,
+                  _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+  addScalar(out + i, a + i, b + i, count - i);
+}
+
+static void mulSse2(double* out, const double* a, const double* b,
+                    size_t count) {
+  size_t i = 0;
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(out + i,
+                  _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+  mulScalar(out + i, a + i, b + i, count - i);
+}
+
+static inline double lanes2(__m128d v, double (*combine)(double, double)) {
+  double lanes[2];
+  _mm_storeu_pd(lanes, v);
+  return combine(lanes[0], lanes[1]);
+}
+
+static double plus(double a, double b) { return a + b; }
+
+// minpd and maxpd give their second operand when the two are equal or either
+// is NaN. these match lesser() and greater() instead: the equal case ors or
+// ands the sign bits together, and a NaN lane becomes all ones and stays so.
+static inline __m128d min2(__m128d m, __m128d x) {
+  __m128d equal = _mm_and_pd(_mm_cmpeq_pd(m, x), m);
+  return _mm_or_pd(_mm_or_pd(_mm_min_pd(m, x), equal), _mm_cmpunord_pd(m, x));
+}
+
+static inline __m128d max2(__m128d m, __m128d x) {
+  __m128d unequal = _mm_or_pd(_mm_cmpneq_pd(m, x), m);
+  return _mm_or_pd(_mm_and_pd(_mm_max_pd(m, x), unequal),
+                   _mm_cmpunord_pd(m, x));
+}
+
+static double sumSse2(const double* a, size_t count) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_loadu_pd(a + i));
+    s1 = _mm_add_pd(s1, _mm_loadu_pd(a + i + 2));
+  }
+  return lanes2(_mm_add_pd(s0, s1), plus) + sumScalar(a + i, count - i);
+}
+
+static double minSse2(const double* a, size_t count) {
+  __m128d m0 = _mm_set1_pd(a[0]), m1 = m0;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    m0 = min2(m0, _mm_loadu_pd(a + i));
+    m1 = min2(m1, _mm_loadu_pd(a + i + 2));
+  }
+  double min = lanes2(min2(m0, m1), lesser);
+  return i < count ? lesser(min, minScalar(a + i, count - i)) : min;
+}
+
+static double maxSse2(const double* a, size_t count) {
+  __m128d m0 = _mm_set1_pd(a[0]), m1 = m0;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    m0 = max2(m0, _mm_loadu_pd(a + i));
+    m1 = max2(m1, _mm_loadu_pd(a + i + 2));
+  }
+  double max = lanes2(max2(m0, m1), greater);
+  return i < count ? greater(max, maxScalar(a + i, count - i)) : max;
+}
+
+static double dotSse2(const double* a, const double* b, size_t count) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    s1 = _mm_add_pd(
+        s1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  return lanes2(_mm_add_pd(s0, s1), plus) + dotScalar(a + i, b + i, count - i);
+}
+
+// SSE2 has no fused multiply-add, and a multiply then an add would round
+// twice, so fma() stays with std::fma.
+static const Kernels sse2Kernels = {
+    "sse2",  addSse2, mulSse2, fmaScalar,
+    sumSse2, minSse2, maxSse2, dotSse2,
+};
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static inline double lanes4(__m256d v,
+                                 double (*combine)(double, double)) {
+  double lanes[4];
+  _mm256_storeu_pd(lanes, v);
+  return combine(combine(lanes[0], lanes[1]), combine(lanes[2], lanes[3]));
+}
+
+AVX2 static void addAvx2(double* out, const double* a, const double* b,
+                         size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  }
+  addScalar(out + i, a + i, b + i, count - i);
+}
+
+AVX2 static void mulAvx2(double* out, const double* a, const double* b,
+                         size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                            _mm256_loadu_pd(b + i)));
+  }
+  mulScalar(out + i, a + i, b + i, count - i);
+}
+
+AVX2 static void fmaAvx2(double* out, const double* a, const double* b,
+                         const double* c, size_t count) {
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_fmadd_pd(_mm256_loadu_pd(a + i),
+                                              _mm256_loadu_pd(b + i),
+                                              _mm256_loadu_pd(c + i)));
+  }
+  for (; i < count; i++) out[i] = std::fma(a[i], b[i], c[i]);
+}
+
+AVX2 static double sumAvx2(const double* a, size_t count) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+  }
+  return lanes4(_mm256_add_pd(s0, s1), plus) + sumScalar(a + i, count - i);
+}
+
+AVX2 static inline __m256d min4(__m256d m, __m256d x) {
+  __m256d equal = _mm256_and_pd(_mm256_cmp_pd(m, x, _CMP_EQ_OQ), m);
+  return _mm256_or_pd(_mm256_or_pd(_mm256_min_pd(m, x), equal),
+                      _mm256_cmp_pd(m, x, _CMP_UNORD_Q));
+}
+
+AVX2 static inline __m256d max4(__m256d m, __m256d x) {
+  __m256d unequal = _mm256_or_pd(_mm256_cmp_pd(m, x, _CMP_NEQ_UQ), m);
+  return _mm256_or_pd(_mm256_and_pd(_mm256_max_pd(m, x), unequal),
+                      _mm256_cmp_pd(m, x, _CMP_UNORD_Q));
+}
+
+AVX2 static double minAvx2(const double* a, size_t count) {
+  __m256d m0 = _mm256_set1_pd(a[0]), m1 = m0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    m0 = min4(m0, _mm256_loadu_pd(a + i));
+    m1 = min4(m1, _mm256_loadu_pd(a + i + 4));
+  }
+  double min = lanes4(min4(m0, m1), lesser);
+  return i < count ? lesser(min, minScalar(a + i, count - i)) : min;
+}
+
+AVX2 static double maxAvx2(const double* a, size_t count) {
+  __m256d m0 = _mm256_set1_pd(a[0]), m1 = m0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    m0 = max4(m0, _mm256_loadu_pd(a + i));
+    m1 = max4(m1, _mm256_loadu_pd(a + i + 4));
+  }
+  double max = lanes4(max4(m0, m1), greater);
+  return i < count ? greater(max, maxScalar(a + i, count - i)) : max;
+}
+
+AVX2 static double dotAvx2(const double* a, const double* b, size_t count) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), s0);
+    s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4),
+                         _mm256_loadu_pd(b + i + 4), s1);
+  }
+  return lanes4(_mm256_add_pd(s0, s1), plus) +
+         dotScalar(a + i, b + i, count - i);
+}
+
+#undef AVX2
+
+static const Kernels avx2Kernels = {
+    "avx2",  addAvx2, mulAvx2, fmaAvx2,
+    sumAvx2, minAvx2, maxAvx2, dotAvx2,
+};
+
+static const bool supportsAvx2 =
+    (__builtin_cpu_init(),
+     __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"));
+#endif
+
+std::vector<const Kernels*> supportedKernels() {
+  std::vector<const Kernels*> kernels = {&scalarKernels};
+#ifdef BUFFER_SIMD
+  kernels.push_back(&sse2Kernels);
+  if (supportsAvx2) kernels.push_back(&avx2Kernels);
+#endif
+  return kernels;
+}
+
+const Kernels* bestKernels() {
+#ifdef BUFFER_SIMD
+  return supportsAvx2 ? &avx2Kernels : &sse2Kernels;
+#else
+  return &scalarKernels;
+#endif
+}
+
+// checks that the first `count` arguments are buffers of one length, which
+// the natives below all require.
+static bool sameBuffers(VM* vm, const char* usage, int argCount, Value* args,
+                        int count) {
+  bool ok = argCount == count;
+  for (int i = 0; ok && i < count; i++) {
+    ok = IS_BUFFER(args[i]) &&
+         AS_BUFFER(args[i])->values.size() == AS_BUFFER(args[0])->values.size();
+  }
+  if (!ok) vm->runtimeError("%s", usage);
+  return ok;
+}
+
+static double* data(Value buffer) { return AS_BUFFER(buffer)->values.data(); }
+
+static size_t size(Value buffer) { return AS_BUFFER(buffer)->values.size(); }
+
+static bool finish(VM* vm, int argCount, Value result) {
+  vm->stack_top -= argCount + 1;
+  vm->push(result);
+  return true;
+}
+
+// buffer(n) makes a buffer of n zeros, buffer(array) one of the array's
+// numbers.
+static bool bufferNative(VM* vm, int argCount, Value* args) {
+  if (argCount == 1 && IS_ARRAY(args[0])) {
+    auto& values = AS_ARRAY(args[0])->values;
+    ObjBuffer* buffer = allocateBufferObject(values.size(), &vm->objects);
+    for (size_t i = 0; i < values.size(); i++) {
+      if (!IS_NUMBER(values[i])) {
+        vm->runtimeError("A buffer can only hold numbers.");
+        return false;
+      }
+      buffer->values[i] = AS_NUMBER(values[i]);
+    }
+    return finish(vm, argCount, OBJ_VAL(buffer));
+  }
+  if (argCount != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 ||
+      AS_NUMBER(args[0]) > (1 << 24) ||
+      AS_NUMBER(args[0]) != std::floor(AS_NUMBER(args[0]))) {
+    vm->runtimeError(
+        "buffer() takes a length up to 16777216 or an array of numbers.");
+    return false;
+  }
+  return finish(
+      vm, argCount,
+      OBJ_VAL(allocateBufferObject((size_t)AS_NUMBER(args[0]), &vm->objects)));
+}
+
+// the natives that write a buffer evaluate to it.
+static bool fillNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_BUFFER(args[0]) || !IS_NUMBER(args[1])) {
+    vm->runtimeError("fill() takes a buffer and a number.");
+    return false;
+  }
+  std::fill_n(data(args[0]), size(args[0]), AS_NUMBER(args[1]));
+  return finish(vm, argCount, args[0]);
+}
+
+static bool copyNative(VM* vm, int argCount, Value* args) {
+  if (!sameBuffers(vm, "copy() takes two buffers of the same length.",
+                   argCount, args, 2)) {
+    return false;
+  }
+  memmove(data(args[0]), data(args[1]), size(args[0]) * sizeof(double));
+  return finish(vm, argCount, args[0]);
+}
+
+static bool addNative(VM* vm, int argCount, Value* args) {
+  if (!sameBuffers(vm, "add() takes three buffers of the same length.",
+                   argCount, args, 3)) {
+    return false;
+  }
+  bestKernels()->add(data(args[0]), data(args[1]), data(args[2]),
+                     size(args[0]));
+  return finish(vm, argCount, args[0]);
+}
+
+static bool mulNative(VM* vm, int argCount, Value* args) {
+  if (!sameBuffers(vm, "mul() takes three buffers of the same length.",
+                   argCount, args, 3)) {
+    return false;
+  }
+  bestKernels()->mul(data(args[0]), data(args[1]), data(args[2]),
+                     size(args[0]));
+  return finish(vm, argCount, args[0]);
+}
+
+static bool fmaNative(VM* vm, int argCount, Value* args) {
+  if (!sameBuffers(vm, "fma() takes four buffers of the same length.",
+                   argCount, args, 4)) {
+    return false;
+  }
+  bestKernels()->fma(data(args[0]), data(args[1]), data(args[2]),
+                     data(args[3]), size(args[0]));
+  return finish(vm, argCount, args[0]);
+}
+
+static bool sumNative(VM* vm, int argCount, Value* args) {
+  if (!sameBuffers(vm, "sum() takes a buffer.", argCount, args, 1)) {
+    return false;
+  }
+  return finish(vm, argCount,
+                NUMBER_VAL(bestKernels()->sum(data(args[0]), size(args[0]))));
+}
+
+// nil for an empty buffer.
+static bool minNative(VM* vm, int argCount, Value* args) {
+  if (!sameBuffers(vm, "min() takes a buffer.", argCount, args, 1)) {
+    return false;
+  }
+  if (size(args[0]) == 0) return finish(vm, argCount, NIL_VAL);
+  return finish(vm, argCount,
+                NUMBER_VAL(bestKernels()->min(data(args[0]), size(args[0]))));
+}
+
+static bool maxNative(VM* vm, int argCount, Value* args) {
+  if (!sameBuffers(vm, "max() takes a buffer.", argCount, args, 1)) {
+    return false;
+  }
+  if (size(args[0]) == 0) return finish(vm, argCount, NIL_VAL);
+  return finish(vm, argCount,
+                NUMBER_VAL(bestKernels()->max(data(args[0]), size(args[0]))));
+}
+
+static bool dotNative(VM* vm, int argCount, Value* args) {
+  if (!sameBuffers(vm, "dot() takes two buffers of the same length.",
+                   argCount, args, 2)) {
+    return false;
+  }
+  return finish(vm, argCount,
+                NUMBER_VAL(bestKernels()->dot(data(args[0]), data(args[1]),
+                                              size(args[0]))));
+}
+
+void defineBufferNatives(VM* vm) {
+  vm->defineNative("buffer", 6, bufferNative);
+  vm->defineNative("fill", 4, fillNative);
+  vm->defineNative("copy", 4, copyNative);
+  vm->defineNative("add", 3, addNative);
+  vm->defineNative("mul", 3, mulNative);
+  vm->defineNative("fma", 3, fmaNative);
+  vm->defineNative("sum", 3, sumNative);
+  vm->defineNative("min", 3, minNative);
+  vm->defineNative("max", 3, maxNative);
+  vm->defineNative("dot", 3, dotNative);
+}
@@ -0,0 +1,38 @@
+#ifndef cpplox_buffer_h
+#define cpplox_buffer_h
+
+#include <vector>
+
+#include "common.hpp"
+
+class VM;
+
+// bulk operations over raw doubles. sources and `out` have `count` elements
+// and `out` may be one of the sources. reductions add up in several lanes at
+// once, so a sum can differ in its last bits from a left-to-right loop.
+class Kernels {
+ public:
+  const char* name;
+  void (*add)(double* out, const double* a, const double* b, size_t count);
+  void (*mul)(double* out, const double* a, const double* b, size_t count);
+  // out = a * b + c, rounded once.
+  void (*fma)(double* out, const double* a, const double* b, const double* c,
+              size_t count);
+  double (*sum)(const double* a, size_t count);
+  // min and max of at least one element. NaN if any element is, and -0 is
+  // below 0.
+  double (*min)(const double* a, size_t count);
+  double (*max)(const double* a, size_t count);
+  double (*dot)(const double* a, const double* b, size_t count);
+};
+
+// scalar, SSE2 and AVX2 with FMA, as far as this CPU runs them.
+std::vector<const Kernels*> supportedKernels();
+// the fastest of them, which the natives use.
+const Kernels* bestKernels();
+
+// buffer(), fill(), copy(), add(), mul(), fma(), sum(), min(), max() and dot()
+// in `vm`.
+void defineBufferNatives(VM* vm);
+
+#endif
@@ -0,0 +1,514 @@
+#include "bytecode.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <unordered_map>
+
+#include "mapped_file.hpp"
+
+uint64_t hashSource(const char* source, size_t length) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)source[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+class BytecodeWriter : public ImageWriter {
+ public:
+  std::vector<ObjString*> strings;
+  std::unordered_map<std::string, uint32_t> stringIndexes;
+  std::vector<ObjFunction*> functions;
+  std::unordered_map<ObjFunction*, uint32_t> functionIndexes;
+
+  uint32_t addString(ObjString* string);
+  void collect(ObjFunction* function);
+  void writeFunction(ObjFunction* function);
+};
+
+uint32_t BytecodeWriter::addString(ObjString* string) {
+  auto found = stringIndexes.find(string->str);
+  if (found != stringIndexes.end()) return found->second;
+
+  uint32_t index = strings.size();
+  strings.push_back(string);
+  stringIndexes[string->str] = index;
+  return index;
+}
+
+void BytecodeWriter::collect(ObjFunction* function) {
+  if (functionIndexes.count(function)) return;
+
+  if (function->name != nullptr) addString(function->name);
+  for (auto value : function->chunk.constants.values) {
+    if (IS_STRING(value)) {
+      addString(AS_STRING(value));
+    } else if (IS_FUNCTION(value)) {
+      collect(AS_FUNCTION(value));
+    }
+  }
+
+  functionIndexes[function] = functions.size();
+  functions.push_back(function);
+}
+
+void BytecodeWriter::writeFunction(ObjFunction* function) {
+  writeU32(function->name == nullptr ? UINT32_MAX
+                                     : stringIndexes[function->name->str]);
+  writeU32(function->arity);
+  writeU32(function->upvalueCount);
+  writeU32(function->cacheCount);
+
+  auto& chunk = function->chunk;
+  writeU32(chunk.code.size());
+  write(chunk.code.data(), chunk.code.size());
+  align();
+  write(chunk.lines.data(), chunk.lines.size() * sizeof(int));
+
+  writeU32(chunk.constants.values.size());
+  for (auto value : chunk.constants.values) {
+    if (IS_NIL(value)) {
+      writeU8(CONSTANT_NIL);
+    } else if (IS_BOOL(value)) {
+      writeU8(AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else if (IS_NUMBER(value)) {
+      writeU8(CONSTANT_NUMBER);
+      writeF64(AS_NUMBER(value));
+    } else if (IS_STRING(value)) {
+      writeU8(CONSTANT_STRING);
+      writeU32(stringIndexes[AS_STRING(value)->str]);
+    } else {
+      writeU8(CONSTANT_FUNCTION);
+      writeU32(functionIndexes[AS_FUNCTION(value)]);
+    }
+  }
+  align();
+}
+
+std::vector<uint8_t> serializeFunction(ObjFunction* script,
+                                       uint64_t sourceHash) {
+  BytecodeWriter writer{};
+  writer.collect(script);
+
+  writer.writeU32(BYTECODE_MAGIC);
+  writer.writeU32(BYTECODE_VERSION);
+  writer.writeU64(sourceHash);
+  writer.writeU32(writer.strings.size());
+  writer.writeU32(writer.functions.size());
+
+  for (auto string : writer.strings) {
+    writer.writeU32(string->hash);
+    writer.writeU32(string->str.size());
+    writer.write(string->str.data(), string->str.size());
+  }
+  writer.align();
+
+  for (auto function : writer.functions) writer.writeFunction(function);
+  return writer.out;
+}
+
+const uint8_t* ImageReader::read(size_t size) {
+  if (!ok || (size_t)(end - current) < size) {
+    ok = false;
+    return nullptr;
+  }
+  auto bytes = current;
+  current += size;
+  return bytes;
+}
+
+void ImageReader::align() {
+  read((sizeof(uint32_t) - (current - base) % sizeof(uint32_t)) %
+       sizeof(uint32_t));
+}
+
+// how one instruction uses the stack and where it can go next.
+struct Instruction {
+  size_t length;
+  // values it takes off the stack and puts back.
+  int pops;
+  int pushes;
+  bool fallsThrough;
+  // where it may jump to, SIZE_MAX if it can't.
+  size_t target;
+};
+
+class CodeVerifier {
+ public:
+  ObjFunction* function;
+  Chunk& chunk;
+
+  CodeVerifier(ObjFunction* function)
+      : function(function), chunk(function->chunk){};
+
+  bool decode(size_t offset, int height, Instruction* inst);
+  bool verify();
+
+ private:
+  bool constant(size_t index) {
+    return index < chunk.constants.values.size();
+  }
+  bool string(size_t index) {
+    return constant(index) && IS_STRING(chunk.constants.values[index]);
+  }
+  bool cache(size_t offset) {
+    return ((chunk.code[offset] << 8) | chunk.code[offset + 1]) <
+           function->cacheCount;
+  }
+  size_t jump(size_t offset, int sign) {
+    size_t distance = (chunk.code[offset + 1] << 8) | chunk.code[offset + 2];
+    return offset + 3 + sign * distance;
+  }
+};
+
+// checks the operands of the instruction at `offset` against a stack of
+// `height` values in the current frame.
+bool CodeVerifier::decode(size_t offset, int height, Instruction* inst) {
+  auto& code = chunk.code;
+  auto operands = [&](size_t count) {
+    inst->length = 1 + count;
+    return offset + inst->length <= code.size();
+  };
+  auto effect = [&](int pops, int pushes) {
+    inst->pops = pops;
+    inst->pushes = pushes;
+  };
+  inst->fallsThrough = true;
+  inst->target = SIZE_MAX;
+
+  switch (code[offset]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      effect(0, 1);
+      return operands(0);
+    case OP_NOT:
+    case OP_NEGATE:
+      effect(1, 1);
+      return operands(0);
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GET_INDEX:
+    case OP_INHERIT:
+      effect(2, 1);
+      return operands(0);
+    case OP_SET_INDEX:
+      effect(3, 1);
+      return operands(0);
+    case OP_PRINT:
+    case OP_POP:
+    case OP_CLOSE_UPVALUE:
+    case OP_YIELD:
+      effect(1, 0);
+      return operands(0);
+    case OP_RETURN:
+      effect(1, 0);
+      inst->fallsThrough = false;
+      return operands(0);
+    case OP_CONSTANT:
+      effect(0, 1);
+      return operands(1) && constant(code[offset + 1]);
+    case OP_GET_GLOBAL:
+    case OP_CLASS:
+      effect(0, 1);
+      return operands(1) && string(code[offset + 1]);
+    case OP_SET_GLOBAL:
+      effect(1, 1);
+      return operands(1) && string(code[offset + 1]);
+    case OP_DEFINE_GLOBAL:
+      effect(1, 0);
+      return operands(1) && string(code[offset + 1]);
+    case OP_METHOD:
+    case OP_GET_SUPER:
+      effect(2, 1);
+      return operands(1) && string(code[offset + 1]);
+    case OP_GET_LOCAL:
+      effect(0, 1);
+      return operands(1) && code[offset + 1] < height;
+    case OP_SET_LOCAL:
+      effect(1, 1);
+      return operands(1) && code[offset + 1] < height;
+    case OP_GET_UPVALUE:
+      effect(0, 1);
+      return operands(1) && code[offset + 1] < function->upvalueCount;
+    case OP_SET_UPVALUE:
+      effect(1, 1);
+      return operands(1) && code[offset + 1] < function->upvalueCount;
+    case OP_CALL:
+      if (!operands(1)) return false;
+      effect(code[offset + 1] + 1, 1);
+      return true;
+    case OP_ARRAY:
+      if (!operands(1)) return false;
+      effect(code[offset + 1], 1);
+      return true;
+    case OP_GET_PROPERTY:
+      effect(1, 1);
+      return operands(3) && string(code[offset + 1]) && cache(offset + 2);
+    case OP_SET_PROPERTY:
+      effect(2, 1);
+      return operands(3) && string(code[offset + 1]) && cache(offset + 2);
+    case OP_INVOKE:
+      if (!operands(4)) return false;
+      effect(code[offset + 4] + 1, 1);
+      return string(code[offset + 1]) && cache(offset + 2);
+    case OP_SUPER_INVOKE:
+      if (!operands(2)) return false;
+      effect(code[offset + 2] + 2, 1);
+      return string(code[offset + 1]);
+    case OP_JUMP_IF_FALSE:
+      effect(1, 1);
+      if (!operands(2)) return false;
+      inst->target = jump(offset, 1);
+      return true;
+    case OP_JUMP:
+    case OP_LOOP:
+      effect(0, 0);
+      if (!operands(2)) return false;
+      inst->fallsThrough = false;
+      inst->target = jump(offset, code[offset] == OP_JUMP ? 1 : -1);
+      return true;
+    case OP_FOR_LOCAL:
+    case OP_FOR_CONSTANT: {
+      effect(0, 0);
+      if (!operands(4)) return false;
+      size_t distance = (code[offset + 3] << 8) | code[offset + 4];
+      inst->target = offset + 5 - distance;
+      bool limit = code[offset] == OP_FOR_LOCAL ? code[offset + 2] < height
+                                                : constant(code[offset + 2]);
+      return code[offset + 1] < height && limit;
+    }
+    case OP_CLOSURE:
+    case OP_STACK_CLOSURE: {
+      effect(0, 1);
+      if (!operands(1) || !constant(code[offset + 1])) return false;
+      Value value = chunk.constants.values[code[offset + 1]];
+      if (!IS_FUNCTION(value)) return false;
+      int upvalueCount = AS_FUNCTION(value)->upvalueCount;
+      if (!operands(1 + 2 * upvalueCount)) return false;
+      for (int i = 0; i < upvalueCount; i++) {
+        uint8_t isLocal = code[offset + 2 + 2 * i];
+        uint8_t index = code[offset + 3 + 2 * i];
+        if (isLocal > 1) return false;
+        // the closure is pushed first, so a recursive one captures itself.
+        if (isLocal ? index > height : index >= function->upvalueCount) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// decodes every instruction once to find where instructions start, then
+// follows the control flow to find the stack height at each of them. every
+// path must agree on the height, keep the callee in slot 0 and end in
+// OP_RETURN.
+bool CodeVerifier::verify() {
+  if (function->arity < 0 || function->arity >= UINT8_COUNT ||
+      function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT ||
+      function->cacheCount < 0 ||
+      (size_t)function->cacheCount > function->chunk.code.size()) {
+    return false;
+  }
+
+  auto& code = chunk.code;
+  std::vector<bool> starts(code.size(), false);
+  Instruction inst;
+  for (size_t offset = 0; offset < code.size(); offset += inst.length) {
+    if (!decode(offset, UINT8_COUNT, &inst)) return false;
+    starts[offset] = true;
+  }
+  if (code.empty()) return false;
+
+  std::vector<int> heights(code.size(), -1);
+  std::vector<size_t> pending{0};
+  heights[0] = function->arity + 1;
+  auto reach = [&](size_t offset, int height) {
+    if (offset >= code.size() || !starts[offset]) return false;
+    if (heights[offset] == -1) {
+      heights[offset] = height;
+      pending.push_back(offset);
+    }
+    return heights[offset] == height;
+  };
+
+  while (!pending.empty()) {
+    size_t offset = pending.back();
+    pending.pop_back();
+    int height = heights[offset];
+    if (!decode(offset, height, &inst) || height - inst.pops < 1) {
+      return false;
+    }
+    height += inst.pushes - inst.pops;
+    if (height > UINT8_COUNT) return false;
+    if (inst.fallsThrough && !reach(offset + inst.length, height)) {
+      return false;
+    }
+    if (inst.target != SIZE_MAX && !reach(inst.target, height)) return false;
+  }
+  return true;
+}
+
+bool verifyFunction(ObjFunction* function) {
+  return CodeVerifier(function).verify();
+}
+
+ObjFunction* deserializeFunction(const uint8_t* data, size_t size,
+                                 uint64_t* sourceHash, Table* stringTable,
+                                 Obj** objects) {
+  ImageReader reader(data, size);
+  if (reader.readValue<uint32_t>() != BYTECODE_MAGIC) return nullptr;
+  if (reader.readValue<uint32_t>() != BYTECODE_VERSION) return nullptr;
+  uint64_t hash = reader.readValue<uint64_t>();
+  if (sourceHash != nullptr) *sourceHash = hash;
+
+  uint32_t stringCount = reader.readValue<uint32_t>();
+  uint32_t functionCount = reader.readValue<uint32_t>();
+  if (!reader.ok || functionCount == 0 ||
+      stringCount > reader.remaining() ||
+      functionCount > reader.remaining()) {
+    return nullptr;
+  }
+
+  // strings go straight from the mapping into the intern table with the
+  // hash computed at compile time.
+  std::vector<ObjString*> strings;
+  strings.reserve(stringCount);
+  for (uint32_t i = 0; i < stringCount; i++) {
+    uint32_t stringHash = reader.readValue<uint32_t>();
+    uint32_t length = reader.readValue<uint32_t>();
+    auto chars = (const char*)reader.read(length);
+    if (!reader.ok) return nullptr;
+    strings.push_back(allocateStringObject(chars, length, stringHash,
+                                           stringTable, objects));
+  }
+  reader.align();
+
+  std::vector<ObjFunction*> functions;
+  functions.reserve(functionCount);
+  for (uint32_t i = 0; i < functionCount; i++) {
+    uint32_t nameIndex = reader.readValue<uint32_t>();
+    uint32_t arity = reader.readValue<uint32_t>();
+    uint32_t upvalueCount = reader.readValue<uint32_t>();
+    uint32_t cacheCount = reader.readValue<uint32_t>();
+    uint32_t codeLength = reader.readValue<uint32_t>();
+    auto code = reader.read(codeLength);
+    reader.align();
+    auto lines = reader.read(codeLength * sizeof(int));
+    uint32_t constantCount = reader.readValue<uint32_t>();
+    if (!reader.ok || constantCount > reader.remaining()) return nullptr;
+    if (nameIndex != UINT32_MAX && nameIndex >= strings.size()) {
+      return nullptr;
+    }
+
+    auto function = allocateFunctionObject(objects);
+    function->arity = arity;
+    function->upvalueCount = upvalueCount;
+    function->cacheCount = cacheCount;
+    if (nameIndex != UINT32_MAX) {
+      auto name = strings[nameIndex];
+      function->name =
+          new ObjString(name->str.data(), name->str.size(), name->hash);
+    }
+
+    auto& chunk = function->chunk;
+    chunk.code.assign(code, code + codeLength);
+    chunk.lines.resize(codeLength);
+    memcpy(chunk.lines.data(), lines, codeLength * sizeof(int));
+
+    chunk.constants.values.reserve(constantCount);
+    for (uint32_t j = 0; j < constantCount; j++) {
+      Value value = NIL_VAL;
+      switch (reader.readValue<uint8_t>()) {
+        case CONSTANT_NIL:
+          break;
+        case CONSTANT_FALSE:
+          value = BOOL_VAL(false);
+          break;
+        case CONSTANT_TRUE:
+          value = BOOL_VAL(true);
+          break;
+        case CONSTANT_NUMBER:
+          value = packNumber(reader.readValue<double>());
+          break;
+        case CONSTANT_STRING: {
+          uint32_t index = reader.readValue<uint32_t>();
+          if (index >= strings.size()) return nullptr;
+          value = OBJ_VAL(strings[index]);
+          break;
+        }
+        case CONSTANT_FUNCTION: {
+          uint32_t index = reader.readValue<uint32_t>();
+          if (index >= functions.size()) return nullptr;
+          value = OBJ_VAL(functions[index]);
+          break;
+        }
+        default:
+          return nullptr;
+      }
+      chunk.constants.writeValueArray(value);
+    }
+    reader.align();
+    if (!reader.ok || !verifyFunction(function)) return nullptr;
+
+    functions.push_back(function);
+  }
+
+  // nothing runs the script in a closure with upvalues.
+  if (functions.back()->upvalueCount != 0) return nullptr;
+  return functions.back();
+}
+
+bool isBytecodeFile(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  uint32_t magic = 0;
+  bool isBytecode = read(fd, &magic, sizeof(magic)) == sizeof(magic) &&
+                    magic == BYTECODE_MAGIC;
+  close(fd);
+  return isBytecode;
+}
+
+bool writeImageFile(const char* path, const std::vector<uint8_t>& image) {
+  std::string tmpPath = std::string(path) + ".tmp";
+  FILE* file = fopen(tmpPath.c_str(), "wb");
+  if (file == nullptr) return false;
+  bool written = fwrite(image.data(), 1, image.size(), file) == image.size();
+  written = fclose(file) == 0 && written;
+  if (!written || rename(tmpPath.c_str(), path) != 0) {
+    remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool writeBytecodeFile(const char* path, ObjFunction* script,
+                       uint64_t sourceHash) {
+  return writeImageFile(path, serializeFunction(script, sourceHash));
+}
+
+ObjFunction* loadBytecodeFile(const char* path, uint64_t sourceHash,
+                              Table* stringTable, Obj** objects) {
+  MappedFile file{};
+  if (!file.map(path)) return nullptr;
+
+  // check the recorded source hash before materializing any objects.
+  if (sourceHash != 0 &&
+      (file.size < 16 ||
+       memcmp(file.data + 8, &sourceHash, sizeof(sourceHash)) != 0)) {
+    return nullptr;
+  }
+  return deserializeFunction(file.data, file.size, nullptr, stringTable,
+                             objects);
+}
@@ -0,0 +1,103 @@
+#ifndef cpplox_bytecode_h
+#define cpplox_bytecode_h
+
+#include <string.h>
+
+#include "common.hpp"
+#include "object.hpp"
+#include "table.hpp"
+
+// on-disk layout (native byte order):
+//   header    magic, version, source hash, string count, function count
+//   strings   hash, length, bytes
+//   functions name index, arity, upvalue count, cache count, code, lines,
+//             constants
+// functions are written children first so that every OP_CLOSURE constant
+// refers to an already loaded function; the script is the last one.
+#define BYTECODE_MAGIC 0x42584f4c  // "LOXB"
+#define BYTECODE_VERSION 6
+
+enum BytecodeConstant : uint8_t {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+  // any other heap object, by index into a heap snapshot's object table.
+  CONSTANT_OBJECT,
+};
+
+// appends native-endian fields to an image, keeping 4 byte alignment where
+// the loader copies arrays out of the mapping.
+class ImageWriter {
+ public:
+  std::vector<uint8_t> out;
+
+  void write(const void* data, size_t size) {
+    auto bytes = (const uint8_t*)data;
+    out.insert(out.end(), bytes, bytes + size);
+  }
+  void writeU8(uint8_t value) { out.push_back(value); }
+  void writeU32(uint32_t value) { write(&value, sizeof(value)); }
+  void writeU64(uint64_t value) { write(&value, sizeof(value)); }
+  void writeF64(double value) { write(&value, sizeof(value)); }
+  void align() {
+    while (out.size() % sizeof(uint32_t) != 0) out.push_back(0);
+  }
+};
+
+// bounds checked cursor over an image. once a read runs past the end `ok`
+// stays false and every further read returns zeroes.
+class ImageReader {
+ public:
+  const uint8_t* base;
+  const uint8_t* current;
+  const uint8_t* end;
+  bool ok;
+  ImageReader(const uint8_t* data, size_t size)
+      : base(data), current(data), end(data + size), ok(true){};
+
+  const uint8_t* read(size_t size);
+  template <typename T>
+  T readValue() {
+    T value{};
+    auto bytes = read(sizeof(T));
+    if (bytes != nullptr) memcpy(&value, bytes, sizeof(T));
+    return value;
+  }
+  void align();
+  // bytes left to read. every table entry takes at least one, so a count
+  // larger than this is corrupt.
+  size_t remaining() const { return end - current; }
+};
+
+uint64_t hashSource(const char* source, size_t length);
+
+// every function reachable from `script` must have been compiled eagerly.
+std::vector<uint8_t> serializeFunction(ObjFunction* script,
+                                       uint64_t sourceHash);
+// returns nullptr if `data` is not a well formed image of this version or
+// its code fails verifyFunction().
+ObjFunction* deserializeFunction(const uint8_t* data, size_t size,
+                                 uint64_t* sourceHash, Table* stringTable,
+                                 Obj** objects);
+
+// checks that running `function` can't read outside its code, constants,
+// upvalues, property caches or a stack frame of UINT8_COUNT slots, so a
+// corrupt image is rejected instead of crashing the VM. the functions in its
+// constants must already be loaded.
+bool verifyFunction(ObjFunction* function);
+
+// writes through a temporary file so readers never map a partial image.
+bool writeImageFile(const char* path, const std::vector<uint8_t>& image);
+
+bool isBytecodeFile(const char* path);
+bool writeBytecodeFile(const char* path, ObjFunction* script,
+                       uint64_t sourceHash);
+// maps `path` and loads the script it holds. a non-zero `sourceHash` must
+// match the hash recorded at compile time, otherwise the image is stale.
+ObjFunction* loadBytecodeFile(const char* path, uint64_t sourceHash,
+                              Table* stringTable, Obj** objects);
+
+#endif
@@ -0,0 +1,279 @@
+#include "channel.hpp"
+
+#include "object.hpp"
+#include "scheduler.hpp"
+#include "vm.hpp"
+
+Channel::Channel(size_t capacity, SharedKind elementKind)
+    : elementKind(elementKind),
+      sendPosition(0),
+      receivePosition(0),
+      closed(false),
+      changes(0),
+      waiting(0) {
+  size_t size = 2;
+  while (size < capacity) size <<= 1;
+  mask = size - 1;
+  cells.reset(new Cell[size]);
+  for (size_t i = 0; i < size; i++) {
+    cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool Channel::trySend(SharedValue* value) {
+  size_t position = sendPosition.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells[position & mask];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t turn = (intptr_t)sequence - (intptr_t)position;
+    if (turn == 0) {
+      if (sendPosition.compare_exchange_weak(position, position + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (turn < 0) {
+      return false;  // a full lap ahead of the receivers
+    } else {
+      position = sendPosition.load(std::memory_order_relaxed);
+    }
+  }
+  cell->value = std::move(*value);
+  cell->sequence.store(position + 1, std::memory_order_release);
+  notify();
+  return true;
+}
+
+bool Channel::tryReceive(SharedValue* value) {
+  size_t position = receivePosition.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells[position & mask];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t turn = (intptr_t)sequence - (intptr_t)(position + 1);
+    if (turn == 0) {
+      if (receivePosition.compare_exchange_weak(position, position + 1,
+                                                std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (turn < 0) {
+      return false;  // nothing sent into this cell yet
+    } else {
+      position = receivePosition.load(std::memory_order_relaxed);
+    }
+  }
+  *value = std::move(cell->value);
+  cell->value = SharedValue();
+  cell->sequence.store(position + mask + 1, std::memory_order_release);
+  notify();
+  return true;
+}
+
+void Channel::close() {
+  closed.store(true, std::memory_order_release);
+  notify();
+}
+
+void Channel::notify() {
+  changes++;
+  if (waiting.load() == 0) return;
+
+  std::vector<std::function<void()>> woken;
+  {
+    std::lock_guard<std::mutex> lock(waitMutex);
+    woken.swap(parked);
+    waiting -= woken.size();
+  }
+  changed.notify_all();
+  for (auto& wake : woken) wake();
+}
+
+void Channel::waitFor(uint64_t version) {
+  std::unique_lock<std::mutex> lock(waitMutex);
+  waiting++;
+  changed.wait(lock, [&] { return changes.load() != version; });
+  waiting--;
+}
+
+bool Channel::park(uint64_t version, std::function<void()> wake) {
+  std::lock_guard<std::mutex> lock(waitMutex);
+  waiting++;
+  if (changes.load() != version) {
+    waiting--;
+    return false;
+  }
+  parked.push_back(std::move(wake));
+  return true;
+}
+
+// a full or empty channel makes the caller wait for it to change since
+// `version`. a scheduler task's fiber is parked on the channel and its
+// worker runs other tasks until the change resumes it, retrying the call;
+// anything else sleeps on its thread. returns true if the fiber was parked,
+// false if the call should try again right away.
+static bool wait(VM* vm, Channel* channel, uint64_t version) {
+  if (vm->worker != nullptr && vm->fiber != nullptr &&
+      vm->fiber->caller == nullptr) {
+    Worker* worker = vm->worker;
+    Resume resume{worker->index, vm->fiber, worker->running, nullptr};
+    if (!channel->park(version, [=] { worker->resume(resume); })) {
+      return false;
+    }
+    // back to the OP_CALL or OP_INVOKE. the resume can't run before the
+    // fiber is suspended, it goes to this same worker.
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    frame->ip = frame->callStart;
+    worker->blocked = true;
+    vm->suspendFiber(NIL_VAL);
+    return true;
+  }
+  channel->waitFor(version);
+  return false;
+}
+
+// the names channel() knows element kinds by.
+static const struct {
+  const char* name;
+  SharedKind kind;
+} elementKinds[] = {
+    {"bool", SHARED_BOOL},
+    {"number", SHARED_NUMBER},
+    {"string", SHARED_STRING},
+    {"task", SHARED_TASK},
+    {"channel", SHARED_CHANNEL},
+    {"buffer", SHARED_BUFFER},
+};
+
+static const char* elementKindName(SharedKind kind) {
+  for (auto& element : elementKinds) {
+    if (element.kind == kind) return element.name;
+  }
+  return "nil";
+}
+
+// channel(capacity) makes a channel holding up to `capacity` values, rounded
+// up to a power of two. channel(capacity, type) makes one that only takes
+// values of `type`: "bool", "number", "string", "task", "channel" or
+// "buffer".
+bool channelNative(VM* vm, int argCount, Value* args) {
+  // written so that NaN fails the check too.
+  if ((argCount != 1 && argCount != 2) || !IS_NUMBER(args[0]) ||
+      !(AS_NUMBER(args[0]) >= 1 && AS_NUMBER(args[0]) <= (1 << 24))) {
+    vm->runtimeError(
+        "channel() takes a capacity between 1 and 16777216, and optionally a "
+        "type.");
+    return false;
+  }
+  SharedKind elementKind = SHARED_ANY;
+  if (argCount == 2) {
+    for (auto& element : elementKinds) {
+      if (IS_STRING(args[1]) && AS_STRING(args[1])->str == element.name) {
+        elementKind = element.kind;
+      }
+    }
+    if (elementKind == SHARED_ANY) {
+      vm->runtimeError(
+          "A channel's type is \"bool\", \"number\", \"string\", \"task\", "
+          "\"channel\" or \"buffer\".");
+      return false;
+    }
+  }
+  auto channel =
+      std::make_shared<Channel>((size_t)AS_NUMBER(args[0]), elementKind);
+  vm->stack_top -= argCount + 1;
+  vm->push(OBJ_VAL(allocateChannelObject(std::move(channel), &vm->objects)));
+  return true;
+}
+
+// send(channel, value) waits for room and evaluates to nil.
+bool sendNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_CHANNEL(args[0])) {
+    vm->runtimeError("send() takes a channel and a value.");
+    return false;
+  }
+  if (!SharedValue::sendable(args[1])) {
+    vm->runtimeError(
+        "send() can only pass nil, a boolean, a number, a string, a task, a "
+        "channel or a buffer.");
+    return false;
+  }
+  Channel* channel = AS_CHANNEL(args[0]).get();
+  if (!channel->accepts(SharedValue::kindOf(args[1]))) {
+    vm->runtimeError("send() on a channel of type %s got a %s.",
+                     elementKindName(channel->elementKind),
+                     elementKindName(SharedValue::kindOf(args[1])));
+    return false;
+  }
+  SharedValue value;
+  SharedValue::from(args[1], &value);
+  while (true) {
+    if (channel->isClosed()) {
+      vm->runtimeError("Cannot send on a closed channel.");
+      return false;
+    }
+    uint64_t version = channel->version();
+    if (channel->trySend(&value)) break;
+    if (wait(vm, channel, version)) {
+      // the call runs again once resumed, and needs the buffer back.
+      if (value.kind == SHARED_BUFFER) {
+        AS_BUFFER(args[1])->values = std::move(value.buffer);
+      }
+      return true;
+    }
+  }
+  vm->stack_top -= argCount + 1;
+  vm->push(NIL_VAL);
+  return true;
+}
+
+// receive(channel) waits for a value. once the channel is closed and
+// drained it evaluates to nil.
+bool receiveNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_CHANNEL(args[0])) {
+    vm->runtimeError("receive() takes a channel.");
+    return false;
+  }
+  Channel* channel = AS_CHANNEL(args[0]).get();
+  SharedValue value;
+  while (true) {
+    uint64_t version = channel->version();
+    if (channel->tryReceive(&value)) break;
+    if (channel->isClosed()) {
+      // a value may have landed between the failed receive and the close.
+      channel->tryReceive(&value);
+      break;
+    }
+    if (wait(vm, channel, version)) return true;
+  }
+  vm->stack_top -= argCount + 1;
+  vm->push(value.take(vm));
+  return true;
+}
+
+// close(channel) lets receivers finish once the channel is drained.
+bool closeNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_CHANNEL(args[0])) {
+    vm->runtimeError("close() takes a channel.");
+    return false;
+  }
+  AS_CHANNEL(args[0])->close();
+  vm->stack_top -= argCount + 1;
+  vm->push(NIL_VAL);
+  return true;
+}
+
+void defineChannelNatives(VM* vm) {
+  vm->defineNative("channel", 7, channelNative);
+  vm->defineNative("send", 4, sendNative);
+  vm->defineNative("receive", 7, receiveNative);
+  vm->defineNative("close", 5, closeNative);
+}
+
+void defineChannel(VM* vm, const char* name, std::shared_ptr<Channel> channel) {
+  vm->push(OBJ_VAL(
+      allocateStringObject(name, strlen(name), &vm->strings, &vm->objects)));
+  vm->push(OBJ_VAL(allocateChannelObject(std::move(channel), &vm->objects)));
+  vm->globals.set(AS_STRING(vm->peek(1)), vm->peek(0));
+  vm->pop();
+  vm->pop();
+}
@@ -0,0 +1,87 @@
+#ifndef cpplox_channel_h
+#define cpplox_channel_h
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common.hpp"
+#include "shared_value.hpp"
+
+class VM;
+
+// a bounded queue that any number of VMs, on any threads, send to and
+// receive from without locks. every cell carries a sequence number that says
+// whose turn it is: a sender may fill cell i when its sequence equals the
+// send position, a receiver may empty it once it is one past. values are
+// moved in and out, so a string's shared storage and a buffer's doubles are
+// never copied on the way. a caller that finds the channel full or empty
+// waits for the next send, receive or close: a thread sleeps on a condition
+// variable, a scheduler task is parked until one wakes it.
+class Channel {
+ public:
+  // rounded up to a power of two, and at least 2.
+  explicit Channel(size_t capacity, SharedKind elementKind = SHARED_ANY);
+
+  // the kind of value send() takes, SHARED_ANY for all of them. the host
+  // checks it, trySend() doesn't.
+  const SharedKind elementKind;
+  bool accepts(SharedKind kind) {
+    return elementKind == SHARED_ANY || kind == elementKind;
+  }
+
+  // false if the channel is full. takes `*value` on success.
+  bool trySend(SharedValue* value);
+  // false if the channel is empty.
+  bool tryReceive(SharedValue* value);
+
+  // receivers drain what is left and then get nil, sends fail.
+  void close();
+  bool isClosed() { return closed.load(std::memory_order_acquire); }
+  size_t capacity() { return mask + 1; }
+
+  // counts sends, receives and closes. read it before trying one of them, to
+  // wait for whatever happens after the try.
+  uint64_t version() { return changes.load(); }
+  // returns once the channel has changed since `version`.
+  void waitFor(uint64_t version);
+  // has `wake` called, once, when the channel changes since `version`. false
+  // if it already has, and `wake` is dropped.
+  bool park(uint64_t version, std::function<void()> wake);
+
+ private:
+  class Cell {
+   public:
+    std::atomic<size_t> sequence;
+    SharedValue value;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  // kept on separate cache lines so senders and receivers don't contend.
+  alignas(64) std::atomic<size_t> sendPosition;
+  alignas(64) std::atomic<size_t> receivePosition;
+  alignas(64) std::atomic<bool> closed;
+
+  // every change bumps `changes` and then, if anyone waits, wakes them all.
+  // waiters count themselves in before they check `changes`, so one of the
+  // two always sees the other.
+  alignas(64) std::atomic<uint64_t> changes;
+  std::atomic<int> waiting;
+  std::mutex waitMutex;
+  std::condition_variable changed;
+  std::vector<std::function<void()>> parked;
+
+  void notify();
+};
+
+// channel(), send(), receive() and close() in `vm`.
+void defineChannelNatives(VM* vm);
+// makes `channel` the global `name` in `vm`, so that isolates set up by the
+// host can talk to each other.
+void defineChannel(VM* vm, const char* name, std::shared_ptr<Channel> channel);
+
+#endif
@@ -4,6 +4,9 @@
 #include "common.hpp"
 #include "value.hpp"
 
+// bytecode images and snapshots store these numbers. an older cpplox would
+// run an opcode it doesn't know, so adding one, even at the end, means
+// raising BYTECODE_VERSION and SNAPSHOT_VERSION.
 enum OptCode : uint8_t {
   OP_RETURN,
   OP_NOT,
@@ -34,6 +37,28 @@ enum OptCode : uint8_t {
   OP_LOOP,
   OP_CALL,
   OP_CLOSURE,
+  OP_STACK_CLOSURE,
+  OP_YIELD,
+  OP_ARRAY,
+  OP_GET_INDEX,
+  OP_SET_INDEX,
+  OP_CLASS,
+  OP_INHERIT,
+  OP_METHOD,
+  // name constant, then the big-endian index of the instruction's
+  // PropertyCache.
+  OP_GET_PROPERTY,
+  OP_SET_PROPERTY,
+  OP_GET_SUPER,
+  // a method call: name constant, u16 cache index, argument count.
+  OP_INVOKE,
+  // name constant, argument count.
+  OP_SUPER_INVOKE,
+  // the step of a counted loop: adds one to the local in the first operand
+  // and jumps back by the u16 offset while it is less than the limit, a local
+  // or a constant in the second operand.
+  OP_FOR_LOCAL,
+  OP_FOR_CONSTANT,
 };
 
 class Chunk {
@@ -1,68 +1,100 @@
 
 #include "compiler.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "number.hpp"
+
 #ifdef DEBUG_PRINT_CODE
 #include "debug.hpp"
 #endif
 
-ParseRule parseRules[TokenType::TOKEN_TYPE_NUMS];
-ParseRule* getRule(TokenType type) { return &parseRules[type]; };
-
-void initializeParseRules() {
-  parseRules[TOKEN_LEFT_PAREN] = ParseRule{grouping, call, PREC_CALL};
-  parseRules[TOKEN_RIGHT_PAREN] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_LEFT_BRACE] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_RIGHT_BRACE] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_COMMA] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_DOT] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_MINUS] = ParseRule{unary, binary, PREC_TERM};
-  parseRules[TOKEN_PLUS] = ParseRule{NULL, binary, PREC_TERM};
-  parseRules[TOKEN_SEMICOLON] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_SLASH] = ParseRule{NULL, binary, PREC_FACTOR};
-  parseRules[TOKEN_STAR] = ParseRule{NULL, binary, PREC_FACTOR};
-  parseRules[TOKEN_BANG] = ParseRule{unary, NULL, PREC_NONE};
-  parseRules[TOKEN_BANG_EQUAL] = ParseRule{NULL, binary, PREC_EQUALITY};
-  parseRules[TOKEN_EQUAL] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_EQUAL_EQUAL] = ParseRule{NULL, binary, PREC_EQUALITY};
-  parseRules[TOKEN_GREATER] = ParseRule{NULL, binary, PREC_COMPARISON};
-  parseRules[TOKEN_GREATER_EQUAL] = ParseRule{NULL, binary, PREC_COMPARISON};
-  parseRules[TOKEN_LESS] = ParseRule{NULL, binary, PREC_COMPARISON};
-  parseRules[TOKEN_LESS_EQUAL] = ParseRule{NULL, binary, PREC_COMPARISON};
-  parseRules[TOKEN_IDENTIFIER] = ParseRule{variable, NULL, PREC_NONE};
-  parseRules[TOKEN_STRING] = ParseRule{string, NULL, PREC_NONE};
-  parseRules[TOKEN_NUMBER] = ParseRule{number, NULL, PREC_NONE};
-  parseRules[TOKEN_AND] = ParseRule{NULL, andOp, PREC_AND};
-  parseRules[TOKEN_CLASS] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_ELSE] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_FALSE] = ParseRule{literal, NULL, PREC_NONE};
-  parseRules[TOKEN_FOR] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_FUN] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_IF] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_NIL] = ParseRule{literal, NULL, PREC_NONE};
-  parseRules[TOKEN_OR] = ParseRule{NULL, orOp, PREC_OR};
-  parseRules[TOKEN_PRINT] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_RETURN] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_SUPER] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_THIS] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_TRUE] = ParseRule{literal, NULL, PREC_NONE};
-  parseRules[TOKEN_VAR] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_WHILE] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_ERROR] = ParseRule{NULL, NULL, PREC_NONE};
-  parseRules[TOKEN_EOF] = ParseRule{NULL, NULL, PREC_NONE};
-}
-
-Compiler::Compiler(const char* source, FunctionType functionType,
-                   Table* stringTable, Obj** objects)
-    : scanner(new Scanner(source)),
-      objects(objects),
+// indexed by TokenType, one rule per token in declaration order.
+constexpr ParseRule parseRules[] = {
+    {TOKEN_LEFT_PAREN, grouping, call, PREC_CALL},
+    {TOKEN_RIGHT_PAREN, NULL, NULL, PREC_NONE},
+    {TOKEN_LEFT_BRACE, NULL, NULL, PREC_NONE},
+    {TOKEN_RIGHT_BRACE, NULL, NULL, PREC_NONE},
+    {TOKEN_LEFT_BRACKET, array, subscript, PREC_CALL},
+    {TOKEN_RIGHT_BRACKET, NULL, NULL, PREC_NONE},
+    {TOKEN_COMMA, NULL, NULL, PREC_NONE},
+    {TOKEN_DOT, NULL, dot, PREC_CALL},
+    {TOKEN_MINUS, unary, binary, PREC_TERM},
+    {TOKEN_PLUS, NULL, binary, PREC_TERM},
+    {TOKEN_SEMICOLON, NULL, NULL, PREC_NONE},
+    {TOKEN_SLASH, NULL, binary, PREC_FACTOR},
+    {TOKEN_STAR, NULL, binary, PREC_FACTOR},
+    {TOKEN_BANG, unary, NULL, PREC_NONE},
+    {TOKEN_BANG_EQUAL, NULL, binary, PREC_EQUALITY},
+    {TOKEN_EQUAL, NULL, NULL, PREC_NONE},
+    {TOKEN_EQUAL_EQUAL, NULL, binary, PREC_EQUALITY},
+    {TOKEN_GREATER, NULL, binary, PREC_COMPARISON},
+    {TOKEN_GREATER_EQUAL, NULL, binary, PREC_COMPARISON},
+    {TOKEN_LESS, NULL, binary, PREC_COMPARISON},
+    {TOKEN_LESS_EQUAL, NULL, binary, PREC_COMPARISON},
+    {TOKEN_IDENTIFIER, variable, NULL, PREC_NONE},
+    {TOKEN_STRING, string, NULL, PREC_NONE},
+    {TOKEN_NUMBER, number, NULL, PREC_NONE},
+    {TOKEN_AND, NULL, andOp, PREC_AND},
+    {TOKEN_CLASS, NULL, NULL, PREC_NONE},
+    {TOKEN_ELSE, NULL, NULL, PREC_NONE},
+    {TOKEN_FALSE, literal, NULL, PREC_NONE},
+    {TOKEN_FOR, NULL, NULL, PREC_NONE},
+    {TOKEN_FUN, NULL, NULL, PREC_NONE},
+    {TOKEN_IF, NULL, NULL, PREC_NONE},
+    {TOKEN_NIL, literal, NULL, PREC_NONE},
+    {TOKEN_OR, NULL, orOp, PREC_OR},
+    {TOKEN_PRINT, NULL, NULL, PREC_NONE},
+    {TOKEN_RETURN, NULL, NULL, PREC_NONE},
+    {TOKEN_SUPER, super_, NULL, PREC_NONE},
+    {TOKEN_THIS, this_, NULL, PREC_NONE},
+    {TOKEN_TRUE, literal, NULL, PREC_NONE},
+    {TOKEN_VAR, NULL, NULL, PREC_NONE},
+    {TOKEN_WHILE, NULL, NULL, PREC_NONE},
+    {TOKEN_YIELD, NULL, NULL, PREC_NONE},
+    {TOKEN_ERROR, NULL, NULL, PREC_NONE},
+    {TOKEN_EOF, NULL, NULL, PREC_NONE},
+};
+
+constexpr bool parseRulesComplete() {
+  if (sizeof(parseRules) / sizeof(parseRules[0]) != TOKEN_TYPE_NUMS) {
+    return false;
+  }
+  for (int i = 0; i < TOKEN_TYPE_NUMS; i++) {
+    if (parseRules[i].type != i) return false;
+  }
+  return true;
+}
+static_assert(parseRulesComplete(),
+              "parseRules needs exactly one rule per token, in order");
+
+const ParseRule* getRule(TokenType type) { return &parseRules[type]; };
+
+// a name the compiler refers to without it appearing in the source.
+static Token syntheticToken(const char* text) {
+  Token token;
+  token.type = TOKEN_IDENTIFIER;
+  token.start = text;
+  token.length = (int)strlen(text);
+  token.line = 0;
+  return token;
+}
+
+Compiler::Compiler(const char* source, size_t length,
+                   FunctionType functionType, Table* stringTable,
+                   Obj** objects)
+    : scanner(new Scanner(source, length)),
+      parser(new Parser{}),
       stringTable(stringTable),
+      objects(objects),
+      functionType(functionType),
       localCount(0),
       scopeDepth(0),
-      functionType(functionType),
-      parser(new Parser{}),
+      sharesUpvalues(false),
+      lazy(false),
       enclosing(nullptr) {
-  initializeParseRules();
-
   function = allocateFunctionObject(objects);
   Local* local = &locals[localCount++];
   local->depth = 0;
@@ -72,12 +104,14 @@ Compiler::Compiler(const char* source, FunctionType functionType,
 
 Compiler::Compiler(Compiler* parent, FunctionType functionType)
     : scanner(parent->scanner),
-      objects(parent->objects),
+      parser(parent->parser),
       stringTable(parent->stringTable),
+      objects(parent->objects),
+      functionType(functionType),
       localCount(0),
       scopeDepth(0),
-      functionType(functionType),
-      parser(parent->parser),
+      sharesUpvalues(false),
+      lazy(parent->lazy),
       enclosing(parent) {
   function = allocateFunctionObject(objects);
 
@@ -85,11 +119,33 @@ Compiler::Compiler(Compiler* parent, FunctionType functionType)
     function->name =
         new ObjString(parser->previous.start, parser->previous.length);
   }
+  reserveReceiver();
+}
+
+Compiler::Compiler(ObjFunction* function, Table* stringTable, Obj** objects)
+    : scanner(new Scanner(function->lazy->start, function->lazy->end)),
+      parser(new Parser{}),
+      stringTable(stringTable),
+      objects(objects),
+      functionType((FunctionType)function->lazy->functionType),
+      function(function),
+      localCount(0),
+      scopeDepth(0),
+      sharesUpvalues(false),
+      lazy(true),
+      enclosing(nullptr) {
+  scanner->line = function->lazy->line;
+  reserveReceiver();
+}
 
+// slot zero holds the callee, or the receiver as `this` in a method.
+void Compiler::reserveReceiver() {
+  bool isMethod =
+      functionType == TYPE_METHOD || functionType == TYPE_INITIALIZER;
   Local* local = &locals[localCount++];
   local->depth = 0;
-  local->name.start = "";
-  local->name.length = 0;
+  local->name.start = isMethod ? "this" : "";
+  local->name.length = isMethod ? 4 : 0;
 }
 
 ObjFunction* Compiler::compile() {
@@ -99,9 +155,116 @@ ObjFunction* Compiler::compile() {
   }
 
   ObjFunction* function = endCompiler();
+  if (!deferred.empty() && !compileDeferred()) parser->hadError = true;
   return parser->hadError ? NULL : function;
 }
 
+// a top-level function can't capture anything, so its body compiles the same
+// no matter what the script around it looks like. the script pass only
+// brace-matches the body and emits the closure; a worker compiles it later.
+void Compiler::deferFunction() {
+  auto child = Compiler(this, TYPE_FUNCTION);
+  child.function->lazy = new LazyBody(parser->current.start, scanner->end,
+                                      parser->current.line, TYPE_FUNCTION);
+
+  // parameters are checked by the worker.
+  while (!check(TOKEN_LEFT_BRACE) && !check(TOKEN_EOF)) advance();
+  int depth = 0;
+  while (!check(TOKEN_EOF)) {
+    if (check(TOKEN_LEFT_BRACE)) depth++;
+    if (check(TOKEN_RIGHT_BRACE) && --depth == 0) break;
+    advance();
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+
+  deferred.push_back(child.function);
+  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(child.function)));
+}
+
+// every worker allocates into its own object list; the lists and the staged
+// strings are handed to the VM once all bodies are compiled.
+bool Compiler::compileDeferred() {
+  StringStaging strings(stringTable);
+  int threadCount = std::min<int>(workers, deferred.size());
+  std::vector<Obj*> workerObjects(threadCount, nullptr);
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < threadCount; i++) {
+    threads.emplace_back([&, i] {
+      for (size_t j; (j = next++) < deferred.size();) {
+        ObjFunction* function = deferred[j];
+        auto body = Compiler(function, stringTable, &workerObjects[i]);
+        body.lazy = false;
+        body.staging = &strings;
+        if (!body.compileLazyBody()) failed = true;
+        body.freeCompiler();
+        delete function->lazy;
+        function->lazy = nullptr;
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  for (Obj* list : workerObjects) {
+    while (list != nullptr) {
+      Obj* object = list;
+      list = list->next;
+      object->next = *objects;
+      *objects = object;
+    }
+  }
+  strings.merge(objects);
+  deferred.clear();
+  return !failed;
+}
+
+ObjString* StringStaging::intern(const char* chars, int length) {
+  auto string = new ObjString(chars, length);
+  string->isMarked = false;
+  auto found = strings->findString(string);
+  if (found == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex);
+    found = staged.findString(string);
+    if (found == nullptr) {
+      string->next = objects;
+      objects = string;
+      staged.set(string, NIL_VAL);
+      return string;
+    }
+  }
+  delete string;
+  return found;
+}
+
+void StringStaging::merge(Obj** objects) {
+  auto entries = staged.entries;
+  for (size_t i = 0; i < entries->capacity(); i++) {
+    if ((*entries)[i].key != NULL) strings->set((*entries)[i].key, NIL_VAL);
+  }
+  while (this->objects != nullptr) {
+    Obj* object = this->objects;
+    this->objects = object->next;
+    object->next = *objects;
+    *objects = object;
+  }
+}
+
+// the span starts at the parameter list. upvalues resolve through the names
+// recorded when the function was preparsed, so the indexes match the
+// OP_CLOSURE operands its enclosing function was compiled with.
+bool Compiler::compileLazyBody() {
+  advance();
+  beginScope();
+  function->arity = 0;
+  parameterList();
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block();
+  endCompiler();
+  return !parser->hadError;
+}
+
 bool Compiler::match(TokenType type) {
   if (!check(type)) return false;
   advance();
@@ -111,7 +274,9 @@ bool Compiler::match(TokenType type) {
 bool Compiler::check(TokenType type) { return parser->current.type == type; }
 
 void Compiler::declaration() {
-  if (match(TOKEN_FUN)) {
+  if (match(TOKEN_CLASS)) {
+    classDeclaration();
+  } else if (match(TOKEN_FUN)) {
     functionDeclaration();
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
@@ -122,36 +287,86 @@ void Compiler::declaration() {
   if (parser->panicMode) synchronize();
 }
 
+// the class is bound to its name before the body, so methods can refer to it.
+// with a superclass, the body sits in a scope holding it as `super`.
+void Compiler::classDeclaration() {
+  consume(TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser->previous;
+  uint8_t nameConstant = identifierConstant(&className);
+  if (scopeDepth > 0) declareVariable();
+
+  emitBytes(OP_CLASS, nameConstant);
+  defineVariable(nameConstant);
+
+  bool hasSuperclass = match(TOKEN_LESS);
+  if (hasSuperclass) {
+    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(this, false);
+    if (identifiersEqual(&className, &parser->previous)) {
+      error("A class cannot inherit from itself.");
+    }
+    beginScope();
+    addLocal(syntheticToken("super"));
+    defineVariable(0);
+    namedVariable(className, false);
+    emitByte(OP_INHERIT);
+  }
+
+  namedVariable(className, false);
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) method();
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(OP_POP);
+
+  if (hasSuperclass) endScope();
+}
+
+void Compiler::method() {
+  consume(TOKEN_IDENTIFIER, "Expect method name.");
+  Token* name = &parser->previous;
+  uint8_t constant = identifierConstant(name);
+  bool isInitializer = name->length == 4 && memcmp(name->start, "init", 4) == 0;
+  compileFunction(isInitializer ? TYPE_INITIALIZER : TYPE_METHOD);
+  emitBytes(OP_METHOD, constant);
+}
+
 void Compiler::functionDeclaration() {
   uint8_t global = parseVariable("Expect function name.");
   markInitialized();
-  compileFunction(TYPE_FUNCTION);
+  if (workers > 0 && !lazy && enclosing == nullptr && scopeDepth == 0) {
+    deferFunction();
+    defineVariable(global);
+    return;
+  }
+
+  int closureOffset = function->chunk.count();
+  bool frameAllocatable = compileFunction(TYPE_FUNCTION);
+  if (scopeDepth > 0 && frameAllocatable) {
+    locals[localCount - 1].closureOffset = closureOffset;
+  }
   defineVariable(global);
 }
 
-void Compiler::compileFunction(FunctionType type) {
+// returns false if the compiled closure must live on the heap regardless of
+// how the enclosing function uses it.
+bool Compiler::compileFunction(FunctionType type) {
   auto child = Compiler(this, type);
   child.beginScope();
-  child.consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-  if (!child.check(TOKEN_RIGHT_PAREN)) {
-    do {
-      child.function->arity++;
-      if (child.function->arity > 255) {
-        child.errorAtCurrent("Cannot have more than 255 parameters.");
-      }
-
-      uint8_t paramConstant = child.parseVariable("Expect parameter name.");
-      child.defineVariable(paramConstant);
-    } while (child.match(TOKEN_COMMA));
-  }
-
-  child.consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  const char* start = parser->current.start;
+  int line = parser->current.line;
+  child.parameterList();
 
   // The body.
   child.consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  child.block();
-
-  ObjFunction* function = child.endCompiler();
+  ObjFunction* function;
+  if (lazy) {
+    child.function->lazy = new LazyBody(start, scanner->end, line, type);
+    child.preparseBody();
+    function = child.function;
+  } else {
+    child.block();
+    function = child.endCompiler();
+  }
 
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
@@ -159,6 +374,52 @@ void Compiler::compileFunction(FunctionType type) {
     emitByte(child.upvalues[i].isLocal ? 1 : 0);
     emitByte(child.upvalues[i].index);
   }
+  return !child.sharesUpvalues;
+}
+
+void Compiler::parameterList() {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      function->arity++;
+      if (function->arity > 255) {
+        errorAtCurrent("Cannot have more than 255 parameters.");
+      }
+
+      uint8_t paramConstant = parseVariable("Expect parameter name.");
+      defineVariable(paramConstant);
+    } while (match(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+}
+
+// skips the body up to its matching brace. every identifier that isn't a
+// parameter is resolved against the enclosing functions, so the closure
+// captures whatever the body could refer to once it is compiled. names that
+// turn out to be body locals or properties are captured needlessly but
+// harmlessly.
+void Compiler::preparseBody() {
+  int depth = 1;
+  while (!check(TOKEN_EOF)) {
+    if (check(TOKEN_LEFT_BRACE)) {
+      depth++;
+    } else if (check(TOKEN_RIGHT_BRACE)) {
+      if (--depth == 0) break;
+    } else if (check(TOKEN_FUN)) {
+      // a nested closure may copy our upvalues once the body is compiled.
+      sharesUpvalues = true;
+    } else if ((check(TOKEN_IDENTIFIER) || check(TOKEN_THIS) ||
+                check(TOKEN_SUPER)) &&
+               resolveLocal(&parser->current) == -1) {
+      int upvalue = resolveUpvalue(&parser->current);
+      if (upvalue == (int)function->lazy->upvalueNames.size()) {
+        function->lazy->upvalueNames.push_back(parser->current);
+      }
+    }
+    advance();
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 void Compiler::statement() {
@@ -176,6 +437,8 @@ void Compiler::statement() {
     endScope();
   } else if (match(TOKEN_RETURN)) {
     returnStatement();
+  } else if (match(TOKEN_YIELD)) {
+    yieldStatement();
   } else {
     expressionStatement();
   }
@@ -224,6 +487,11 @@ void Compiler::forStatement() {
   if (match(TOKEN_SEMICOLON)) {
   } else if (match(TOKEN_VAR)) {
     varDeclaration();
+    if (isCountedLoop()) {
+      countedLoop();
+      endScope();
+      return;
+    }
   } else {
     expressionStatement();
   }
@@ -263,6 +531,87 @@ void Compiler::forStatement() {
   endScope();
 }
 
+// whether the clauses after the loop variable's declaration read
+// `i < limit; i = i + 1)`, with a number literal or another local as the
+// limit. only peeks at the tokens.
+bool Compiler::isCountedLoop() {
+  const int count = 10;
+  Token tokens[count];
+  tokens[0] = parser->current;
+  Scanner scanned = *scanner;
+  size_t nextToken = parser->nextToken;
+  int read = 1;
+  for (; read < count; read++) {
+    tokens[read] = parser->tokens != nullptr
+                       ? parser->tokens->at(parser->nextToken++)
+                       : scanner->scanToken();
+    if (tokens[read].type == TOKEN_ERROR || tokens[read].type == TOKEN_EOF) {
+      break;
+    }
+  }
+  *scanner = scanned;
+  parser->nextToken = nextToken;
+  if (read < count) return false;
+
+  static const TokenType pattern[count] = {
+      TOKEN_IDENTIFIER, TOKEN_LESS,       TOKEN_NUMBER,     TOKEN_SEMICOLON,
+      TOKEN_IDENTIFIER, TOKEN_EQUAL,      TOKEN_IDENTIFIER, TOKEN_PLUS,
+      TOKEN_NUMBER,     TOKEN_RIGHT_PAREN};
+  for (int i = 0; i < count; i++) {
+    if (i == 2 && tokens[i].type == TOKEN_IDENTIFIER) continue;
+    if (tokens[i].type != pattern[i]) return false;
+  }
+
+  Token* variable = &locals[localCount - 1].name;
+  if (!identifiersEqual(&tokens[0], variable) ||
+      !identifiersEqual(&tokens[4], variable) ||
+      !identifiersEqual(&tokens[6], variable)) {
+    return false;
+  }
+  if (tokens[8].length != 1 || tokens[8].start[0] != '1') return false;
+  if (tokens[2].type == TOKEN_IDENTIFIER) {
+    int limit = resolveLocal(&tokens[2]);
+    return limit != -1 && limit != localCount - 1;
+  }
+  return true;
+}
+
+// the condition is tested as usual before the first iteration. after that,
+// one instruction at the end of the body both steps the loop variable and
+// tests it. it reads both locals every time, so assigning either of them in
+// the body, or capturing them, works as in any other loop.
+void Compiler::countedLoop() {
+  int line = parser->current.line;
+  int counter = localCount - 1;
+  expression();
+  auto& code = function->chunk.code;
+  uint8_t instruction =
+      code[code.size() - 3] == OP_GET_LOCAL ? OP_FOR_LOCAL : OP_FOR_CONSTANT;
+  uint8_t limit = code[code.size() - 2];
+  consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  int exitJump = emitJump(OP_JUMP_IF_FALSE);
+  emitByte(OP_POP);
+  // the increment was checked to be `i = i + 1)`.
+  for (int i = 0; i < 6; i++) advance();
+
+  int bodyStart = function->chunk.count();
+  statement();
+
+  // the step reports errors on the line of the clauses.
+  function->chunk.write_chunk(instruction, line);
+  function->chunk.write_chunk(counter, line);
+  function->chunk.write_chunk(limit, line);
+  int offset = function->chunk.count() - bodyStart + 2;
+  if (offset > UINT16_MAX) error("Loop body too large.");
+  function->chunk.write_chunk((offset >> 8) & 0xff, line);
+  function->chunk.write_chunk(offset & 0xff, line);
+
+  int endJump = emitJump(OP_JUMP);
+  patchJump(exitJump);
+  emitByte(OP_POP);  // Condition.
+  patchJump(endJump);
+}
+
 void Compiler::emitLoop(int loopStart) {
   emitByte(OP_LOOP);
 
@@ -302,6 +651,7 @@ void Compiler::beginScope() { scopeDepth++; }
 void Compiler::endScope() {
   scopeDepth--;
   while (localCount > 0 && locals[localCount - 1].depth > scopeDepth) {
+    allocateInFrame(&locals[localCount - 1]);
     if (locals[localCount - 1].isCaptured) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
@@ -311,6 +661,13 @@ void Compiler::endScope() {
   }
 }
 
+// the local goes out of scope without its closure ever being stored, returned
+// or captured, so the closure can't outlive the current frame.
+void Compiler::allocateInFrame(Local* local) {
+  if (local->closureOffset == -1 || local->escapes) return;
+  function->chunk.code[local->closureOffset] = OP_STACK_CLOSURE;
+}
+
 void Compiler::varDeclaration() {
   uint8_t global = parseVariable("Expect variable name.");
 
@@ -337,7 +694,7 @@ void Compiler::namedVariable(Token name, bool canAssign) {
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(&name)) != -1) {
+  } else if ((arg = resolveUpvalue(&name, check(TOKEN_LEFT_PAREN))) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
@@ -350,6 +707,9 @@ void Compiler::namedVariable(Token name, bool canAssign) {
     expression();
     emitBytes(setOp, arg);
   } else {
+    if (getOp == OP_GET_LOCAL && !check(TOKEN_LEFT_PAREN)) {
+      locals[arg].escapes = true;
+    }
     emitBytes(getOp, arg);
   }
 }
@@ -364,17 +724,29 @@ int Compiler::resolveLocal(Token* name) {
   return -1;
 }
 
-int Compiler::resolveUpvalue(Token* name) {
-  if (enclosing == NULL) return -1;
+int Compiler::resolveUpvalue(Token* name, bool isCall) {
+  if (enclosing == NULL) {
+    if (function->lazy == nullptr) return -1;
+    auto& names = function->lazy->upvalueNames;
+    for (int i = 0; i < (int)names.size(); i++) {
+      if (identifiersEqual(&names[i], name)) return i;
+    }
+    return -1;
+  }
 
   int local = enclosing->resolveLocal(name);
   if (local != -1) {
     enclosing->locals[local].isCaptured = true;
+    // a function calling itself recursively does not leak its own closure.
+    bool isSelfCall = isCall && functionType == TYPE_FUNCTION &&
+                      local == enclosing->localCount - 1;
+    if (!isSelfCall) enclosing->locals[local].escapes = true;
     return addUpvalue((uint8_t)local, true);
   }
 
   int upvalue = enclosing->resolveUpvalue(name);
   if (upvalue != -1) {
+    enclosing->sharesUpvalues = true;
     return addUpvalue((uint8_t)upvalue, false);
   }
   return -1;
@@ -435,6 +807,8 @@ void Compiler::addLocal(Token name) {
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
+  local->closureOffset = -1;
+  local->escapes = false;
 }
 
 void Compiler::markInitialized() {
@@ -443,8 +817,12 @@ void Compiler::markInitialized() {
 }
 
 uint8_t Compiler::identifierConstant(const Token* name) {
-  return makeConstant(OBJ_VAL(
-      allocateStringObject(name->start, name->length, stringTable, objects)));
+  return makeConstant(OBJ_VAL(internString(name->start, name->length)));
+}
+
+ObjString* Compiler::internString(const char* chars, int length) {
+  if (staging != nullptr) return staging->intern(chars, length);
+  return allocateStringObject(chars, length, stringTable, objects);
 }
 
 void Compiler::printStatement() {
@@ -467,18 +845,38 @@ void Compiler::returnStatement() {
   if (match(TOKEN_SEMICOLON)) {
     emitReturn();
   } else {
+    if (functionType == TYPE_INITIALIZER) {
+      error("Cannot return a value from an initializer.");
+    }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
     emitByte(OP_RETURN);
   }
 }
 
+// suspends the running fiber and hands the value to whoever resumed it.
+void Compiler::yieldStatement() {
+  if (match(TOKEN_SEMICOLON)) {
+    emitByte(OP_NIL);
+  } else {
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after yield value.");
+  }
+  emitByte(OP_YIELD);
+}
+
+// an initializer always returns the new instance.
 void Compiler::emitReturn() {
-  emitByte(OP_NIL);
+  if (functionType == TYPE_INITIALIZER) {
+    emitBytes(OP_GET_LOCAL, 0);
+  } else {
+    emitByte(OP_NIL);
+  }
   emitByte(OptCode::OP_RETURN);
 };
 
 ObjFunction* Compiler::endCompiler() {
+  for (int i = localCount - 1; i > 0; i--) allocateInFrame(&locals[i]);
   emitReturn();
   ObjFunction* ret = function;
 #ifdef DEBUG_PRINT_CODE
@@ -495,7 +893,9 @@ void Compiler::advance() {
   parser->previous = parser->current;
 
   while (true) {
-    parser->current = scanner->scanToken();
+    parser->current = parser->tokens != nullptr
+                          ? parser->tokens->at(parser->nextToken++)
+                          : scanner->scanToken();
     if (parser->current.type != TokenType::TOKEN_ERROR) break;
 
     errorAtCurrent(parser->current.start);
@@ -514,6 +914,8 @@ void Compiler::errorAt(Token* token, const char* message) {
   if (parser->panicMode) return;
   parser->panicMode = true;
 
+  // keeps messages from parallel workers from interleaving.
+  flockfile(stderr);
   fprintf(stderr, "[line %d] Error", token->line);
 
   if (token->type == TokenType::TOKEN_EOF) {
@@ -525,6 +927,7 @@ void Compiler::errorAt(Token* token, const char* message) {
   }
 
   fprintf(stderr, ": %s\n", message);
+  funlockfile(stderr);
   parser->hadError = true;
 }
 void Compiler::synchronize() {
@@ -542,6 +945,7 @@ void Compiler::synchronize() {
       case TOKEN_WHILE:
       case TOKEN_PRINT:
       case TOKEN_RETURN:
+      case TOKEN_YIELD:
         return;
       default:;
     }
@@ -557,6 +961,17 @@ void Compiler::emitConstant(Value value) {
   emitBytes(OptCode::OP_CONSTANT, makeConstant(value));
 }
 
+// every property instruction gets a cache of its own, numbered in the order
+// they appear in the function.
+void Compiler::emitProperty(uint8_t instruction, uint8_t name) {
+  if (function->cacheCount > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+  }
+  int cache = function->cacheCount++;
+  emitBytes(instruction, name);
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
 uint8_t Compiler::makeConstant(Value value) {
   int constant = function->chunk.add_const(value);
   if (constant > UINT8_MAX) {
@@ -586,8 +1001,13 @@ void Compiler::parsePrecedence(Precedence precedence) {
 };
 
 void number(Compiler* compiler, bool canAssign) {
-  double value = strtod(compiler->parser->previous.start, NULL);
-  compiler->emitConstant(NUMBER_VAL(value));
+  auto token = &compiler->parser->previous;
+  double value;
+  if (!parseNumber(token->start, token->length, &value)) {
+    compiler->error("Invalid number.");
+    return;
+  }
+  compiler->emitConstant(packNumber(value));
 }
 
 void grouping(Compiler* compiler, bool canAssign) {
@@ -670,10 +1090,9 @@ void literal(Compiler* compiler, bool canAssign) {
 }
 
 void string(Compiler* compiler, bool canAssign) {
-  compiler->emitConstant(
-      OBJ_VAL(allocateStringObject(compiler->parser->previous.start + 1,
-                                   compiler->parser->previous.length - 2,
-                                   compiler->stringTable, compiler->objects)));
+  compiler->emitConstant(OBJ_VAL(
+      compiler->internString(compiler->parser->previous.start + 1,
+                             compiler->parser->previous.length - 2)));
 }
 
 void variable(Compiler* compiler, bool canAssign) {
@@ -705,6 +1124,82 @@ void call(Compiler* compiler, bool canAssign) {
   compiler->emitBytes(OP_CALL, argCount);
 }
 
+// [a, b, c] makes an array of its elements. a trailing comma is fine.
+void array(Compiler* compiler, bool canAssign) {
+  int count = 0;
+  while (!compiler->check(TOKEN_RIGHT_BRACKET)) {
+    compiler->expression();
+    if (count == 255) {
+      compiler->error("Cannot have more than 255 elements in an array.");
+    }
+    count++;
+    if (!compiler->match(TOKEN_COMMA)) break;
+  }
+  compiler->consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+  compiler->emitBytes(OP_ARRAY, count);
+}
+
+void subscript(Compiler* compiler, bool canAssign) {
+  compiler->expression();
+  compiler->consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+  if (canAssign && compiler->match(TOKEN_EQUAL)) {
+    compiler->expression();
+    compiler->emitByte(OP_SET_INDEX);
+  } else {
+    compiler->emitByte(OP_GET_INDEX);
+  }
+}
+
+void dot(Compiler* compiler, bool canAssign) {
+  compiler->consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = compiler->identifierConstant(&compiler->parser->previous);
+  if (canAssign && compiler->match(TOKEN_EQUAL)) {
+    compiler->expression();
+    compiler->emitProperty(OP_SET_PROPERTY, name);
+  } else if (compiler->match(TOKEN_LEFT_PAREN)) {
+    // calls the method without binding it first.
+    uint8_t argCount = compiler->argumentList();
+    compiler->emitProperty(OP_INVOKE, name);
+    compiler->emitByte(argCount);
+  } else {
+    compiler->emitProperty(OP_GET_PROPERTY, name);
+  }
+}
+
+// `this` is slot zero of a method, or an upvalue over it in a function
+// nested in one, and nothing anywhere else.
+void this_(Compiler* compiler, bool canAssign) {
+  Token name = compiler->parser->previous;
+  if (compiler->resolveLocal(&name) == -1 &&
+      compiler->resolveUpvalue(&name) == -1) {
+    compiler->error("Cannot use 'this' outside of a class.");
+    return;
+  }
+  compiler->namedVariable(name, false);
+}
+
+void super_(Compiler* compiler, bool canAssign) {
+  Token super = compiler->parser->previous;
+  if (compiler->resolveLocal(&super) == -1 &&
+      compiler->resolveUpvalue(&super) == -1) {
+    compiler->error("Cannot use 'super' outside of a class with a superclass.");
+  }
+  compiler->consume(TOKEN_DOT, "Expect '.' after 'super'.");
+  compiler->consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+  uint8_t name = compiler->identifierConstant(&compiler->parser->previous);
+
+  compiler->namedVariable(syntheticToken("this"), false);
+  if (compiler->match(TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = compiler->argumentList();
+    compiler->namedVariable(super, false);
+    compiler->emitBytes(OP_SUPER_INVOKE, name);
+    compiler->emitByte(argCount);
+  } else {
+    compiler->namedVariable(super, false);
+    compiler->emitBytes(OP_GET_SUPER, name);
+  }
+}
+
 uint8_t Compiler::argumentList() {
   uint8_t argCount = 0;
   if (!check(TOKEN_RIGHT_PAREN)) {
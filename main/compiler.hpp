@@ -1,14 +1,19 @@
 #ifndef cpplox_compiler_h
 #define cpplox_compiler_h
+#include <mutex>
+
 #include "chunk.hpp"
 #include "common.hpp"
 #include "object.hpp"
 #include "scanner.hpp"
 #include "table.hpp"
+#include "token_stream.hpp"
 
 enum FunctionType {
   TYPE_FUNCTION,
   TYPE_SCRIPT,
+  TYPE_METHOD,
+  TYPE_INITIALIZER,
 };
 
 enum Precedence {
@@ -31,6 +36,9 @@ class Parser {
   Token previous;
   bool hadError;
   bool panicMode;
+  // when set, tokens come from a pre-scanned stream instead of the scanner.
+  TokenStream* tokens = nullptr;
+  size_t nextToken = 0;
 };
 
 class Local {
@@ -38,6 +46,11 @@ class Local {
   Token name;
   int depth;
   bool isCaptured;
+  // offset of the OP_CLOSURE that defined this local via `fun`, or -1 when the
+  // closure has to stay on the heap.
+  int closureOffset = -1;
+  // set once the local is read anywhere other than as a callee.
+  bool escapes = false;
 };
 
 class Upvalue {
@@ -46,6 +59,21 @@ class Upvalue {
   bool isLocal;
 };
 
+// interns strings for compilers running on several threads. the VM's table is
+// only read while they run; new strings are staged under a lock and merged
+// into it once every worker is done.
+class StringStaging {
+ public:
+  Table* strings;
+  Table staged;
+  Obj* objects;
+  std::mutex mutex;
+  StringStaging(Table* strings) : strings(strings), objects(nullptr){};
+
+  ObjString* intern(const char* chars, int length);
+  void merge(Obj** objects);
+};
+
 class Compiler {
  public:
   Scanner* scanner;
@@ -60,18 +88,40 @@ class Compiler {
   Local locals[UINT8_COUNT];
   int localCount;
   int scopeDepth;
-
+  // true if a nested closure copies one of this function's upvalues, which
+  // forbids allocating this function's closure in its caller's frame.
+  bool sharesUpvalues;
+  // only preparse nested function bodies and compile them on first call.
+  bool lazy;
+  // when non-zero, top-level function bodies are skipped by the script pass
+  // and compiled afterwards on this many threads.
+  int workers = 0;
+  std::vector<ObjFunction*> deferred;
+  StringStaging* staging = nullptr;
+
+  Compiler(const char* source, size_t length, FunctionType functionType,
+           Table* stringTable, Obj** objects);
   Compiler(const char* source, FunctionType functionType, Table* stringTable,
-           Obj** objects);
+           Obj** objects)
+      : Compiler(source, strlen(source), functionType, stringTable, objects){};
 
   Compiler(const char* source, Table* stringTable, Obj** objects)
       : Compiler(source, FunctionType::TYPE_SCRIPT, stringTable, objects){};
+  Compiler(const char* source, size_t length, Table* stringTable, Obj** objects)
+      : Compiler(source, length, FunctionType::TYPE_SCRIPT, stringTable,
+                 objects){};
 
   Compiler* enclosing;
   Compiler(Compiler* parent, FunctionType type);
+  // compiles the body of a function that was only preparsed.
+  Compiler(ObjFunction* function, Table* stringTable, Obj** objects);
+  void reserveReceiver();
   void freeCompiler() { delete parser, delete scanner; };
 
   ObjFunction* compile();
+  bool compileLazyBody();
+  void deferFunction();
+  bool compileDeferred();
   void advance();
   void consume(TokenType type, const char* message);
   void emitByte(uint8_t byte);
@@ -82,6 +132,7 @@ class Compiler {
   void emitReturn();
   void emitConstant(Value value);
   uint8_t makeConstant(Value value);
+  void emitProperty(uint8_t instruction, uint8_t name);
 
   bool match(TokenType type);
   bool check(TokenType type);
@@ -91,17 +142,25 @@ class Compiler {
   void ifStatement();
   void whileStatement();
   void forStatement();
+  bool isCountedLoop();
+  void countedLoop();
   void returnStatement();
+  void yieldStatement();
   void block();
   void printStatement();
   void expressionStatement();
   void varDeclaration();
   void functionDeclaration();
+  void classDeclaration();
+  void method();
   void declareVariable();
-  void compileFunction(FunctionType type);
+  bool compileFunction(FunctionType type);
+  void parameterList();
+  void preparseBody();
   uint8_t argumentList();
   uint8_t parseVariable(const char* errorMessage);
   uint8_t identifierConstant(const Token* name);
+  ObjString* internString(const char* chars, int length);
   void defineVariable(uint8_t global);
   void namedVariable(Token name, bool canAssign);
 
@@ -110,10 +169,11 @@ class Compiler {
 
   void beginScope();
   void endScope();
+  void allocateInFrame(Local* local);
   void addLocal(Token name);
   void markInitialized();
   int resolveLocal(Token* name);
-  int resolveUpvalue(Token* name);
+  int resolveUpvalue(Token* name, bool isCall = false);
   int addUpvalue(uint8_t index, bool isLocal);
 
   int emitJump(uint8_t instruction);
@@ -139,6 +199,11 @@ void variable(Compiler* compiler, bool canAssign);
 void andOp(Compiler* compiler, bool canAssign);
 void orOp(Compiler* compiler, bool canAssign);
 void call(Compiler* compiler, bool canAssign);
+void array(Compiler* compiler, bool canAssign);
+void subscript(Compiler* compiler, bool canAssign);
+void dot(Compiler* compiler, bool canAssign);
+void this_(Compiler* compiler, bool canAssign);
+void super_(Compiler* compiler, bool canAssign);
 
 // parse rule table
 using ParseFn = void(Compiler*, bool);
@@ -146,14 +211,16 @@ using ParseFnPtr = ParseFn*;
 
 class ParseRule {
  public:
+  // the token this rule is for, so the table can be checked at compile time.
+  TokenType type;
   ParseFnPtr prefix;
   ParseFnPtr infix;
-  ParseRule(){};
-  ParseRule(ParseFnPtr pre, ParseFnPtr in, Precedence precedence)
-      : prefix(pre), infix(in), precedence(precedence){};
+  constexpr ParseRule(TokenType type, ParseFnPtr pre, ParseFnPtr in,
+                      Precedence precedence)
+      : type(type), prefix(pre), infix(in), precedence(precedence){};
   Precedence precedence;
 };
 
-void initializeParseRules();
+const ParseRule* getRule(TokenType type);
 
 #endif
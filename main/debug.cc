@@ -37,6 +37,43 @@ int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+  auto index = chunk->code[offset + 1];
+  int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s %4d '", name, index);
+  printValue(chunk->constants.values[index]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
+int invokeInstruction(const char* name, Chunk* chunk, int offset) {
+  auto index = chunk->code[offset + 1];
+  int cache = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  printf("%-16s (%d args) %4d '", name, chunk->code[offset + 4], index);
+  printValue(chunk->constants.values[index]);
+  printf("' cache %d\n", cache);
+  return offset + 5;
+}
+
+int superInvokeInstruction(Chunk* chunk, int offset) {
+  auto index = chunk->code[offset + 1];
+  printf("%-16s (%d args) %4d '", "OP_SUPER_INVOKE", chunk->code[offset + 2],
+         index);
+  printValue(chunk->constants.values[index]);
+  printf("'\n");
+  return offset + 3;
+}
+
+int forInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t counter = chunk->code[offset + 1];
+  uint8_t limit = chunk->code[offset + 2];
+  uint16_t jump =
+      (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+  printf("%-16s %4d %4d %4d -> %d\n", name, counter, limit, offset,
+         offset + 5 - jump);
+  return offset + 5;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
   if (offset > 0 && chunk->lines[offset - 1] == chunk->lines[offset]) {
@@ -102,10 +139,40 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
     case OptCode::OP_CLOSE_UPVALUE:
       return simpleInstruction("OP_CLOSE_UPVALUE", offset);
-    case OptCode::OP_CLOSURE: {
+    case OptCode::OP_YIELD:
+      return simpleInstruction("OP_YIELD", offset);
+    case OptCode::OP_ARRAY:
+      return byteInstruction("OP_ARRAY", chunk, offset);
+    case OptCode::OP_GET_INDEX:
+      return simpleInstruction("OP_GET_INDEX", offset);
+    case OptCode::OP_SET_INDEX:
+      return simpleInstruction("OP_SET_INDEX", offset);
+    case OptCode::OP_CLASS:
+      return constantInstruction("OP_CLASS", chunk, offset);
+    case OptCode::OP_INHERIT:
+      return simpleInstruction("OP_INHERIT", offset);
+    case OptCode::OP_METHOD:
+      return constantInstruction("OP_METHOD", chunk, offset);
+    case OptCode::OP_GET_PROPERTY:
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+    case OptCode::OP_SET_PROPERTY:
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+    case OptCode::OP_GET_SUPER:
+      return constantInstruction("OP_GET_SUPER", chunk, offset);
+    case OptCode::OP_FOR_LOCAL:
+      return forInstruction("OP_FOR_LOCAL", chunk, offset);
+    case OptCode::OP_FOR_CONSTANT:
+      return forInstruction("OP_FOR_CONSTANT", chunk, offset);
+    case OptCode::OP_INVOKE:
+      return invokeInstruction("OP_INVOKE", chunk, offset);
+    case OptCode::OP_SUPER_INVOKE:
+      return superInvokeInstruction(chunk, offset);
+    case OptCode::OP_CLOSURE:
+    case OptCode::OP_STACK_CLOSURE: {
       offset++;
       uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
+      printf("%-16s %4d ",
+             inst == OP_CLOSURE ? "OP_CLOSURE" : "OP_STACK_CLOSURE", constant);
       printValue(chunk->constants.values[constant]);
       printf("\n");
 
@@ -0,0 +1,175 @@
+#include "hash_map.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#include "object.hpp"
+#include "vm.hpp"
+
+#define INDEX_EMPTY -1
+#define INDEX_REMOVED -2
+#define MIN_INDEX_SIZE 8
+
+bool isMapKey(Value key) {
+  return IS_NIL(key) || IS_BOOL(key) || IS_STRING(key) ||
+         (IS_NUMBER(key) && !std::isnan(AS_NUMBER(key)));
+}
+
+// equal keys hash alike, so 0 and -0 hash as 0.
+static uint32_t hashKey(Value key) {
+  if (IS_STRING(key)) return AS_STRING(key)->hash;
+  if (IS_NIL(key)) return 0x9e3779b9u;
+  if (IS_BOOL(key)) return AS_BOOL(key) ? 0x85ebca6bu : 0xc2b2ae35u;
+
+  double number = AS_NUMBER(key) == 0 ? 0 : AS_NUMBER(key);
+  uint64_t bits;
+  memcpy(&bits, &number, sizeof(bits));
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+// the index slot holding `key`, or else the slot it would go in: the first
+// removed one on its probe sequence or the empty one that ends it.
+int32_t* ObjMap::find(Value key, uint32_t hash) {
+  size_t mask = index.size() - 1;
+  int32_t* reusable = nullptr;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    int32_t slot = index[i];
+    if (slot == INDEX_EMPTY) return reusable != nullptr ? reusable : &index[i];
+    if (slot == INDEX_REMOVED) {
+      if (reusable == nullptr) reusable = &index[i];
+    } else if (entries[slot].hash == hash &&
+               valuesEqual(entries[slot].key, key)) {
+      return &index[i];
+    }
+  }
+}
+
+bool ObjMap::get(Value key, Value* value) {
+  if (count == 0) return false;
+  int32_t slot = *find(key, hashKey(key));
+  if (slot < 0) return false;
+  *value = entries[slot].value;
+  return true;
+}
+
+void ObjMap::set(Value key, Value value) {
+  uint32_t hash = hashKey(key);
+  if (!index.empty()) {
+    int32_t slot = *find(key, hash);
+    if (slot >= 0) {
+      entries[slot].value = value;
+      return;
+    }
+  }
+  // every entry, removed or not, has used up an index slot. keep at least a
+  // quarter of them empty so probes stay short.
+  if ((entries.size() + 1) * 4 > index.size() * 3) rebuild();
+
+  *find(key, hash) = (int32_t)entries.size();
+  entries.push_back(Entry{key, value, hash, false});
+  count++;
+}
+
+bool ObjMap::remove(Value key) {
+  if (count == 0) return false;
+  int32_t* slot = find(key, hashKey(key));
+  if (*slot < 0) return false;
+  Entry& entry = entries[*slot];
+  entry.removed = true;
+  entry.key = entry.value = NIL_VAL;
+  *slot = INDEX_REMOVED;
+  count--;
+  if (entries.size() > MIN_INDEX_SIZE && entries.size() > count * 2) rebuild();
+  return true;
+}
+
+// drops removed entries and sizes the index for twice the live ones.
+void ObjMap::rebuild() {
+  size_t live = 0;
+  for (auto& entry : entries) {
+    if (!entry.removed) entries[live++] = entry;
+  }
+  entries.resize(live);
+
+  size_t size = MIN_INDEX_SIZE;
+  while (size < (live + 1) * 2) size *= 2;
+  index.assign(size, INDEX_EMPTY);
+  for (size_t i = 0; i < live; i++) {
+    *find(entries[i].key, entries[i].hash) = (int32_t)i;
+  }
+}
+
+// map() makes an empty map.
+static bool mapNative(VM* vm, int argCount, Value*) {
+  if (argCount != 0) {
+    vm->runtimeError("map() takes no arguments.");
+    return false;
+  }
+  vm->stack_top -= argCount + 1;
+  vm->push(OBJ_VAL(allocateMapObject(&vm->objects)));
+  return true;
+}
+
+static bool checkMapAndKey(VM* vm, const char* name, int argCount,
+                           Value* args) {
+  if (argCount != 2 || !IS_MAP(args[0])) {
+    vm->runtimeError("%s() takes a map and a key.", name);
+    return false;
+  }
+  return vm->checkKey(args[1]);
+}
+
+// has(map, key) tells whether `key` is in the map.
+static bool hasNative(VM* vm, int argCount, Value* args) {
+  if (!checkMapAndKey(vm, "has", argCount, args)) return false;
+  Value value;
+  bool found = AS_MAP(args[0])->get(args[1], &value);
+  vm->stack_top -= argCount + 1;
+  vm->push(BOOL_VAL(found));
+  return true;
+}
+
+// remove(map, key) removes `key` and tells whether it was there.
+static bool removeNative(VM* vm, int argCount, Value* args) {
+  if (!checkMapAndKey(vm, "remove", argCount, args)) return false;
+  bool removed = AS_MAP(args[0])->remove(args[1]);
+  vm->stack_top -= argCount + 1;
+  vm->push(BOOL_VAL(removed));
+  return true;
+}
+
+// keys(map) and values(map) copy them into an array in insertion order.
+static bool entriesNative(VM* vm, int argCount, Value* args, bool keys) {
+  if (argCount != 1 || !IS_MAP(args[0])) {
+    vm->runtimeError("%s() takes a map.", keys ? "keys" : "values");
+    return false;
+  }
+  ObjMap* map = AS_MAP(args[0]);
+  ObjArray* array = allocateArrayObject(&vm->objects);
+  array->values.reserve(map->count);
+  for (auto& entry : map->entries) {
+    if (!entry.removed) array->values.push_back(keys ? entry.key : entry.value);
+  }
+  vm->stack_top -= argCount + 1;
+  vm->push(OBJ_VAL(array));
+  return true;
+}
+
+static bool keysNative(VM* vm, int argCount, Value* args) {
+  return entriesNative(vm, argCount, args, true);
+}
+
+static bool valuesNative(VM* vm, int argCount, Value* args) {
+  return entriesNative(vm, argCount, args, false);
+}
+
+void defineHashMapNatives(VM* vm) {
+  vm->defineNative("map", 3, mapNative);
+  vm->defineNative("has", 3, hasNative);
+  vm->defineNative("remove", 6, removeNative);
+  vm->defineNative("keys", 4, keysNative);
+  vm->defineNative("values", 6, valuesNative);
+}
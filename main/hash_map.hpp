@@ -0,0 +1,17 @@
+#ifndef cpplox_hash_map_h
+#define cpplox_hash_map_h
+
+#include "common.hpp"
+#include "value.hpp"
+
+class VM;
+
+// whether `key` can be a map key: nil, a boolean, a number other than NaN or
+// a string.
+bool isMapKey(Value key);
+
+// map(), has(), remove(), keys() and values() in `vm`. maps are read and
+// written by indexing and their size is `length`.
+void defineHashMapNatives(VM* vm);
+
+#endif
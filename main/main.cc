@@ -1,37 +1,177 @@
-#include <fstream>
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <thread>
 
+#include "bytecode.hpp"
 #include "chunk.hpp"
 #include "common.hpp"
+#include "compiler.hpp"
 #include "debug.hpp"
+#include "mapped_file.hpp"
+#include "parallel_map.hpp"
+#include "program.hpp"
+#include "scheduler.hpp"
+#include "snapshot.hpp"
 #include "vm.hpp"
 
-void repl() {
+void repl(VM* vm) {
   std::string line;
   printf("> ");
   while (std::getline(std::cin, line)) {
-    vm.interpret(line.c_str());
+    vm->interpret(line.c_str());
     printf("> ");
   }
 }
 
-void runFile(const char* path) {
-  std::ifstream ifs(path);
-  std::string content((std::istreambuf_iterator<char>(ifs)),
-                      (std::istreambuf_iterator<char>()));
-  vm.interpret(content.c_str());
+// tokens point straight into the mapping, so it has to outlive the compile.
+void mapSource(const char* path, MappedFile* file) {
+  if (!file->map(path)) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+}
+
+// compiled scripts are cached next to their source, e.g. `a.lox` -> `a.loxc`.
+std::string cachePath(const char* path) { return std::string(path) + "c"; }
+
+void runFile(VM* vm, const char* path) {
+  if (isBytecodeFile(path)) {
+    auto script = loadBytecodeFile(path, 0, &vm->strings, &vm->objects);
+    if (script == nullptr) {
+      fprintf(stderr, "Invalid bytecode file \"%s\".\n", path);
+      exit(65);
+    }
+    vm->runScript(script);
+    return;
+  }
+
+  if (vm->lazyCompile) {
+    // lazily compiled scripts can't be cached, their bodies aren't bytecode
+    // yet. the mapping lives as long as the VM.
+    MappedFile* file = &vm->mappedSources.emplace_back();
+    mapSource(path, file);
+    auto script = vm->compile((const char*)file->data, file->size);
+    if (script == nullptr) exit(65);
+    vm->runScript(script);
+    return;
+  }
+
+  MappedFile file{};
+  mapSource(path, &file);
+  auto source = (const char*)file.data;
+  uint64_t sourceHash = hashSource(source, file.size);
+  std::string cache = cachePath(path);
+
+  auto script =
+      loadBytecodeFile(cache.c_str(), sourceHash, &vm->strings, &vm->objects);
+  if (script == nullptr) {
+    script = vm->compile(source, file.size);
+    if (script == nullptr) exit(65);
+    // the cache is best effort, e.g. the directory may be read-only.
+    writeBytecodeFile(cache.c_str(), script, sourceHash);
+  }
+  file.unmap();
+  vm->runScript(script);
+}
+
+void compileFile(VM* vm, const char* path, const char* outPath) {
+  MappedFile file{};
+  mapSource(path, &file);
+  auto source = (const char*)file.data;
+  // images hold bytecode only, so every body is compiled up front.
+  vm->lazyCompile = false;
+  auto script = vm->compile(source, file.size);
+  if (script == nullptr) exit(65);
+
+  std::string out = outPath != nullptr ? outPath : cachePath(path);
+  if (!writeBytecodeFile(out.c_str(), script, hashSource(source, file.size))) {
+    fprintf(stderr, "Could not write \"%s\".\n", out.c_str());
+    exit(74);
+  }
+}
+
+// runs a prelude script and saves the resulting heap.
+void snapshotFile(VM* vm, const char* imagePath, const char* path) {
+  runFile(vm, path);
+  if (!writeSnapshotFile(imagePath, vm)) {
+    fprintf(stderr, "Could not write snapshot \"%s\".\n", imagePath);
+    exit(74);
+  }
+}
+
+void loadSnapshot(VM* vm, const char* imagePath) {
+  if (!loadSnapshotFile(imagePath, vm)) {
+    fprintf(stderr, "Invalid snapshot \"%s\".\n", imagePath);
+    exit(65);
+  }
+}
+
+// runs the script as the first task of a scheduler with `workers` threads.
+void runScheduled(VM* vm, const char* path, int workers) {
+  std::shared_ptr<const Program> program;
+  if (isBytecodeFile(path)) {
+    program = Program::load(path);
+    if (program == nullptr) {
+      fprintf(stderr, "Invalid bytecode file \"%s\".\n", path);
+      exit(65);
+    }
+  } else {
+    MappedFile file{};
+    mapSource(path, &file);
+    program = Program::compile((const char*)file.data, file.size,
+                               vm->compileWorkers);
+    if (program == nullptr) exit(65);
+  }
+
+  Scheduler scheduler(program, workers, vm->mapPool);
+  if (!scheduler.run()) exit(70);
 }
 
 int main(int argc, char* argv[]) {
+  // VMs share no state, the interpreter just needs the one. parallelMap()
+  // gets a thread per core besides the caller's.
+  MapPool mapPool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+  VM vm{};
   vm.initVM();
+  vm.mapPool = &mapPool;
+  int workers = 0;
+
+  for (; argc > 1; argv++, argc--) {
+    std::string option = argv[1];
+    if (option == "--lazy") {
+      vm.lazyCompile = true;
+    } else if (option == "--parallel") {
+      vm.compileWorkers = std::max(1u, std::thread::hardware_concurrency());
+    } else if (option == "--pretokenize") {
+      vm.pretokenize = true;
+    } else if (option == "--workers" && argc > 2) {
+      workers = std::max(1, atoi(argv[2]));
+      argv++, argc--;
+    } else {
+      break;
+    }
+  }
 
+  std::string flag = argc > 1 ? argv[1] : "";
   if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+    repl(&vm);
+  } else if (argc == 2 && flag[0] != '-') {
+    workers > 0 ? runScheduled(&vm, argv[1], workers) : runFile(&vm, argv[1]);
+  } else if ((argc == 3 || argc == 4) && flag == "--compile") {
+    compileFile(&vm, argv[2], argc == 4 ? argv[3] : nullptr);
+  } else if (argc == 4 && flag == "--snapshot") {
+    snapshotFile(&vm, argv[2], argv[3]);
+  } else if ((argc == 3 || argc == 4) && flag == "--from-snapshot") {
+    loadSnapshot(&vm, argv[2]);
+    argc == 4 ? runFile(&vm, argv[3]) : repl(&vm);
   } else {
-    std::cout << "Usage: clox [path]\n";
+    std::cout << "Usage: clox [--lazy] [--parallel] [--pretokenize] [path]\n"
+                 "       clox [--parallel] --workers n path\n"
+                 "       clox [--parallel] [--pretokenize] --compile path "
+                 "[out]\n"
+                 "       clox --snapshot image prelude\n"
+                 "       clox --from-snapshot image [path]\n";
     exit(64);
   }
 };
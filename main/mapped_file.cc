@@ -0,0 +1,39 @@
+#include "mapped_file.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool MappedFile::map(const char* path) {
+  unmap();
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return true;
+  }
+
+  void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return false;
+  // files are read front to back once, let the kernel read ahead.
+  madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+  data = (const uint8_t*)mapping;
+  size = st.st_size;
+  return true;
+}
+
+void MappedFile::unmap() {
+  if (data != nullptr) munmap((void*)data, size);
+  data = nullptr;
+  size = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef cpplox_mapped_file_h
+#define cpplox_mapped_file_h
+
+#include "common.hpp"
+
+// read-only, private mapping of a whole file.
+class MappedFile {
+ public:
+  const uint8_t* data;
+  size_t size;
+  MappedFile() : data(nullptr), size(0){};
+  ~MappedFile() { unmap(); };
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  // returns false if the file can't be opened. an empty file maps to no data.
+  bool map(const char* path);
+  void unmap();
+};
+
+#endif
@@ -0,0 +1,30 @@
+#include "number.hpp"
+
+#include <charconv>
+#include <cmath>
+
+// std::from_chars and std::to_chars are exact, locale-independent and
+// allocation-free: an Eisel-Lemire parse and a Ryu shortest round-trip print.
+bool parseNumber(const char* start, size_t length, double* value) {
+  const char* end = start + length;
+  // from_chars would also take `inf`, `nan` and a leading sign.
+  for (const char* c = start; c < end; c++) {
+    if ((*c < '0' || *c > '9') && *c != '.') return false;
+  }
+  auto result = std::from_chars(start, end, *value, std::chars_format::fixed);
+  // without an exponent a literal out of range either has a zero integer part
+  // and rounds to 0, or overflows. denormals parse normally.
+  if (result.ec == std::errc::result_out_of_range) {
+    const char* c = start;
+    while (c < end && *c == '0') c++;
+    *value = c == end || *c == '.' ? 0 : HUGE_VAL;
+  } else if (result.ec != std::errc()) {
+    return false;
+  }
+  return result.ptr == end;
+}
+
+int formatNumber(double value, char* buffer) {
+  auto result = std::to_chars(buffer, buffer + NUMBER_BUFFER_SIZE, value);
+  return static_cast<int>(result.ptr - buffer);
+}
@@ -0,0 +1,18 @@
+#ifndef cpplox_number_h
+#define cpplox_number_h
+
+#include "common.hpp"
+
+// longest output of formatNumber, e.g. "-2.2250738585072014e-308".
+#define NUMBER_BUFFER_SIZE 32
+
+// parses a number literal, digits with an optional fraction, straight from the
+// source span. it ignores the locale and doesn't need a terminating NUL.
+// returns false unless the whole span is a literal.
+bool parseNumber(const char* start, size_t length, double* value);
+
+// writes the shortest text that parses back to `value` and returns its
+// length. the output isn't NUL-terminated.
+int formatNumber(double value, char* buffer);
+
+#endif
@@ -1,19 +1,35 @@
 #include "object.hpp"
 
+#include <algorithm>
+#include <cstring>
+
 #include "value.hpp"
 #include "vm.hpp"
 
+static bool namesLength(const std::string& str) {
+  return str.size() == 6 && memcmp(str.data(), "length", 6) == 0;
+}
+
 ObjString::ObjString(const char* chars, int length) {
   str = std::string(chars, length);
   type = ObjType::OBJ_STRING;
   next = nullptr;
   hash = hashString(chars, length);
+  isLength = namesLength(str);
+}
+
+ObjString::ObjString(const char* chars, int length, uint32_t hash)
+    : str(chars, length), hash(hash) {
+  type = ObjType::OBJ_STRING;
+  next = nullptr;
+  isLength = namesLength(str);
 }
 
 ObjString::ObjString(std::string s) : str(s) {
   type = ObjType::OBJ_STRING;
   next = nullptr;
   hash = hashString(s.c_str(), s.size());
+  isLength = namesLength(str);
 }
 
 bool isObjType(Value value, ObjType type) {
@@ -28,16 +44,23 @@ bool isObjType(Value value, ObjType type) {
 
 ObjString* allocateStringObject(const char* chars, int length,
                                 Table* stringTable, Obj** objects) {
-  auto string = new ObjString(chars, length);
-  string->type = ObjType::OBJ_STRING;
-  string->isMarked = false;
-  auto found = stringTable->findString(string);
+  return allocateStringObject(chars, length, hashString(chars, length),
+                              stringTable, objects);
+};
+
+// interns a string whose hash is already known, e.g. from a bytecode image.
+// an interned string is returned without copying the characters.
+ObjString* allocateStringObject(const char* chars, int length, uint32_t hash,
+                                Table* stringTable, Obj** objects) {
+  auto found = stringTable->findString(chars, length, hash);
   if (found != nullptr) return found;
 
+  auto string = new ObjString(chars, length, hash);
+  string->isMarked = false;
   ADD_OBJECT_LISTS(objects, string)
   stringTable->set(string, NIL_VAL);
   return string;
-};
+}
 
 ObjFunction* allocateFunctionObject(Obj** objects) {
   auto function = new ObjFunction{};
@@ -55,6 +78,15 @@ ObjNative* allocateNativeFnctionObject(NativeFunctionPtr func, Obj** objects) {
   return native;
 }
 
+ObjNative* allocateNativeFnctionObject(VMNativeFunctionPtr func,
+                                       Obj** objects) {
+  auto native = new ObjNative{func};
+  native->isMarked = false;
+  native->type = ObjType::OBJ_NATIVE;
+  ADD_OBJECT_LISTS(objects, native)
+  return native;
+}
+
 ObjClosure* allocateClosureObject(ObjFunction* function, Obj** objects) {
   auto closure = new ObjClosure(function);
   closure->isMarked = false;
@@ -71,34 +103,111 @@ ObjUpvalue* allocateUpvalueObject(Value* location, Obj** objects) {
   return upvalue;
 };
 
-void printFunction(ObjFunction* function) {
-  if (function->name == NULL) {
-    printf("<script>");
-    return;
+ObjFiber* allocateFiberObject(ObjClosure* closure, Obj** objects) {
+  auto fiber = new ObjFiber(closure);
+  fiber->isMarked = false;
+  fiber->type = ObjType::OBJ_FIBER;
+  ADD_OBJECT_LISTS(objects, fiber)
+  return fiber;
+}
+
+ObjTask* allocateTaskObject(std::shared_ptr<Task> task, Obj** objects) {
+  auto handle = new ObjTask(std::move(task));
+  handle->isMarked = false;
+  handle->type = ObjType::OBJ_TASK;
+  ADD_OBJECT_LISTS(objects, handle)
+  return handle;
+}
+
+ObjChannel* allocateChannelObject(std::shared_ptr<Channel> channel,
+                                  Obj** objects) {
+  auto handle = new ObjChannel(std::move(channel));
+  handle->isMarked = false;
+  handle->type = ObjType::OBJ_CHANNEL;
+  ADD_OBJECT_LISTS(objects, handle)
+  return handle;
+}
+
+ObjArray* allocateArrayObject(Obj** objects) {
+  auto array = new ObjArray();
+  array->isMarked = false;
+  array->type = ObjType::OBJ_ARRAY;
+  ADD_OBJECT_LISTS(objects, array)
+  return array;
+}
+
+ObjBuffer* allocateBufferObject(size_t count, Obj** objects) {
+  auto buffer = new ObjBuffer(count);
+  buffer->isMarked = false;
+  buffer->type = ObjType::OBJ_BUFFER;
+  ADD_OBJECT_LISTS(objects, buffer)
+  return buffer;
+}
+
+ObjMap* allocateMapObject(Obj** objects) {
+  auto map = new ObjMap();
+  map->isMarked = false;
+  map->type = ObjType::OBJ_MAP;
+  ADD_OBJECT_LISTS(objects, map)
+  return map;
+}
+
+ObjClass* allocateClassObject(ObjString* name, Obj** objects) {
+  auto klass = new ObjClass(name);
+  klass->isMarked = false;
+  klass->type = ObjType::OBJ_CLASS;
+  ADD_OBJECT_LISTS(objects, klass)
+  return klass;
+}
+
+ObjInstance* allocateInstanceObject(ObjClass* klass, Obj** objects) {
+  auto instance = new ObjInstance(klass);
+  instance->isMarked = false;
+  instance->type = ObjType::OBJ_INSTANCE;
+  ADD_OBJECT_LISTS(objects, instance)
+  return instance;
+}
+
+ObjBoundMethod* allocateBoundMethodObject(Value receiver, ObjClosure* method,
+                                          Obj** objects) {
+  auto bound = new ObjBoundMethod(receiver, method);
+  bound->isMarked = false;
+  bound->type = ObjType::OBJ_BOUND_METHOD;
+  ADD_OBJECT_LISTS(objects, bound)
+  return bound;
+}
+
+// names are interned, but a shared Program's constants are interned in its
+// own table, so equal names may still be different objects.
+static bool sameName(ObjString* a, ObjString* b) {
+  return a == b || (a->hash == b->hash && a->str == b->str);
+}
+
+int Shape::lookup(ObjString* field) {
+  for (Shape* shape = this; shape->parent != nullptr; shape = shape->parent) {
+    if (sameName(shape->name, field)) return shape->slotCount - 1;
   }
-  printf("<fn %s>", function->name->str.c_str());
+  return -1;
 }
 
-void printObject(Value value) {
-  switch (OBJ_TYPE(value)) {
-    case OBJ_FUNCTION:
-      printFunction(AS_FUNCTION(value));
-      break;
-    case OBJ_NATIVE:
-      printf("<native fn>");
-      break;
-    case OBJ_CLOSURE:
-      printFunction(AS_CLOSURE(value)->function);
-      break;
-    case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
-      break;
-    case OBJ_UPVALUE:
-      printf("upvalue");
-      break;
+Shape* Shape::transition(ObjString* field) {
+  for (auto next : transitions) {
+    if (sameName(next->name, field)) return next;
   }
+  klass->shapes.emplace_back(new Shape(klass, this, field));
+  Shape* next = klass->shapes.back().get();
+  transitions.push_back(next);
+  klass->slotHint = std::max(klass->slotHint, next->slotCount);
+  return next;
 }
 
+FiberStack::~FiberStack() {
+  for (auto& stackClosure : stackClosures) delete stackClosure.closure;
+}
+
+// the one formatter is OutputSink's, see printValue().
+void printObject(Value value) { printValue(value); }
+
 uint32_t hashString(const char* key, int length) {
   uint32_t hash = 2166136261u;
 
@@ -152,10 +261,74 @@ void blackenObject(Obj* obj, std::vector<Obj*>& grayStack) {
       for (int i = 0; i < closure->upvalueCount; i++) {
         markObject((Obj*)closure->upvalues[i], grayStack);
       }
+      // a cached shape must not be freed and its address reused.
+      for (auto& cache : closure->caches) {
+        for (int i = 0; i < cache.count; i++) {
+          markObject((Obj*)cache.entries[i].shape->klass, grayStack);
+          MARK_VALUE(cache.entries[i].method);
+        }
+      }
+      break;
+    }
+    case OBJ_FIBER: {
+      ObjFiber* fiber = (ObjFiber*)obj;
+      markObject((Obj*)fiber->closure, grayStack);
+      markObject((Obj*)fiber->caller, grayStack);
+      if (fiber->stack != nullptr) markFiberStack(fiber->stack, grayStack);
+      break;
+    }
+    case OBJ_ARRAY:
+      for (auto value : ((ObjArray*)obj)->values) {
+        MARK_VALUE(value);
+      }
+      break;
+    case OBJ_MAP:
+      for (auto& entry : ((ObjMap*)obj)->entries) {
+        if (entry.removed) continue;
+        MARK_VALUE(entry.key);
+        MARK_VALUE(entry.value);
+      }
+      break;
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)obj;
+      markObject((Obj*)klass->name, grayStack);
+      klass->methods.markTable(grayStack);
+      for (auto& shape : klass->shapes) {
+        markObject((Obj*)shape->name, grayStack);
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)obj;
+      markObject((Obj*)instance->klass, grayStack);
+      for (auto value : instance->fields) {
+        MARK_VALUE(value);
+      }
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)obj;
+      MARK_VALUE(bound->receiver);
+      markObject((Obj*)bound->method, grayStack);
       break;
     }
     case OBJ_NATIVE:
     case OBJ_STRING:
+    case OBJ_TASK:
+    case OBJ_CHANNEL:
+    case OBJ_BUFFER:
       break;
   }
 }
+
+void markFiberStack(FiberStack* stack, std::vector<Obj*>& grayStack) {
+  for (Value* slot = stack->values.get(); slot < stack->top; slot++) {
+    MARK_VALUE(*slot);
+  }
+  for (int i = 0; i < stack->frameCount; i++) {
+    markObject((Obj*)stack->frames[i].closure, grayStack);
+    for (auto upvalue : stack->frames[i].openUpvalues) {
+      markObject((Obj*)upvalue, grayStack);
+    }
+  }
+}
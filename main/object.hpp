@@ -1,8 +1,11 @@
 #ifndef cpplox_object_h
 #define cpplox_object_h
 
+#include <memory>
+
 #include "chunk.hpp"
 #include "common.hpp"
+#include "scanner.hpp"
 #include "table.hpp"
 #include "value.hpp"
 
@@ -12,14 +15,36 @@
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+#define IS_TASK(value) isObjType(value, OBJ_TASK)
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
+#define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
+#define IS_BUFFER(value) isObjType(value, OBJ_BUFFER)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_CLASS(value) isObjType(value, OBJ_CLASS)
+#define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->func)
 #define AS_CLOSURE(value) (((ObjClosure*)AS_OBJ(value)))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+#define AS_TASK(value) (((ObjTask*)AS_OBJ(value))->task)
+#define AS_CHANNEL(value) (((ObjChannel*)AS_OBJ(value))->channel)
+#define AS_ARRAY(value) ((ObjArray*)AS_OBJ(value))
+#define AS_BUFFER(value) ((ObjBuffer*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+#define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
+#define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->str.c_str())
 
+class Channel;
+class ObjClass;
 class Table;
+class Task;
+class VM;
 
 enum ObjType {
   OBJ_FUNCTION,
@@ -27,6 +52,15 @@ enum ObjType {
   OBJ_NATIVE,
   OBJ_UPVALUE,
   OBJ_CLOSURE,
+  OBJ_FIBER,
+  OBJ_TASK,
+  OBJ_CHANNEL,
+  OBJ_ARRAY,
+  OBJ_BUFFER,
+  OBJ_CLASS,
+  OBJ_INSTANCE,
+  OBJ_BOUND_METHOD,
+  OBJ_MAP,
 };
 
 class Obj {
@@ -41,9 +75,31 @@ class ObjString : public Obj {
  public:
   ObjString(){};
   ObjString(const char* chars, int length);
+  ObjString(const char* chars, int length, uint32_t hash);
   ObjString(std::string str);
   std::string str;
   uint32_t hash;
+  // whether this is "length", which arrays, buffers, strings and maps answer.
+  // strings come from several intern tables, so it can't be told by address.
+  bool isLength = false;
+  // a copy of `str` that other VMs may hold, made the first time the string
+  // is sent to one.
+  std::shared_ptr<const std::string> shared;
+};
+
+// a function body that was only preparsed. `start` points at the parameter
+// list inside source the VM keeps alive, `end` at the end of that source, and
+// `upvalueNames[i]` is the name upvalue i was resolved to when the function
+// was declared.
+class LazyBody {
+ public:
+  const char* start;
+  const char* end;
+  int line;
+  int functionType;
+  std::vector<Token> upvalueNames;
+  LazyBody(const char* start, const char* end, int line, int functionType)
+      : start(start), end(end), line(line), functionType(functionType){};
 };
 
 class ObjFunction : public Obj {
@@ -53,20 +109,41 @@ class ObjFunction : public Obj {
 
   Chunk chunk;
   ObjString* name;
+  // non-null until the body is compiled on the first call.
+  LazyBody* lazy;
+  // property instructions in the body, each with its own PropertyCache.
+  int cacheCount;
 
-  ObjFunction() : arity(0), upvalueCount(0), name(nullptr){};
+  ObjFunction()
+      : arity(0), upvalueCount(0), name(nullptr), lazy(nullptr), cacheCount(0){};
   ObjFunction(Chunk chunk)
-      : arity(0), upvalueCount(0), chunk(chunk), name(nullptr) {}
-  ~ObjFunction() { delete name; };
+      : arity(0),
+        upvalueCount(0),
+        chunk(chunk),
+        name(nullptr),
+        lazy(nullptr),
+        cacheCount(0) {}
+  ~ObjFunction() {
+    delete name;
+    delete lazy;
+  };
 };
 
 using NativeFunctionType = Value(int argCount, Value* args);
 using NativeFunctionPtr = NativeFunctionType*;
 
+// natives that need the VM, e.g. to switch fibers. they replace the callee
+// and arguments with their result on whatever stack is current when they
+// return, and report their own errors.
+using VMNativeFunctionType = bool(VM* vm, int argCount, Value* args);
+using VMNativeFunctionPtr = VMNativeFunctionType*;
+
 class ObjNative : public Obj {
  public:
   NativeFunctionPtr func;
-  ObjNative(NativeFunctionPtr func) : func(func){};
+  VMNativeFunctionPtr vmFunc;
+  ObjNative(NativeFunctionPtr func) : func(func), vmFunc(nullptr){};
+  ObjNative(VMNativeFunctionPtr vmFunc) : func(nullptr), vmFunc(vmFunc){};
   ~ObjNative(){};
 };
 
@@ -74,9 +151,44 @@ class ObjUpvalue : public Obj {
  public:
   Value* location;
   Value closed;
-  ObjUpvalue* nextUpValue;
-  ObjUpvalue(Value* location)
-      : location(location), nextUpValue(nullptr), closed(NIL_VAL){};
+  // the header is set here too, since frame storage copies upvalues that
+  // were never allocated.
+  ObjUpvalue(Value* location) : location(location), closed(NIL_VAL) {
+    type = ObjType::OBJ_UPVALUE;
+    isMarked = false;
+    next = nullptr;
+  };
+};
+
+class Shape;
+
+#define PROPERTY_CACHE_WAYS 4
+
+// what a property instruction found for one shape. `slot` is the field's
+// index, or -1 for a method of the shape's class. a store that added the
+// field also records the shape it moved the instance to in `next`.
+struct CacheEntry {
+  Shape* shape;
+  int slot;
+  Shape* next;
+  Value method;
+};
+
+// the shapes a property instruction has seen, up to PROPERTY_CACHE_WAYS of
+// them. once it is full, further shapes take the slow path every time.
+struct PropertyCache {
+  CacheEntry entries[PROPERTY_CACHE_WAYS];
+  int count = 0;
+
+  CacheEntry* find(Shape* shape) {
+    for (int i = 0; i < count; i++) {
+      if (entries[i].shape == shape) return &entries[i];
+    }
+    return nullptr;
+  }
+  void add(CacheEntry entry) {
+    if (count < PROPERTY_CACHE_WAYS) entries[count++] = entry;
+  }
 };
 
 class ObjClosure : public Obj {
@@ -84,6 +196,13 @@ class ObjClosure : public Obj {
   ObjFunction* function;
   std::vector<ObjUpvalue*> upvalues;
   int upvalueCount;
+  // the property caches of the function's body. they live here rather than
+  // in the chunk since a shared Program's chunks are never written, and
+  // shapes belong to one VM. sized on the first call, so a closure made anew
+  // on every call of its enclosing function allocates its caches each time
+  // and starts cold. property accesses in hot code are best in functions
+  // declared once.
+  std::vector<PropertyCache> caches;
   ObjClosure(ObjFunction* function)
       : function(function),
         upvalueCount(function->upvalueCount),
@@ -91,17 +210,208 @@ class ObjClosure : public Obj {
   ~ObjClosure(){};
 };
 
+struct CallFrame {
+  ObjClosure* closure;
+  uint8_t* ip;
+  // the start of the last call instruction run in this frame. a native that
+  // waits rewinds `ip` to it to be called again.
+  uint8_t* callStart;
+  Value* slots;
+  // upvalues still pointing into this frame's slots, sorted by location.
+  std::vector<ObjUpvalue*> openUpvalues;
+};
+
+// frame-owned storage for a closure the compiler proved never outlives the
+// frame that created it. indexed by the stack slot holding the closure and
+// reused every time that slot defines a closure again.
+struct StackClosure {
+  ObjClosure* closure = nullptr;
+  std::vector<ObjUpvalue> captures;
+};
+
+// a value stack and its call frames. the VM runs on one at a time: its own,
+// or a fiber's taken from the VM's pool, so switching fibers only swaps the
+// VM's pointers. `top` and `frameCount` are saved here while another stack
+// runs.
+class FiberStack {
+ public:
+  std::unique_ptr<Value[]> values;
+  std::unique_ptr<CallFrame[]> frames;
+  int framesMax;
+  std::vector<StackClosure> stackClosures;
+  Value* top;
+  int frameCount;
+  FiberStack(int framesMax)
+      : values(new Value[framesMax * UINT8_COUNT]),
+        frames(new CallFrame[framesMax]),
+        framesMax(framesMax),
+        top(values.get()),
+        frameCount(0){};
+  ~FiberStack();
+};
+
+enum FiberState {
+  FIBER_NEW,
+  FIBER_SUSPENDED,
+  FIBER_RUNNING,
+  FIBER_DONE,
+};
+
+class ObjFiber : public Obj {
+ public:
+  ObjClosure* closure;
+  FiberState state;
+  // from the VM's pool while the fiber runs or is suspended.
+  FiberStack* stack;
+  // the fiber that resumed this one, nullptr for the VM's own stack.
+  ObjFiber* caller;
+  ObjFiber(ObjClosure* closure)
+      : closure(closure), state(FIBER_NEW), stack(nullptr), caller(nullptr){};
+};
+
+// a VM's handle on a task, which is shared by every worker that knows of it.
+class ObjTask : public Obj {
+ public:
+  std::shared_ptr<Task> task;
+  ObjTask(std::shared_ptr<Task> task) : task(std::move(task)){};
+};
+
+// a VM's handle on a channel, which any number of VMs may hold.
+class ObjChannel : public Obj {
+ public:
+  std::shared_ptr<Channel> channel;
+  ObjChannel(std::shared_ptr<Channel> channel) : channel(std::move(channel)){};
+};
+
+// elements are stored contiguously and grow by doubling.
+class ObjArray : public Obj {
+ public:
+  std::vector<Value> values;
+};
+
+// raw doubles without value tags, for the bulk natives in buffer.hpp.
+class ObjBuffer : public Obj {
+ public:
+  std::vector<double> values;
+  ObjBuffer(size_t count) : values(count){};
+};
+
+// keys are nil, booleans, numbers other than NaN and strings, kept in the
+// order they were first set. `entries` is dense, with removed entries left as
+// holes until there are more holes than entries, and `index` is a power of
+// two sized open addressing table from a key's hash to its entry.
+class ObjMap : public Obj {
+ public:
+  struct Entry {
+    Value key;
+    Value value;
+    uint32_t hash;
+    bool removed;
+  };
+  std::vector<Entry> entries;
+  std::vector<int32_t> index;
+  size_t count = 0;
+
+  bool get(Value key, Value* value);
+  void set(Value key, Value value);
+  bool remove(Value key);
+
+ private:
+  int32_t* find(Value key, uint32_t hash);
+  void rebuild();
+};
+
+// the fields an instance has, in the order they were added. instances of a
+// class that got the same fields in the same order share a shape, so a
+// field's slot follows from the shape alone. each shape adds one field to its
+// parent; the class owns them all, rooted at its empty shape.
+class Shape {
+ public:
+  ObjClass* klass;
+  Shape* parent;
+  // the field this shape added, nullptr for the root.
+  ObjString* name;
+  int slotCount;
+  // shapes that add one more field to this one.
+  std::vector<Shape*> transitions;
+
+  Shape(ObjClass* klass, Shape* parent, ObjString* name)
+      : klass(klass),
+        parent(parent),
+        name(name),
+        slotCount(parent == nullptr ? 0 : parent->slotCount + 1){};
+
+  // the slot holding `field`, or -1.
+  int lookup(ObjString* field);
+  // the shape an instance of this one moves to when `field` is added.
+  Shape* transition(ObjString* field);
+};
+
+class ObjClass : public Obj {
+ public:
+  ObjString* name;
+  Table methods;
+  // `init` from `methods`, looked up once instead of on every construction.
+  ObjClosure* initializer;
+  std::vector<std::unique_ptr<Shape>> shapes;
+  // the most fields any instance has had, reserved for new instances up
+  // front.
+  int slotHint;
+
+  ObjClass(ObjString* name) : name(name), initializer(nullptr), slotHint(0) {
+    shapes.emplace_back(new Shape(this, nullptr, nullptr));
+  };
+  Shape* root() { return shapes[0].get(); }
+};
+
+class ObjInstance : public Obj {
+ public:
+  ObjClass* klass;
+  Shape* shape;
+  // one per slot of the shape.
+  std::vector<Value> fields;
+
+  ObjInstance(ObjClass* klass) : klass(klass), shape(klass->root()) {
+    fields.reserve(klass->slotHint);
+  };
+};
+
+class ObjBoundMethod : public Obj {
+ public:
+  Value receiver;
+  ObjClosure* method;
+  ObjBoundMethod(Value receiver, ObjClosure* method)
+      : receiver(receiver), method(method){};
+};
+
 ObjString* allocateStringObject(const char* chars, int length,
                                 Table* stringTable, Obj** objects);
+ObjString* allocateStringObject(const char* chars, int length, uint32_t hash,
+                                Table* stringTable, Obj** objects);
 ObjFunction* allocateFunctionObject(Obj** objects);
 ObjNative* allocateNativeFnctionObject(NativeFunctionPtr func, Obj** objects);
+ObjNative* allocateNativeFnctionObject(VMNativeFunctionPtr func,
+                                       Obj** objects);
 ObjClosure* allocateClosureObject(ObjFunction* function, Obj** objects);
 ObjUpvalue* allocateUpvalueObject(Value* location, Obj** objects);
+ObjFiber* allocateFiberObject(ObjClosure* closure, Obj** objects);
+ObjTask* allocateTaskObject(std::shared_ptr<Task> task, Obj** objects);
+ObjChannel* allocateChannelObject(std::shared_ptr<Channel> channel,
+                                  Obj** objects);
+ObjArray* allocateArrayObject(Obj** objects);
+ObjBuffer* allocateBufferObject(size_t count, Obj** objects);
+ObjMap* allocateMapObject(Obj** objects);
+ObjClass* allocateClassObject(ObjString* name, Obj** objects);
+ObjInstance* allocateInstanceObject(ObjClass* klass, Obj** objects);
+ObjBoundMethod* allocateBoundMethodObject(Value receiver, ObjClosure* method,
+                                          Obj** objects);
 
 bool isObjType(Value value, ObjType type);
 void printObject(Value value);
+
 uint32_t hashString(const char* key, int length);
 
 void markObject(Obj* obj, std::vector<Obj*>& greyStack);
 void blackenObject(Obj* obj, std::vector<Obj*>& greyStack);
+void markFiberStack(FiberStack* stack, std::vector<Obj*>& greyStack);
 #endif
@@ -0,0 +1,207 @@
+#include "output.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "number.hpp"
+#include "object.hpp"
+
+OutputSink::OutputSink()
+    : mode(isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_BLOCK),
+      fd(STDOUT_FILENO),
+      memory(nullptr),
+      used(0){};
+
+void OutputSink::redirect(int fd, FlushMode mode) {
+  flush();
+  this->fd = fd, this->mode = mode, memory = nullptr;
+}
+
+void OutputSink::redirect(std::string* memory) {
+  flush();
+  this->memory = memory, mode = FLUSH_BLOCK;
+}
+
+void OutputSink::flush() {
+  if (used == 0) return;
+  if (memory != nullptr) {
+    memory->append(buffer, used);
+    used = 0;
+    return;
+  }
+
+  // anything still in stdio, e.g. debug traces, was written first.
+  if (fd == STDOUT_FILENO) fflush(stdout);
+  size_t written = 0;
+  while (written < used) {
+    ssize_t n = ::write(fd, buffer + written, used - written);
+    if (n < 0 && errno == EINTR) continue;
+    // nowhere to report it, drop the output like a closed pipe would.
+    if (n <= 0) break;
+    written += n;
+  }
+  used = 0;
+}
+
+void OutputSink::write(const char* chars, size_t length) {
+  if (used + length > OUTPUT_BUFFER_SIZE) {
+    flush();
+    if (length > OUTPUT_BUFFER_SIZE) {
+      // too long to buffer, e.g. a huge string. the buffer is empty now.
+      if (memory != nullptr) {
+        memory->append(chars, length);
+        return;
+      }
+      while (length > 0) {
+        size_t chunk = std::min(length, (size_t)OUTPUT_BUFFER_SIZE);
+        memcpy(buffer, chars, chunk);
+        used = chunk;
+        flush();
+        chars += chunk, length -= chunk;
+      }
+      return;
+    }
+  }
+  memcpy(buffer + used, chars, length);
+  used += length;
+}
+
+void OutputSink::put(char c) {
+  if (used == OUTPUT_BUFFER_SIZE) flush();
+  buffer[used++] = c;
+}
+
+void OutputSink::writeValue(Value value) {
+  switch (value.type) {
+    case ValueType::VAL_BOOL:
+      AS_BOOL(value) ? write("true", 4) : write("false", 5);
+      break;
+    case ValueType::VAL_NIL:
+      write("nil", 3);
+      break;
+    case ValueType::VAL_NUMBER:
+    case ValueType::VAL_INT:
+      if (used + NUMBER_BUFFER_SIZE > OUTPUT_BUFFER_SIZE) flush();
+      used += formatNumber(AS_NUMBER(value), buffer + used);
+      break;
+    case ValueType::VAL_OBJ:
+      writeObject(value);
+      break;
+  }
+}
+
+// the arrays and maps this thread is in the middle of writing.
+static thread_local std::vector<Obj*> printing;
+
+// marks an array or map as being written by this thread while it lives, so
+// one that holds itself prints as [...] or {...} rather than recursing.
+class PrintGuard {
+ public:
+  bool repeated;
+  explicit PrintGuard(Obj* object)
+      : repeated(std::find(printing.begin(), printing.end(), object) !=
+                 printing.end()) {
+    printing.push_back(object);
+  }
+  ~PrintGuard() { printing.pop_back(); }
+  PrintGuard(const PrintGuard&) = delete;
+  PrintGuard& operator=(const PrintGuard&) = delete;
+};
+
+void OutputSink::writeObject(Value value) {
+  switch (OBJ_TYPE(value)) {
+    case OBJ_STRING: {
+      auto& str = AS_STRING(value)->str;
+      write(str.data(), str.size());
+      break;
+    }
+    case OBJ_FUNCTION:
+    case OBJ_CLOSURE:
+    case OBJ_BOUND_METHOD: {
+      auto function = IS_FUNCTION(value) ? AS_FUNCTION(value)
+                      : IS_CLOSURE(value)
+                          ? AS_CLOSURE(value)->function
+                          : AS_BOUND_METHOD(value)->method->function;
+      if (function->name == NULL) {
+        write("<script>", 8);
+        break;
+      }
+      write("<fn ", 4);
+      write(function->name->str.data(), function->name->str.size());
+      put('>');
+      break;
+    }
+    case OBJ_NATIVE:
+      write("<native fn>", 11);
+      break;
+    case OBJ_UPVALUE:
+      write("upvalue", 7);
+      break;
+    case OBJ_FIBER:
+      write("<fiber>", 7);
+      break;
+    case OBJ_TASK:
+      write("<task>", 6);
+      break;
+    case OBJ_CHANNEL:
+      write("<channel>", 9);
+      break;
+    case OBJ_ARRAY: {
+      PrintGuard guard(AS_OBJ(value));
+      if (guard.repeated) {
+        write("[...]", 5);
+        break;
+      }
+      auto& values = AS_ARRAY(value)->values;
+      put('[');
+      for (size_t i = 0; i < values.size(); i++) {
+        if (i > 0) write(", ", 2);
+        writeValue(values[i]);
+      }
+      put(']');
+      break;
+    }
+    case OBJ_BUFFER:
+      write("<buffer>", 8);
+      break;
+    case OBJ_MAP: {
+      PrintGuard guard(AS_OBJ(value));
+      if (guard.repeated) {
+        write("{...}", 5);
+        break;
+      }
+      bool first = true;
+      put('{');
+      for (auto& entry : AS_MAP(value)->entries) {
+        if (entry.removed) continue;
+        if (!first) write(", ", 2);
+        first = false;
+        writeValue(entry.key);
+        write(": ", 2);
+        writeValue(entry.value);
+      }
+      put('}');
+      break;
+    }
+    case OBJ_CLASS: {
+      auto& name = AS_CLASS(value)->name->str;
+      write(name.data(), name.size());
+      break;
+    }
+    case OBJ_INSTANCE: {
+      auto& name = AS_INSTANCE(value)->klass->name->str;
+      write(name.data(), name.size());
+      write(" instance", 9);
+      break;
+    }
+  }
+}
+
+void OutputSink::writeLine(Value value) {
+  writeValue(value);
+  put('\n');
+  if (mode == FLUSH_LINE) flush();
+}
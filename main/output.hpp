@@ -0,0 +1,50 @@
+#ifndef cpplox_output_h
+#define cpplox_output_h
+
+#include <string>
+
+#include "common.hpp"
+#include "value.hpp"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+enum FlushMode {
+  // flush after every line, for a terminal.
+  FLUSH_LINE,
+  // flush only when the buffer fills up or on flush(), for pipes and files.
+  FLUSH_BLOCK,
+};
+
+// where a VM's `print` goes. values are formatted straight into the buffer,
+// which is written out with one syscall per flush.
+class OutputSink {
+ public:
+  // stdout, line mode on a terminal and block mode otherwise.
+  OutputSink();
+  ~OutputSink() { flush(); };
+  OutputSink(const OutputSink&) = delete;
+  OutputSink& operator=(const OutputSink&) = delete;
+
+  // the caller keeps `fd` open and `memory` alive until the next redirect.
+  void redirect(int fd, FlushMode mode);
+  void redirect(std::string* memory);
+
+  void write(const char* chars, size_t length);
+  void writeValue(Value value);
+  // a value and a newline, as printed by OP_PRINT.
+  void writeLine(Value value);
+  void flush();
+
+  FlushMode mode;
+
+ private:
+  int fd;
+  std::string* memory;
+  size_t used;
+  char buffer[OUTPUT_BUFFER_SIZE];
+
+  void put(char c);
+  void writeObject(Value value);
+};
+
+#endif
@@ -0,0 +1,259 @@
+#include "parallel_map.hpp"
+
+#include <algorithm>
+
+#include "channel.hpp"
+#include "object.hpp"
+#include "vm.hpp"
+
+MapJob::MapJob(std::shared_ptr<const Program> program, MapPool* pool,
+               std::vector<SharedValue> inputs, size_t batchSize)
+    : program(std::move(program)),
+      pool(pool),
+      inputs(std::move(inputs)),
+      batchSize(batchSize),
+      nextBatch(0),
+      failedAt(SIZE_MAX) {
+  outputs.resize(this->inputs.size());
+  pending = batchCount();
+}
+
+void MapJob::work() {
+  // nothing a call leaves behind reaches the next one.
+  VM vm{};
+  vm.initVM();
+  vm.mapPool = pool;
+  vm.loadFunctions(program);
+  auto function = AS_FUNCTION(program->script->chunk.constants.values[0]);
+  vm.push(OBJ_VAL(allocateClosureObject(function, &vm.objects)));
+  auto fiber = allocateFiberObject(AS_CLOSURE(vm.peek(0)), &vm.objects);
+  vm.pop();
+  vm.hostFibers.insert(fiber);
+
+  size_t count = batchCount();
+  for (size_t batch = nextBatch++; batch < count; batch = nextBatch++) {
+    size_t end = std::min(inputs.size(), (batch + 1) * batchSize);
+    for (size_t i = batch * batchSize; i < end; i++) {
+      if (failedAt.load(std::memory_order_relaxed) != SIZE_MAX) break;
+      // a finished fiber just starts over with the next input.
+      fiber->state = FIBER_NEW;
+      if (vm.runFiber(fiber, inputs[i].take(&vm), false) != INTERPRET_OK) {
+        fail(i);
+        continue;
+      }
+      const char* error = nullptr;
+      if (!SharedValue::from(vm.pop(), &outputs[i])) {
+        error =
+            "A mapped function can only return nil, a boolean, a number, a "
+            "string, a task, a channel or a buffer.";
+      } else if (fiber->state != FIBER_DONE) {
+        error = "A mapped function cannot yield.";
+      }
+      if (error != nullptr) {
+        vm.output.flush();
+        fprintf(stderr, "%s\n", error);
+        fail(i);
+      }
+    }
+    if (--pending == 0) {
+      std::lock_guard<std::mutex> lock(mutex);
+      finished.notify_all();
+    }
+  }
+  vm.output.flush();
+}
+
+// keeps the earliest failure when several batches fail at once.
+void MapJob::fail(size_t index) {
+  size_t seen = failedAt.load();
+  while (index < seen && !failedAt.compare_exchange_weak(seen, index)) {
+  }
+}
+
+MapPool::MapPool(int threadCount) {
+  for (int i = 0; i < threadCount; i++) {
+    threads.emplace_back(&MapPool::loop, this);
+  }
+}
+
+MapPool::~MapPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (auto& thread : threads) thread.join();
+}
+
+void MapPool::run(std::shared_ptr<MapJob> job) {
+  if (!threads.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(job);
+    }
+    wakeup.notify_all();
+  }
+  job->work();
+  {
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->finished.wait(lock, [&] { return job->pending.load() == 0; });
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  auto queued = std::find(jobs.begin(), jobs.end(), job);
+  if (queued != jobs.end()) jobs.erase(queued);
+}
+
+void MapPool::loop() {
+  while (true) {
+    std::shared_ptr<MapJob> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeup.wait(lock, [&] { return stopping || !jobs.empty(); });
+      if (stopping) return;
+      job = jobs.front();
+      // every batch is taken, the threads that took them finish the job.
+      if (job->nextBatch.load() >= job->batchCount()) {
+        jobs.pop_front();
+        continue;
+      }
+    }
+    job->work();
+  }
+}
+
+// the copies hold bytecode only, so lazy bodies are compiled first, the
+// nested functions they declare included.
+static bool compileAll(VM* vm, ObjFunction* function) {
+  if (function->lazy != nullptr && !vm->compileLazy(function)) return false;
+  for (auto constant : function->chunk.constants.values) {
+    if (IS_FUNCTION(constant) && !compileAll(vm, AS_FUNCTION(constant))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// parallelMap(fn, items) calls fn, a function of one parameter that closes
+// over nothing, with every item on a pool of isolated VMs. items is an array,
+// which maps to an array of the results, or a count n, meaning 0 to n - 1, or
+// a channel, which is drained until it is closed. those two map to a closed
+// channel of the results. results keep the order of the items. fn sees the
+// caller's top-level functions but no other globals. a scheduler task can
+// only pass a channel that is closed already.
+bool parallelMapNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_CLOSURE(args[0]) ||
+      AS_CLOSURE(args[0])->upvalueCount > 0 ||
+      AS_CLOSURE(args[0])->function->arity != 1) {
+    vm->runtimeError(
+        "parallelMap() takes a function of one parameter that closes over "
+        "nothing, and items.");
+    return false;
+  }
+
+  // the pool's VMs get copies of fn and of every function it might call.
+  std::vector<ObjFunction*> functions{AS_CLOSURE(args[0])->function};
+  for (size_t i = 0; i < vm->globals.entries->capacity(); i++) {
+    Value value = (*vm->globals.entries)[i].value;
+    if ((*vm->globals.entries)[i].key == nullptr || !IS_CLOSURE(value) ||
+        AS_CLOSURE(value)->upvalueCount > 0) {
+      continue;
+    }
+    functions.push_back(AS_CLOSURE(value)->function);
+  }
+  for (auto function : functions) {
+    if (!compileAll(vm, function)) return false;
+  }
+
+  std::vector<SharedValue> inputs;
+  if (IS_ARRAY(args[1])) {
+    auto& values = AS_ARRAY(args[1])->values;
+    // checked up front, so a failed call hands no buffer over.
+    for (auto value : values) {
+      if (!SharedValue::sendable(value)) {
+        vm->runtimeError(
+            "parallelMap() can only pass nil, a boolean, a number, a string, a "
+            "task, a channel or a buffer.");
+        return false;
+      }
+    }
+    inputs.resize(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+      SharedValue::from(values[i], &inputs[i]);
+    }
+  } else if (IS_NUMBER(args[1]) && AS_NUMBER(args[1]) >= 0 &&
+             AS_NUMBER(args[1]) <= (1 << 24)) {
+    size_t count = AS_NUMBER(args[1]);
+    inputs.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      inputs[i].kind = SHARED_NUMBER;
+      inputs[i].number = i;
+    }
+  } else if (IS_CHANNEL(args[1])) {
+    Channel* channel = AS_CHANNEL(args[1]).get();
+    // waiting here would hold up the worker, and with it maybe the task that
+    // feeds the channel. the items taken so far can't wait in a parked
+    // fiber, so tasks only drain channels that are already closed.
+    if (vm->worker != nullptr && !channel->isClosed()) {
+      vm->runtimeError("parallelMap() in a task takes a closed channel.");
+      return false;
+    }
+    SharedValue item;
+    while (true) {
+      uint64_t version = channel->version();
+      if (channel->tryReceive(&item)) {
+        inputs.push_back(std::move(item));
+      } else if (channel->isClosed()) {
+        if (!channel->tryReceive(&item)) break;
+        inputs.push_back(std::move(item));
+      } else {
+        channel->waitFor(version);
+      }
+    }
+  } else {
+    vm->runtimeError(
+        "parallelMap() takes an array, a count up to 16777216 or a channel of "
+        "items.");
+    return false;
+  }
+
+  MapPool* pool = vm->mapPool;
+  size_t count = inputs.size();
+  // enough batches for the load to even out, few enough to keep the
+  // bookkeeping cheap.
+  int threads = pool != nullptr ? pool->size() : 1;
+  size_t batchSize = std::max<size_t>(1, count / (threads * 8));
+  auto job = std::make_shared<MapJob>(Program::copy(functions), pool,
+                                      std::move(inputs), batchSize);
+  // a pool VM reports errors straight to stderr, after what was printed here.
+  vm->output.flush();
+  // without a pool the caller maps every item itself.
+  pool != nullptr ? pool->run(job) : job->work();
+  if (job->failedAt != SIZE_MAX) {
+    vm->runtimeError("parallelMap() failed on item %zu.",
+                     job->failedAt.load());
+    return false;
+  }
+
+  if (IS_ARRAY(args[1])) {
+    ObjArray* results = allocateArrayObject(&vm->objects);
+    vm->push(OBJ_VAL(results));
+    results->values.reserve(count);
+    for (auto& output : job->outputs) {
+      results->values.push_back(output.take(vm));
+    }
+    vm->stack_top -= argCount + 2;
+    vm->push(OBJ_VAL(results));
+    return true;
+  }
+
+  auto results = std::make_shared<Channel>(std::max<size_t>(1, count));
+  for (auto& output : job->outputs) results->trySend(&output);
+  results->close();
+  vm->stack_top -= argCount + 1;
+  vm->push(OBJ_VAL(allocateChannelObject(std::move(results), &vm->objects)));
+  return true;
+}
+
+void defineMapNatives(VM* vm) {
+  vm->defineNative("parallelMap", 11, parallelMapNative);
+}
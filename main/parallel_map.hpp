@@ -0,0 +1,78 @@
+#ifndef cpplox_parallel_map_h
+#define cpplox_parallel_map_h
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "program.hpp"
+#include "shared_value.hpp"
+
+class MapPool;
+class VM;
+
+// one parallelMap() call: the first function of `program` applied to every
+// input, a batch at a time, by every thread that joins in.
+class MapJob {
+ public:
+  std::shared_ptr<const Program> program;
+  // where calls made by the mapped function run, may be null.
+  MapPool* pool;
+  std::vector<SharedValue> inputs;
+  std::vector<SharedValue> outputs;
+  size_t batchSize;
+
+  std::atomic<size_t> nextBatch;
+  // batches not done yet, the caller waits for zero.
+  std::atomic<size_t> pending;
+  // the input that failed, or SIZE_MAX. the rest are skipped once it is set.
+  std::atomic<size_t> failedAt;
+  std::mutex mutex;
+  std::condition_variable finished;
+
+  MapJob(std::shared_ptr<const Program> program, MapPool* pool,
+         std::vector<SharedValue> inputs, size_t batchSize);
+
+  size_t batchCount() const {
+    return (inputs.size() + batchSize - 1) / batchSize;
+  }
+  // maps batches on a fresh VM until none are left to claim.
+  void work();
+
+ private:
+  void fail(size_t index);
+};
+
+// threads that help with parallelMap() calls. the caller always works on its
+// own call too, so a pool without threads still gets through it and a call
+// made inside a mapped function can't end up waiting on itself. the host
+// owns a pool and hands it to the VMs it wants to share it.
+class MapPool {
+ public:
+  explicit MapPool(int threads);
+  ~MapPool();
+
+  // threads working on a call, the caller's included.
+  int size() { return threads.size() + 1; }
+  // returns once every input is mapped.
+  void run(std::shared_ptr<MapJob> job);
+
+ private:
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::deque<std::shared_ptr<MapJob>> jobs;
+  bool stopping = false;
+
+  void loop();
+};
+
+// parallelMap() in `vm`.
+void defineMapNatives(VM* vm);
+
+#endif
@@ -0,0 +1,62 @@
+#include "program.hpp"
+
+#include "bytecode.hpp"
+#include "compiler.hpp"
+
+std::shared_ptr<const Program> Program::compile(const char* source,
+                                                size_t length, int workers) {
+  std::unique_ptr<Program> program(new Program());
+  auto compiler =
+      Compiler(source, length, &program->strings, &program->objects);
+  compiler.workers = workers;
+  program->script = compiler.compile();
+  compiler.freeCompiler();
+  return seal(std::move(program));
+}
+
+std::shared_ptr<const Program> Program::load(const char* path) {
+  std::unique_ptr<Program> program(new Program());
+  program->script =
+      loadBytecodeFile(path, 0, &program->strings, &program->objects);
+  return seal(std::move(program));
+}
+
+std::shared_ptr<const Program> Program::copy(
+    const std::vector<ObjFunction*>& functions) {
+  ObjFunction stub{};
+  for (auto function : functions) {
+    stub.chunk.constants.writeValueArray(OBJ_VAL(function));
+  }
+  stub.chunk.write_chunk(OP_NIL, 0);
+  stub.chunk.write_chunk(OP_RETURN, 0);
+  auto image = serializeFunction(&stub, 0);
+
+  std::unique_ptr<Program> program(new Program());
+  uint64_t sourceHash;
+  program->script = deserializeFunction(image.data(), image.size(), &sourceHash,
+                                        &program->strings, &program->objects);
+  return seal(std::move(program));
+}
+
+std::shared_ptr<const Program> Program::seal(
+    std::unique_ptr<Program> program) {
+  if (program->script == nullptr) return nullptr;
+  for (auto obj = program->objects; obj != nullptr; obj = obj->next) {
+    obj->isMarked = true;
+    // filled in now, so VMs sending the program's constants never write it.
+    if (obj->type == OBJ_STRING) {
+      auto string = (ObjString*)obj;
+      string->shared = std::make_shared<const std::string>(string->str);
+    }
+  }
+  return std::shared_ptr<const Program>(program.release());
+}
+
+Program::~Program() {
+  auto obj = objects;
+  while (obj != nullptr) {
+    auto next = obj->next;
+    delete obj;
+    obj = next;
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef cpplox_program_h
+#define cpplox_program_h
+
+#include <memory>
+#include <vector>
+
+#include "common.hpp"
+#include "object.hpp"
+#include "table.hpp"
+
+// a compiled script that any number of VMs, on any threads, can run without
+// copying it. its functions, chunks and constant strings live in their own
+// heap and are never written after construction: every body is compiled
+// eagerly and every object is born marked, so a VM's collector neither
+// traces nor frees them. each VM still keeps its own globals and closures.
+class Program {
+ public:
+  ObjFunction* script;
+
+  // returns nullptr if the source doesn't compile.
+  static std::shared_ptr<const Program> compile(const char* source,
+                                                size_t length,
+                                                int workers = 0);
+  // returns nullptr if `path` isn't a valid bytecode image.
+  static std::shared_ptr<const Program> load(const char* path);
+  // copies functions out of a VM's heap, e.g. to call them on other VMs. the
+  // script does nothing, its constants are the copies in the same order.
+  // every function has to be compiled already.
+  static std::shared_ptr<const Program> copy(
+      const std::vector<ObjFunction*>& functions);
+
+  Program() : script(nullptr), objects(nullptr){};
+  ~Program();
+  Program(const Program&) = delete;
+  Program& operator=(const Program&) = delete;
+
+ private:
+  Table strings;
+  Obj* objects;
+
+  static std::shared_ptr<const Program> seal(std::unique_ptr<Program> program);
+};
+
+#endif
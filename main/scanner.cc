@@ -1,18 +1,290 @@
 #include "scanner.hpp"
 
+#include <array>
 #include <cstring>
 
 #include "common.hpp"
 
-bool isDigit(char c) { return c >= '0' && c <= '9'; };
-bool isAlpha(char c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define SCANNER_SIMD
+#endif
+
+const char* const scanErrors[SCAN_ERROR_NUMS] = {
+    "Unterminated string.",
+    "Unexpected Character.",
+};
+
+enum CharClass : uint8_t {
+  CHAR_ALPHA = 1,  // letters and '_'
+  CHAR_DIGIT = 2,
+};
+
+constexpr std::array<uint8_t, 256> makeCharClasses() {
+  std::array<uint8_t, 256> classes{};
+  for (int c = 'a'; c <= 'z'; c++) classes[c] |= CHAR_ALPHA;
+  for (int c = 'A'; c <= 'Z'; c++) classes[c] |= CHAR_ALPHA;
+  classes['_'] |= CHAR_ALPHA;
+  for (int c = '0'; c <= '9'; c++) classes[c] |= CHAR_DIGIT;
+  return classes;
+}
+
+constexpr std::array<uint8_t, 256> charClasses = makeCharClasses();
+static_assert(
+    charClasses['a'] == CHAR_ALPHA && charClasses['Z'] == CHAR_ALPHA &&
+        charClasses['_'] == CHAR_ALPHA && charClasses['0'] == CHAR_DIGIT &&
+        charClasses['9'] == CHAR_DIGIT && charClasses['@'] == 0 &&
+        charClasses['['] == 0 && charClasses['`'] == 0 &&
+        charClasses['{'] == 0 && charClasses['/'] == 0 &&
+        charClasses[':'] == 0 && charClasses[0x80] == 0,
+    "charClasses misclassifies a character");
+
+bool isDigit(char c) { return charClasses[(uint8_t)c] & CHAR_DIGIT; };
+bool isAlpha(char c) { return charClasses[(uint8_t)c] & CHAR_ALPHA; };
+
+class Keyword {
+ public:
+  const char* name;
+  TokenType type;
+  int length;
+  constexpr Keyword(const char* name, TokenType type)
+      : name(name), type(type), length(0) {
+    while (name[length] != '\0') length++;
+  }
+};
+
+// the last entry never matches, it fills the empty hash slots.
+constexpr Keyword keywords[] = {
+    {"and", TOKEN_AND},       {"class", TOKEN_CLASS},
+    {"else", TOKEN_ELSE},     {"false", TOKEN_FALSE},
+    {"for", TOKEN_FOR},       {"fun", TOKEN_FUN},
+    {"if", TOKEN_IF},         {"nil", TOKEN_NIL},
+    {"or", TOKEN_OR},         {"print", TOKEN_PRINT},
+    {"return", TOKEN_RETURN}, {"super", TOKEN_SUPER},
+    {"this", TOKEN_THIS},     {"true", TOKEN_TRUE},
+    {"var", TOKEN_VAR},       {"while", TOKEN_WHILE},
+    {"yield", TOKEN_YIELD},
+    {"", TOKEN_IDENTIFIER},
 };
+constexpr int KEYWORD_NUMS = sizeof(keywords) / sizeof(keywords[0]) - 1;
+
+// perfect for the keywords above: every keyword lands in its own slot.
+#define KEYWORD_SLOTS 32
+constexpr int keywordHash(char first, char last, int length) {
+  return ((uint8_t)first * 7 + (uint8_t)last + length) & (KEYWORD_SLOTS - 1);
+}
+
+constexpr std::array<uint8_t, KEYWORD_SLOTS> makeKeywordSlots() {
+  std::array<uint8_t, KEYWORD_SLOTS> slots{};
+  for (auto& slot : slots) slot = KEYWORD_NUMS;
+  for (int i = 0; i < KEYWORD_NUMS; i++) {
+    auto& keyword = keywords[i];
+    slots[keywordHash(keyword.name[0], keyword.name[keyword.length - 1],
+                      keyword.length)] = i;
+  }
+  return slots;
+}
+
+constexpr std::array<uint8_t, KEYWORD_SLOTS> keywordSlots = makeKeywordSlots();
+
+// every keyword token has exactly one entry and none of them collide.
+constexpr bool keywordsComplete() {
+  if (KEYWORD_NUMS != TOKEN_YIELD - TOKEN_AND + 1) return false;
+  for (int i = 0; i < KEYWORD_NUMS; i++) {
+    auto& keyword = keywords[i];
+    if (keyword.type != TOKEN_AND + i) return false;
+    int slot = keywordHash(keyword.name[0], keyword.name[keyword.length - 1],
+                           keyword.length);
+    if (keywordSlots[slot] != i) return false;
+  }
+  return true;
+}
+static_assert(keywordsComplete(),
+              "keywords must cover every keyword token without collisions");
+
+// the characters a run continues through.
+enum ScanClass {
+  SCAN_SPACE,       // ' ', '\t', '\r' and '\n'
+  SCAN_IDENTIFIER,  // letters, digits and '_'
+  SCAN_DIGIT,
+  SCAN_COMMENT,  // anything up to a '\n'
+  SCAN_STRING,   // anything up to a '"'
+};
+
+// whether newlines can be part of the run and have to be counted.
+constexpr bool countsLines(ScanClass c) {
+  return c == SCAN_SPACE || c == SCAN_STRING;
+}
+
+template <ScanClass C>
+static inline bool inRun(char c) {
+  switch (C) {
+    case SCAN_SPACE:
+      return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    case SCAN_IDENTIFIER:
+      return isAlpha(c) || isDigit(c);
+    case SCAN_DIGIT:
+      return isDigit(c);
+    case SCAN_COMMENT:
+      return c != '\n';
+    case SCAN_STRING:
+      return c != '"';
+  }
+  return false;
+}
+
+template <ScanClass C>
+static const char* scanRunScalar(const char* p, const char* end, int* lines) {
+  for (; p < end && inRun<C>(*p); p++) {
+    if (countsLines(C) && *p == '\n') (*lines)++;
+  }
+  return p;
+}
+
+#ifdef SCANNER_SIMD
+// every lane is 0xff where the byte continues the run. bytes >= 0x80 compare
+// as negative and so never fall into a letter or digit range.
+static inline __m128i is16(__m128i c, char ch) {
+  return _mm_cmpeq_epi8(c, _mm_set1_epi8(ch));
+}
+
+static inline __m128i between16(__m128i c, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1)));
+}
+
+template <ScanClass C>
+static inline __m128i runMask16(__m128i c) {
+#define is(ch) is16(c, ch)
+#define between(v, lo, hi) between16(v, lo, hi)
+  switch (C) {
+    case SCAN_SPACE:
+      return _mm_or_si128(_mm_or_si128(is(' '), is('\t')),
+                          _mm_or_si128(is('\r'), is('\n')));
+    case SCAN_IDENTIFIER: {
+      __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+      return _mm_or_si128(_mm_or_si128(between(lower, 'a', 'z'), is('_')),
+                          between(c, '0', '9'));
+    }
+    case SCAN_DIGIT:
+      return between(c, '0', '9');
+    case SCAN_COMMENT:
+      return _mm_xor_si128(is('\n'), _mm_set1_epi8(-1));
+    case SCAN_STRING:
+      return _mm_xor_si128(is('"'), _mm_set1_epi8(-1));
+  }
+  return _mm_setzero_si128();
+#undef is
+#undef between
+}
+
+template <ScanClass C>
+static const char* scanRun16(const char* p, const char* end, int* lines) {
+  for (; end - p >= 16; p += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i*)p);
+    uint32_t stop = ~_mm_movemask_epi8(runMask16<C>(c)) & 0xffff;
+    uint32_t newlines = 0;
+    if (countsLines(C)) {
+      newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('\n')));
+    }
+    if (stop != 0) {
+      int length = __builtin_ctz(stop);
+      *lines += __builtin_popcount(newlines & ((1u << length) - 1));
+      return p + length;
+    }
+    *lines += __builtin_popcount(newlines);
+  }
+  return scanRunScalar<C>(p, end, lines);
+}
+
+__attribute__((target("avx2"))) static inline __m256i is32(__m256i c,
+                                                            char ch) {
+  return _mm256_cmpeq_epi8(c, _mm256_set1_epi8(ch));
+}
+
+__attribute__((target("avx2"))) static inline __m256i between32(__m256i c,
+                                                                 char lo,
+                                                                 char hi) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(lo - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), c));
+}
+
+template <ScanClass C>
+__attribute__((target("avx2"))) static inline __m256i runMask32(__m256i c) {
+#define is(ch) is32(c, ch)
+#define between(v, lo, hi) between32(v, lo, hi)
+  switch (C) {
+    case SCAN_SPACE:
+      return _mm256_or_si256(_mm256_or_si256(is(' '), is('\t')),
+                             _mm256_or_si256(is('\r'), is('\n')));
+    case SCAN_IDENTIFIER: {
+      __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+      return _mm256_or_si256(
+          _mm256_or_si256(between(lower, 'a', 'z'), is('_')),
+          between(c, '0', '9'));
+    }
+    case SCAN_DIGIT:
+      return between(c, '0', '9');
+    case SCAN_COMMENT:
+      return _mm256_xor_si256(is('\n'), _mm256_set1_epi8(-1));
+    case SCAN_STRING:
+      return _mm256_xor_si256(is('"'), _mm256_set1_epi8(-1));
+  }
+  return _mm256_setzero_si256();
+#undef is
+#undef between
+}
+
+template <ScanClass C>
+__attribute__((target("avx2"))) static const char* scanRun32(const char* p,
+                                                              const char* end,
+                                                              int* lines) {
+  for (; end - p >= 32; p += 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i*)p);
+    uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(runMask32<C>(c));
+    uint32_t newlines = 0;
+    if (countsLines(C)) {
+      newlines = _mm256_movemask_epi8(
+          _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')));
+    }
+    if (stop != 0) {
+      int length = __builtin_ctz(stop);
+      *lines += __builtin_popcount(newlines & (uint32_t)((1ull << length) - 1));
+      return p + length;
+    }
+    *lines += __builtin_popcount(newlines);
+  }
+  return scanRun16<C>(p, end, lines);
+}
+
+static const bool supportsAvx2 =
+    (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+#endif
+
+// most runs are a handful of bytes, too short to pay for vector loads.
+#define SCALAR_PREFIX 8
+
+// returns the end of the run starting at `p`, adding the newlines it spans to
+// `lines`.
+template <ScanClass C>
+static inline const char* scanRun(const char* p, const char* end, int* lines,
+                                  bool vectorized) {
+#ifdef SCANNER_SIMD
+  if (vectorized) {
+    const char* prefixEnd = end - p > SCALAR_PREFIX ? p + SCALAR_PREFIX : end;
+    p = scanRunScalar<C>(p, prefixEnd, lines);
+    if (p < prefixEnd) return p;
+    return supportsAvx2 ? scanRun32<C>(p, end, lines)
+                        : scanRun16<C>(p, end, lines);
+  }
+#endif
+  return scanRunScalar<C>(p, end, lines);
+}
 
 // implementations
-char Scanner::peek() { return *current; }
+char Scanner::peek() { return isAtEnd() ? '\0' : *current; }
 char Scanner::peekNext() {
-  if (isAtEnd()) return '\0';
+  if (end - current < 2) return '\0';
   return current[1];
 }
 
@@ -26,13 +298,10 @@ bool Scanner::match(char expected) {
 }
 
 Token Scanner::stringLiteral() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') line++;
-    advance();
-  }
+  current = scanRun<SCAN_STRING>(current, end, &line, vectorized);
 
   if (isAtEnd()) {
-    return errorToken("Unterminated string.");
+    return errorToken(scanErrors[SCAN_UNTERMINATED_STRING]);
   }
 
   advance();
@@ -40,66 +309,26 @@ Token Scanner::stringLiteral() {
 }
 
 Token Scanner::number() {
-  while (isDigit(peek())) advance();
-  if (peek() == '.' && isDigit(peekNext())) advance();
+  current = scanRun<SCAN_DIGIT>(current, end, &line, vectorized);
+  if (peek() == '.' && isDigit(peekNext())) {
+    advance();
+    current = scanRun<SCAN_DIGIT>(current, end, &line, vectorized);
+  }
 
   return makeToken(TOKEN_NUMBER);
 }
 
 Token Scanner::identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+  current = scanRun<SCAN_IDENTIFIER>(current, end, &line, vectorized);
 
   return makeToken(identifierType());
 }
 
 TokenType Scanner::identifierType() {
-  switch (start[0]) {
-    case 'a':
-      return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c':
-      return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e':
-      return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-      if (current - start > 1) {
-        switch (start[1]) {
-          case 'a':
-            return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o':
-            return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u':
-            return checkKeyword(2, 1, "n", TOKEN_FUN);
-        }
-      }
-      break;
-    case 'i':
-      return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n':
-      return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o':
-      return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p':
-      return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r':
-      return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-      return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-      if (current - start > 1) {
-        switch (start[1]) {
-          case 'h':
-            return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r':
-            return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-      }
-      break;
-    case 'v':
-      return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w':
-      return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-  }
-  return TOKEN_IDENTIFIER;
+  int length = static_cast<int>(current - start);
+  auto& keyword =
+      keywords[keywordSlots[keywordHash(start[0], current[-1], length)]];
+  return checkKeyword(0, keyword.length, keyword.name, keyword.type);
 }
 
 TokenType Scanner::checkKeyword(int begin, int length, const char* rest,
@@ -113,26 +342,9 @@ TokenType Scanner::checkKeyword(int begin, int length, const char* rest,
 
 void Scanner::skipWhitespace() {
   while (true) {
-    char c = peek();
-    switch (c) {
-      case ' ':
-      case '\r':
-      case '\t':
-        advance();
-        break;
-      case '\n':
-        line++;
-        advance();
-        break;
-      case '/':
-        if (peekNext() == '/') {
-          while (peek() != '\n' && !isAtEnd()) advance();
-        } else {
-          return;
-        }
-      default:
-        return;
-    }
+    current = scanRun<SCAN_SPACE>(current, end, &line, vectorized);
+    if (peek() != '/' || peekNext() != '/') return;
+    current = scanRun<SCAN_COMMENT>(current, end, &line, vectorized);
   }
 }
 
@@ -162,7 +374,7 @@ Token Scanner::scanToken() {
 
   auto c = advance();
   if (isAlpha(c)) return identifier();
-  if (isdigit(c)) return number();
+  if (isDigit(c)) return number();
 
   switch (c) {
     case '(':
@@ -173,6 +385,10 @@ Token Scanner::scanToken() {
       return makeToken(TOKEN_LEFT_BRACE);
     case '}':
       return makeToken(TOKEN_RIGHT_BRACE);
+    case '[':
+      return makeToken(TOKEN_LEFT_BRACKET);
+    case ']':
+      return makeToken(TOKEN_RIGHT_BRACKET);
     case ';':
       return makeToken(TOKEN_SEMICOLON);
     case ',':
@@ -199,7 +415,7 @@ Token Scanner::scanToken() {
       return stringLiteral();
   }
 
-  return errorToken("Unexpected Character.");
+  return errorToken(scanErrors[SCAN_UNEXPECTED_CHARACTER]);
 }
 
 bool identifiersEqual(Token* a, Token* b) {
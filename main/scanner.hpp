@@ -1,12 +1,16 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <string.h>
+
 enum TokenType {
   // Single-character tokens.
   TOKEN_LEFT_PAREN,
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA,
   TOKEN_DOT,
   TOKEN_MINUS,
@@ -47,6 +51,7 @@ enum TokenType {
   TOKEN_TRUE,
   TOKEN_VAR,
   TOKEN_WHILE,
+  TOKEN_YIELD,
 
   TOKEN_ERROR,
   TOKEN_EOF,
@@ -69,12 +74,23 @@ class Scanner {
  public:
   const char* start;
   const char* current;
+  const char* end;
   int line;
-  Scanner(const char* source) : start(source), current(source), line(1){};
+  // classify runs of whitespace, identifier and digit characters, comments
+  // and string bodies 16 or 32 bytes at a time where the cpu supports it.
+  bool vectorized = true;
+  Scanner(const char* source)
+      : Scanner(source,
+                source != nullptr ? source + strlen(source) : nullptr){};
+  Scanner(const char* source, const char* end)
+      : start(source), current(source), end(end), line(1){};
+  // the source doesn't have to be NUL terminated, e.g. a mapped file.
+  Scanner(const char* source, size_t length)
+      : Scanner(source, source + length){};
   Scanner(){};
   ~Scanner(){};
 
-  bool isAtEnd() { return *current == '\0'; }
+  bool isAtEnd() { return current >= end; }
   bool match(char expected);
   char advance();
   void skipWhitespace();
@@ -91,5 +107,14 @@ class Scanner {
   Token errorToken(const char* message);
 };
 
+// every message the scanner puts in an error token, so that a token stream can
+// store them by index.
+enum ScanError {
+  SCAN_UNTERMINATED_STRING,
+  SCAN_UNEXPECTED_CHARACTER,
+  SCAN_ERROR_NUMS,
+};
+extern const char* const scanErrors[SCAN_ERROR_NUMS];
+
 bool identifiersEqual(Token* a, Token* b);
 #endif
@@ -0,0 +1,298 @@
+#include "scheduler.hpp"
+
+#include "object.hpp"
+
+// spawn(fn[, value]) queues a call of fn, a function of at most one parameter
+// that closes over nothing, on the current worker and evaluates to its task.
+// any worker may run it, so `value` has to be shareable.
+bool spawnNative(VM* vm, int argCount, Value* args) {
+  if (argCount < 1 || argCount > 2 || !IS_CLOSURE(args[0]) ||
+      AS_CLOSURE(args[0])->upvalueCount > 0 ||
+      AS_CLOSURE(args[0])->function->arity > 1) {
+    vm->runtimeError(
+        "spawn() takes a function of at most one parameter that closes over "
+        "nothing, and an optional value.");
+    return false;
+  }
+  SharedValue argument;
+  if (argCount == 2 && !SharedValue::from(args[1], &argument)) {
+    vm->runtimeError(
+        "spawn() can only pass nil, a boolean, a number, a string, a task, a "
+        "channel or a buffer.");
+    return false;
+  }
+
+  auto task = std::make_shared<Task>(AS_CLOSURE(args[0])->function,
+                                     std::move(argument));
+  vm->worker->submit(task);
+  vm->stack_top -= argCount + 1;
+  vm->push(OBJ_VAL(allocateTaskObject(task, &vm->objects)));
+  return true;
+}
+
+// join(task) evaluates to what the task returned. the calling task is
+// suspended until then, so its worker can run something else meanwhile.
+bool joinNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_TASK(args[0])) {
+    vm->runtimeError("join() takes a task.");
+    return false;
+  }
+  Worker* worker = vm->worker;
+  auto task = AS_TASK(args[0]);
+  if (task == worker->running) {
+    vm->runtimeError("A task cannot join itself.");
+    return false;
+  }
+  // only the task's own fiber can be parked, not one it resumed.
+  if (vm->fiber == nullptr || vm->fiber->caller != nullptr) {
+    vm->runtimeError("Cannot join inside a fiber.");
+    return false;
+  }
+  vm->stack_top -= argCount + 1;
+
+  {
+    std::lock_guard<std::mutex> lock(task->mutex);
+    if (!task->done) {
+      task->waiters.push_back(
+          Resume{worker->index, vm->fiber, worker->running, task});
+      worker->blocked = true;
+    }
+  }
+  if (worker->blocked) {
+    vm->suspendFiber(NIL_VAL);
+    return true;
+  }
+  if (task->failed) {
+    vm->runtimeError("Joined task failed.");
+    return false;
+  }
+  vm->push(task->result.toValue(vm));
+  return true;
+}
+
+// a VM on `worker`'s thread that can spawn and join tasks.
+static VM* newWorkerVM(Worker* worker) {
+  auto vm = new VM();
+  vm->initVM();
+  vm->worker = worker;
+  vm->mapPool = worker->scheduler->mapPool;
+  vm->defineNative("spawn", 5, spawnNative);
+  vm->defineNative("join", 4, joinNative);
+  return vm;
+}
+
+Worker::Worker(Scheduler* scheduler, int index)
+    : index(index),
+      scheduler(scheduler),
+      vm(newWorkerVM(this)),
+      random(index + 1) {
+  // tasks may start before the script has defined anything.
+  vm->loadFunctions(scheduler->program);
+}
+
+VM* Worker::vmFor(const std::shared_ptr<Task>& task) {
+  return task == scheduler->script ? scheduler->scriptVm.get() : vm.get();
+}
+
+void Worker::loop() {
+  while (scheduler->unfinished.load() > 0 && !scheduler->stopped.load()) {
+    uint64_t seen = scheduler->epoch();
+    Resume next;
+    std::shared_ptr<Task> task;
+    if (takeResume(&next)) {
+      proceed(std::move(next));
+    } else if (takeTask(&task) || scheduler->steal(this, &task)) {
+      start(std::move(task));
+    } else if (!yielded.empty()) {
+      next = std::move(yielded.front());
+      yielded.pop_front();
+      proceed(std::move(next));
+    } else {
+      scheduler->idle(seen);
+    }
+  }
+  vm->output.flush();
+}
+
+void Worker::submit(std::shared_ptr<Task> task) {
+  scheduler->unfinished++;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    tasks.push_back(std::move(task));
+  }
+  scheduler->wake();
+}
+
+void Worker::resume(Resume resume) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    resumes.push_back(std::move(resume));
+  }
+  scheduler->wake();
+}
+
+bool Worker::takeResume(Resume* resume) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (resumes.empty()) return false;
+  *resume = std::move(resumes.front());
+  resumes.pop_front();
+  return true;
+}
+
+// the newest task is the likeliest to still be in cache.
+bool Worker::takeTask(std::shared_ptr<Task>* task) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (tasks.empty()) return false;
+  *task = std::move(tasks.back());
+  tasks.pop_back();
+  return true;
+}
+
+// from here on the task is pinned to this worker.
+void Worker::start(std::shared_ptr<Task> task) {
+  VM* runner = vmFor(task);
+  runner->push(
+      OBJ_VAL(allocateClosureObject(task->function, &runner->objects)));
+  auto fiber =
+      allocateFiberObject(AS_CLOSURE(runner->peek(0)), &runner->objects);
+  runner->pop();
+  runner->hostFibers.insert(fiber);
+
+  running = task;
+  Value argument = task->argument.take(runner);
+  settle(fiber, task, runner->runFiber(fiber, argument, false));
+}
+
+void Worker::proceed(Resume resume) {
+  VM* runner = vmFor(resume.task);
+  running = resume.task;
+  IntepretResult result;
+  if (resume.joined == nullptr) {
+    result = runner->runFiber(resume.fiber, NIL_VAL, false);
+  } else if (resume.joined->failed) {
+    // the error surfaces where join() was called.
+    runner->resumeFiber(resume.fiber, NIL_VAL);
+    runner->runtimeError("Joined task failed.");
+    result = INTERPRET_RUNTIME_ERROR;
+  } else {
+    Value value = resume.joined->result.toValue(runner);
+    result = runner->runFiber(resume.fiber, value, true);
+  }
+  settle(resume.fiber, resume.task, result);
+}
+
+// deals with a task's fiber once it is back on the host.
+void Worker::settle(ObjFiber* fiber, std::shared_ptr<Task> task,
+                    IntepretResult result) {
+  VM* runner = vmFor(task);
+  running = nullptr;
+  if (result != INTERPRET_OK) {
+    runner->hostFibers.erase(fiber);
+    scheduler->complete(task, SharedValue(), true);
+    return;
+  }
+
+  // what the fiber returned or yielded.
+  Value value = runner->pop();
+  if (fiber->state != FIBER_DONE) {
+    // a task blocked in join() or on a channel is resumed by whoever
+    // finishes the joined task or changes the channel, a plain `yield` lets
+    // everything else go first.
+    if (blocked) {
+      blocked = false;
+    } else {
+      yielded.push_back(Resume{index, fiber, task, nullptr});
+    }
+    return;
+  }
+
+  runner->hostFibers.erase(fiber);
+  SharedValue shared;
+  bool failed = !SharedValue::from(value, &shared);
+  if (failed) {
+    runner->output.flush();
+    fprintf(stderr,
+            "A task can only return nil, a boolean, a number, a string, a "
+            "task, a channel or a buffer.\n");
+  }
+  scheduler->complete(task, std::move(shared), failed);
+}
+
+Scheduler::Scheduler(std::shared_ptr<const Program> program, int workerCount,
+                     MapPool* mapPool)
+    : program(std::move(program)),
+      mapPool(mapPool),
+      unfinished(0),
+      stopped(false),
+      work(0) {
+  for (int i = 0; i < workerCount; i++) {
+    workers.emplace_back(new Worker(this, i));
+  }
+  scriptVm.reset(newWorkerVM(workers[0].get()));
+}
+
+bool Scheduler::run() {
+  script = std::make_shared<Task>(program->script, SharedValue());
+  unfinished = 1;
+  for (size_t i = 1; i < workers.size(); i++) {
+    workers[i]->thread = std::thread(&Worker::loop, workers[i].get());
+  }
+  // the script prints through worker 0, which is the calling thread.
+  workers[0]->start(script);
+  workers[0]->loop();
+  scriptVm->output.flush();
+  for (size_t i = 1; i < workers.size(); i++) workers[i]->thread.join();
+  return !script->failed;
+}
+
+// thieves take the oldest task of a random victim.
+bool Scheduler::steal(Worker* thief, std::shared_ptr<Task>* task) {
+  int count = workers.size();
+  int first = thief->random() % count;
+  for (int i = 0; i < count; i++) {
+    Worker* victim = workers[(first + i) % count].get();
+    if (victim == thief) continue;
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (victim->tasks.empty()) continue;
+    *task = std::move(victim->tasks.front());
+    victim->tasks.pop_front();
+    return true;
+  }
+  return false;
+}
+
+void Scheduler::complete(std::shared_ptr<Task> task, SharedValue result,
+                         bool failed) {
+  std::vector<Resume> waiters;
+  {
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->done = true;
+    task->failed = failed;
+    task->result = std::move(result);
+    waiters.swap(task->waiters);
+  }
+  for (auto& waiter : waiters) workers[waiter.worker]->resume(waiter);
+  if (failed && task == script) {
+    stopped = true;
+    wake();
+  }
+  if (--unfinished == 0) wake();
+}
+
+void Scheduler::wake() {
+  {
+    std::lock_guard<std::mutex> lock(idleMutex);
+    work++;
+  }
+  wakeup.notify_all();
+}
+
+uint64_t Scheduler::epoch() {
+  std::lock_guard<std::mutex> lock(idleMutex);
+  return work;
+}
+
+void Scheduler::idle(uint64_t seen) {
+  std::unique_lock<std::mutex> lock(idleMutex);
+  wakeup.wait(lock, [&] { return work != seen; });
+}
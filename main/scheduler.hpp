@@ -0,0 +1,133 @@
+#ifndef cpplox_scheduler_h
+#define cpplox_scheduler_h
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "program.hpp"
+#include "shared_value.hpp"
+#include "vm.hpp"
+
+class Scheduler;
+class Task;
+
+// a task's fiber to continue on the worker whose heap holds it.
+class Resume {
+ public:
+  int worker;
+  ObjFiber* fiber;
+  std::shared_ptr<Task> task;
+  // the task it waited for in join(), nullptr after a yield or a wait on a
+  // channel.
+  std::shared_ptr<Task> joined;
+};
+
+// a call to one of a program's functions, run by whichever worker gets to it
+// first. once done, `result` is never written again.
+class Task {
+ public:
+  ObjFunction* function;
+  SharedValue argument;
+
+  std::mutex mutex;
+  bool done = false;
+  bool failed = false;
+  SharedValue result;
+  std::vector<Resume> waiters;
+
+  Task(ObjFunction* function, SharedValue argument)
+      : function(function), argument(std::move(argument)){};
+};
+
+// a thread with its own VM. tasks that haven't started wait in `tasks`: the
+// worker takes the newest, thieves take the oldest. a task that has started
+// lives in its worker's heap, so its resumes only ever go to that worker.
+class Worker {
+ public:
+  int index;
+  Scheduler* scheduler;
+  std::unique_ptr<VM> vm;
+  std::thread thread;
+
+  std::mutex mutex;
+  std::deque<std::shared_ptr<Task>> tasks;
+  std::deque<Resume> resumes;
+  // tasks that yielded. only the worker touches them, and only once it has
+  // nothing newer to do.
+  std::deque<Resume> yielded;
+  std::minstd_rand random;
+
+  // the task on the VM right now, and whether it just blocked in join() or
+  // on a channel.
+  std::shared_ptr<Task> running;
+  bool blocked = false;
+
+  Worker(Scheduler* scheduler, int index);
+
+  void loop();
+  void submit(std::shared_ptr<Task> task);
+  void resume(Resume resume);
+  void start(std::shared_ptr<Task> task);
+  // the VM whose heap holds `task`, the script's own on worker 0.
+  VM* vmFor(const std::shared_ptr<Task>& task);
+
+ private:
+  bool takeResume(Resume* resume);
+  bool takeTask(std::shared_ptr<Task>* task);
+  void proceed(Resume resume);
+  void settle(ObjFiber* fiber, std::shared_ptr<Task> task,
+              IntepretResult result);
+};
+
+// runs a program's `spawn`ed tasks on a fixed set of workers, M tasks on N
+// threads. each worker's VM sees the program's top-level functions as globals
+// and defines spawn() and join().
+class Scheduler {
+ public:
+  std::shared_ptr<const Program> program;
+  // handed to every worker's VM, may be null.
+  MapPool* mapPool;
+  std::vector<std::unique_ptr<Worker>> workers;
+  // worker 0 runs the script in a VM of its own, so its variables never
+  // become globals of the tasks that happen to run on that worker.
+  std::unique_ptr<VM> scriptVm;
+  std::shared_ptr<Task> script;
+  // tasks spawned and not done yet. workers stop once it drops to zero.
+  std::atomic<int> unfinished;
+  // set when the script fails. workers stop and abandon the tasks left, which
+  // may be waiting for the script.
+  std::atomic<bool> stopped;
+
+  Scheduler(std::shared_ptr<const Program> program, int workerCount,
+            MapPool* mapPool = nullptr);
+
+  // runs the script as the first task, on worker 0, until every task is done
+  // or the script fails. false if the script failed.
+  bool run();
+  VM* vm(int worker) { return workers[worker]->vm.get(); }
+
+  bool steal(Worker* thief, std::shared_ptr<Task>* task);
+  void complete(std::shared_ptr<Task> task, SharedValue result, bool failed);
+  // bumps the epoch: new work, a resume or the end of the run.
+  void wake();
+  // read before looking for work, and handed to idle() if none was found.
+  uint64_t epoch();
+  // sleeps until someone wakes the workers after `seen` was read, so a
+  // wakeup that comes in while the worker is still looking is never lost.
+  void idle(uint64_t seen);
+
+ private:
+  std::mutex idleMutex;
+  std::condition_variable wakeup;
+  // guarded by idleMutex.
+  uint64_t work;
+};
+
+#endif
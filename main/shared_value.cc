@@ -0,0 +1,105 @@
+#include "shared_value.hpp"
+
+#include "object.hpp"
+#include "vm.hpp"
+
+bool SharedValue::sendable(Value value) {
+  return !IS_OBJ(value) || IS_STRING(value) || IS_TASK(value) ||
+         IS_CHANNEL(value) || IS_BUFFER(value);
+}
+
+SharedKind SharedValue::kindOf(Value value) {
+  if (IS_NIL(value)) return SHARED_NIL;
+  if (IS_BOOL(value)) return SHARED_BOOL;
+  if (IS_NUMBER(value)) return SHARED_NUMBER;
+  if (IS_STRING(value)) return SHARED_STRING;
+  if (IS_TASK(value)) return SHARED_TASK;
+  if (IS_CHANNEL(value)) return SHARED_CHANNEL;
+  return SHARED_BUFFER;
+}
+
+bool SharedValue::from(Value value, SharedValue* shared) {
+  switch (value.type) {
+    case VAL_NIL:
+      shared->kind = SHARED_NIL;
+      return true;
+    case VAL_BOOL:
+      shared->kind = SHARED_BOOL;
+      shared->boolean = AS_BOOL(value);
+      return true;
+    case VAL_NUMBER:
+    case VAL_INT:
+      shared->kind = SHARED_NUMBER;
+      shared->number = AS_NUMBER(value);
+      return true;
+    case VAL_OBJ:
+      if (IS_STRING(value)) {
+        ObjString* string = AS_STRING(value);
+        if (string->shared == nullptr) {
+          string->shared = std::make_shared<const std::string>(string->str);
+        }
+        shared->kind = SHARED_STRING;
+        shared->string = string->shared;
+        shared->hash = string->hash;
+        return true;
+      }
+      if (IS_TASK(value)) {
+        shared->kind = SHARED_TASK;
+        shared->task = AS_TASK(value);
+        return true;
+      }
+      if (IS_CHANNEL(value)) {
+        shared->kind = SHARED_CHANNEL;
+        shared->channel = AS_CHANNEL(value);
+        return true;
+      }
+      if (IS_BUFFER(value)) {
+        shared->kind = SHARED_BUFFER;
+        shared->buffer = std::move(AS_BUFFER(value)->values);
+        AS_BUFFER(value)->values.clear();
+        return true;
+      }
+      return false;
+  }
+  return false;  // unreachable
+}
+
+Value SharedValue::toValue(VM* vm) const {
+  switch (kind) {
+    case SHARED_NIL:
+      return NIL_VAL;
+    case SHARED_BOOL:
+      return BOOL_VAL(boolean);
+    case SHARED_NUMBER:
+      return packNumber(number);
+    case SHARED_STRING: {
+      // only copied if `vm` doesn't have the string yet.
+      ObjString* interned =
+          allocateStringObject(string->data(), string->size(), hash,
+                               &vm->strings, &vm->objects);
+      // sending it on from here won't copy it again.
+      if (interned->shared == nullptr) interned->shared = string;
+      return OBJ_VAL(interned);
+    }
+    case SHARED_TASK:
+      return OBJ_VAL(allocateTaskObject(task, &vm->objects));
+    case SHARED_CHANNEL:
+      return OBJ_VAL(allocateChannelObject(channel, &vm->objects));
+    case SHARED_BUFFER: {
+      ObjBuffer* copy = allocateBufferObject(0, &vm->objects);
+      copy->values = buffer;
+      return OBJ_VAL(copy);
+    }
+    case SHARED_ANY:
+      break;
+  }
+  return NIL_VAL;  // unreachable
+}
+
+Value SharedValue::take(VM* vm) {
+  if (kind != SHARED_BUFFER) return toValue(vm);
+  ObjBuffer* received = allocateBufferObject(0, &vm->objects);
+  received->values = std::move(buffer);
+  buffer.clear();
+  return OBJ_VAL(received);
+}
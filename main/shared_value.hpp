@@ -0,0 +1,59 @@
+#ifndef cpplox_shared_value_h
+#define cpplox_shared_value_h
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "value.hpp"
+
+class Channel;
+class Task;
+class VM;
+
+enum SharedKind : uint8_t {
+  SHARED_NIL,
+  SHARED_BOOL,
+  SHARED_NUMBER,
+  SHARED_STRING,
+  SHARED_TASK,
+  SHARED_CHANNEL,
+  SHARED_BUFFER,
+  // not a value: what a channel that takes any kind of value accepts.
+  SHARED_ANY,
+};
+
+// a value on its way from one VM's heap to another's. only immutable data,
+// handles on thread-safe objects and buffers cross: nil, booleans, numbers,
+// strings, tasks, channels and buffers. a string's characters are copied
+// into shared storage once, and sending the string on from any heap reuses
+// that storage. a heap that receives it still copies the characters into its
+// own string, unless it has the string interned already, so that strings
+// that never leave their VM pay nothing for it. a buffer's doubles are
+// handed over instead: the sender's buffer is left empty.
+class SharedValue {
+ public:
+  SharedKind kind = SHARED_NIL;
+  bool boolean = false;
+  double number = 0;
+  std::shared_ptr<const std::string> string;
+  uint32_t hash = 0;
+  std::shared_ptr<Task> task;
+  std::shared_ptr<Channel> channel;
+  std::vector<double> buffer;
+
+  // whether `value` can leave its VM. a closure can't, for one.
+  static bool sendable(Value value);
+  // what `value` crosses as, if it is sendable.
+  static SharedKind kindOf(Value value);
+  // false, leaving `value` as it is, if it isn't sendable.
+  static bool from(Value value, SharedValue* shared);
+  // the value in `vm`'s heap. a buffer is copied, for values that are read
+  // more than once, like a task's result.
+  Value toValue(VM* vm) const;
+  // the value in `vm`'s heap, handing a buffer over. for values read once.
+  Value take(VM* vm);
+};
+
+#endif
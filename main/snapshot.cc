@@ -0,0 +1,642 @@
+#include "snapshot.hpp"
+
+#include <unordered_map>
+
+#include "bytecode.hpp"
+#include "hash_map.hpp"
+#include "mapped_file.hpp"
+
+// payloads are written grouped in this order so that the loader only ever
+// follows references to objects it has already created.
+static const ObjType snapshotOrder[] = {OBJ_FUNCTION, OBJ_NATIVE, OBJ_CLOSURE,
+                                        OBJ_UPVALUE, OBJ_ARRAY, OBJ_MAP,
+                                        OBJ_CLASS, OBJ_INSTANCE,
+                                        OBJ_BOUND_METHOD};
+
+class SnapshotWriter : public ImageWriter {
+ public:
+  VM* vm;
+  bool ok;
+  std::vector<ObjString*> strings;
+  std::unordered_map<std::string, uint32_t> stringIndexes;
+  std::unordered_map<Obj*, uint32_t> objectIndexes;
+  std::vector<Obj*> objects;
+  // a shape's index in its class's `shapes`.
+  std::unordered_map<Shape*, uint32_t> shapeIndexes;
+  SnapshotWriter(VM* vm) : vm(vm), ok(true){};
+
+  uint32_t addString(ObjString* string);
+  void collect(Value value);
+  void collect(Obj* object);
+  ObjString* nativeName(Obj* native);
+  void writeValue(Value value);
+  void writeObject(Obj* object);
+};
+
+uint32_t SnapshotWriter::addString(ObjString* string) {
+  auto found = stringIndexes.find(string->str);
+  if (found != stringIndexes.end()) return found->second;
+
+  uint32_t index = strings.size();
+  strings.push_back(string);
+  stringIndexes[string->str] = index;
+  return index;
+}
+
+void SnapshotWriter::collect(Value value) {
+  if (!IS_OBJ(value)) return;
+  if (IS_STRING(value)) {
+    addString(AS_STRING(value));
+  } else {
+    collect(AS_OBJ(value));
+  }
+}
+
+void SnapshotWriter::collect(Obj* object) {
+  if (objectIndexes.count(object)) return;
+  objectIndexes[object] = 0;
+
+  switch (object->type) {
+    case OBJ_FUNCTION: {
+      auto function = (ObjFunction*)object;
+      // the image holds bytecode only, not the source a lazy body needs.
+      if (function->lazy != nullptr && !vm->compileLazy(function)) {
+        ok = false;
+        return;
+      }
+      if (function->name != nullptr) addString(function->name);
+      for (auto value : function->chunk.constants.values) collect(value);
+      break;
+    }
+    case OBJ_NATIVE:
+      if (nativeName(object) == nullptr) ok = false;
+      break;
+    case OBJ_CLOSURE: {
+      auto closure = (ObjClosure*)object;
+      collect(closure->function);
+      for (auto upvalue : closure->upvalues) collect(upvalue);
+      break;
+    }
+    case OBJ_UPVALUE: {
+      auto upvalue = (ObjUpvalue*)object;
+      // an idle VM has no open upvalues left.
+      if (upvalue->location != &upvalue->closed) ok = false;
+      collect(upvalue->closed);
+      break;
+    }
+    case OBJ_ARRAY:
+      for (auto value : ((ObjArray*)object)->values) collect(value);
+      break;
+    case OBJ_MAP:
+      for (auto& entry : ((ObjMap*)object)->entries) {
+        if (entry.removed) continue;
+        collect(entry.key);
+        collect(entry.value);
+      }
+      break;
+    case OBJ_CLASS: {
+      auto klass = (ObjClass*)object;
+      addString(klass->name);
+      auto methods = klass->methods.entries;
+      for (size_t i = 0; i < methods->capacity(); i++) {
+        Entry* entry = &(*methods)[i];
+        if (entry->key == NULL) continue;
+        addString(entry->key);
+        collect(entry->value);
+      }
+      for (size_t i = 0; i < klass->shapes.size(); i++) {
+        Shape* shape = klass->shapes[i].get();
+        shapeIndexes[shape] = i;
+        if (shape->name != nullptr) addString(shape->name);
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      auto instance = (ObjInstance*)object;
+      collect(instance->klass);
+      for (auto value : instance->fields) collect(value);
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      auto bound = (ObjBoundMethod*)object;
+      collect(bound->receiver);
+      collect(bound->method);
+      break;
+    }
+    default:
+      ok = false;
+      return;
+  }
+  objects.push_back(object);
+}
+
+ObjString* SnapshotWriter::nativeName(Obj* native) {
+  auto entries = vm->natives.entries;
+  for (size_t i = 0; i < entries->capacity(); i++) {
+    Entry* entry = &(*entries)[i];
+    if (entry->key != NULL && IS_OBJ(entry->value) &&
+        AS_OBJ(entry->value) == native) {
+      return entry->key;
+    }
+  }
+  return nullptr;
+}
+
+void SnapshotWriter::writeValue(Value value) {
+  if (IS_NIL(value)) {
+    writeU8(CONSTANT_NIL);
+  } else if (IS_BOOL(value)) {
+    writeU8(AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+  } else if (IS_NUMBER(value)) {
+    writeU8(CONSTANT_NUMBER);
+    writeF64(AS_NUMBER(value));
+  } else if (IS_STRING(value)) {
+    writeU8(CONSTANT_STRING);
+    writeU32(stringIndexes[AS_STRING(value)->str]);
+  } else {
+    writeU8(CONSTANT_OBJECT);
+    writeU32(objectIndexes[AS_OBJ(value)]);
+  }
+}
+
+void SnapshotWriter::writeObject(Obj* object) {
+  switch (object->type) {
+    case OBJ_FUNCTION: {
+      auto function = (ObjFunction*)object;
+      writeU32(function->name == nullptr ? UINT32_MAX
+                                         : stringIndexes[function->name->str]);
+      writeU32(function->arity);
+      writeU32(function->upvalueCount);
+      writeU32(function->cacheCount);
+
+      auto& chunk = function->chunk;
+      writeU32(chunk.code.size());
+      write(chunk.code.data(), chunk.code.size());
+      align();
+      write(chunk.lines.data(), chunk.lines.size() * sizeof(int));
+      writeU32(chunk.constants.values.size());
+      for (auto value : chunk.constants.values) writeValue(value);
+      break;
+    }
+    case OBJ_NATIVE:
+      writeU32(stringIndexes[nativeName(object)->str]);
+      break;
+    case OBJ_CLOSURE: {
+      auto closure = (ObjClosure*)object;
+      writeU32(objectIndexes[closure->function]);
+      writeU32(closure->upvalues.size());
+      for (auto upvalue : closure->upvalues) {
+        writeU32(objectIndexes[upvalue]);
+      }
+      break;
+    }
+    case OBJ_UPVALUE:
+      writeValue(((ObjUpvalue*)object)->closed);
+      break;
+    case OBJ_ARRAY: {
+      auto& values = ((ObjArray*)object)->values;
+      writeU32(values.size());
+      for (auto value : values) writeValue(value);
+      break;
+    }
+    case OBJ_MAP: {
+      // live entries in insertion order, the index is rebuilt on load.
+      auto map = (ObjMap*)object;
+      writeU32(map->count);
+      for (auto& entry : map->entries) {
+        if (entry.removed) continue;
+        writeValue(entry.key);
+        writeValue(entry.value);
+      }
+      break;
+    }
+    case OBJ_CLASS: {
+      auto klass = (ObjClass*)object;
+      writeU32(stringIndexes[klass->name->str]);
+      writeValue(klass->initializer == nullptr ? NIL_VAL
+                                               : OBJ_VAL(klass->initializer));
+      writeU32(klass->slotHint);
+
+      auto methods = klass->methods.entries;
+      uint32_t methodCount = 0;
+      for (size_t i = 0; i < methods->capacity(); i++) {
+        if ((*methods)[i].key != NULL) methodCount++;
+      }
+      writeU32(methodCount);
+      for (size_t i = 0; i < methods->capacity(); i++) {
+        Entry* entry = &(*methods)[i];
+        if (entry->key == NULL) continue;
+        writeU32(stringIndexes[entry->key->str]);
+        writeValue(entry->value);
+      }
+
+      // parents come before the shapes they lead to, the root first.
+      writeU32(klass->shapes.size());
+      for (size_t i = 1; i < klass->shapes.size(); i++) {
+        Shape* shape = klass->shapes[i].get();
+        writeU32(shapeIndexes[shape->parent]);
+        writeU32(stringIndexes[shape->name->str]);
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      auto instance = (ObjInstance*)object;
+      writeU32(shapeIndexes[instance->shape]);
+      writeU32(instance->fields.size());
+      for (auto value : instance->fields) writeValue(value);
+      break;
+    }
+    case OBJ_BOUND_METHOD: {
+      auto bound = (ObjBoundMethod*)object;
+      writeValue(bound->receiver);
+      writeU32(objectIndexes[bound->method]);
+      break;
+    }
+    default:
+      break;
+  }
+  align();
+}
+
+bool serializeHeap(VM* vm, std::vector<uint8_t>* image) {
+  if (vm->frameCount != 0) return false;
+
+  SnapshotWriter writer(vm);
+  auto strings = vm->strings.entries;
+  for (size_t i = 0; i < strings->capacity(); i++) {
+    if ((*strings)[i].key != NULL) writer.addString((*strings)[i].key);
+  }
+  auto globals = vm->globals.entries;
+  for (size_t i = 0; i < globals->capacity(); i++) {
+    Entry* entry = &(*globals)[i];
+    if (entry->key == NULL) continue;
+    writer.addString(entry->key);
+    writer.collect(entry->value);
+  }
+  // natives are looked up by name when the snapshot is loaded.
+  for (auto object : writer.objects) {
+    if (object->type == OBJ_NATIVE) writer.addString(writer.nativeName(object));
+  }
+  if (!writer.ok) return false;
+
+  std::vector<Obj*> ordered;
+  for (auto type : snapshotOrder) {
+    for (auto object : writer.objects) {
+      if (object->type != type) continue;
+      writer.objectIndexes[object] = ordered.size();
+      ordered.push_back(object);
+    }
+  }
+
+  writer.writeU32(SNAPSHOT_MAGIC);
+  writer.writeU32(SNAPSHOT_VERSION);
+  writer.writeU32(writer.strings.size());
+  for (auto string : writer.strings) {
+    writer.writeU32(string->hash);
+    writer.writeU32(string->str.size());
+    writer.write(string->str.data(), string->str.size());
+  }
+  writer.align();
+
+  writer.writeU32(ordered.size());
+  for (auto object : ordered) writer.writeU8(object->type);
+  writer.align();
+  for (auto object : ordered) {
+    if (object->type != OBJ_INSTANCE) continue;
+    writer.writeU32(writer.objectIndexes[((ObjInstance*)object)->klass]);
+  }
+  for (auto object : ordered) writer.writeObject(object);
+
+  // the table's count includes tombstones, so count live entries.
+  uint32_t globalCount = 0;
+  for (size_t i = 0; i < globals->capacity(); i++) {
+    if ((*globals)[i].key != NULL) globalCount++;
+  }
+  writer.writeU32(globalCount);
+  for (size_t i = 0; i < globals->capacity(); i++) {
+    Entry* entry = &(*globals)[i];
+    if (entry->key == NULL) continue;
+    writer.writeU32(writer.stringIndexes[entry->key->str]);
+    writer.writeValue(entry->value);
+  }
+
+  *image = std::move(writer.out);
+  return true;
+}
+
+class SnapshotReader : public ImageReader {
+ public:
+  VM* vm;
+  std::vector<ObjString*> strings;
+  std::vector<Obj*> objects;
+  SnapshotReader(const uint8_t* data, size_t size, VM* vm)
+      : ImageReader(data, size), vm(vm){};
+
+  ObjString* readString();
+  Obj* readObject(ObjType type);
+  bool readHeapValue(Value* value);
+  bool readFunction(ObjFunction* function);
+  bool readClosure(size_t index);
+  bool readArray(ObjArray* array);
+  bool readMap(ObjMap* map);
+  bool readClass(ObjClass* klass);
+  bool readInstance(ObjInstance* instance);
+  bool readBoundMethod(ObjBoundMethod* bound);
+};
+
+ObjString* SnapshotReader::readString() {
+  uint32_t index = readValue<uint32_t>();
+  return index < strings.size() ? strings[index] : nullptr;
+}
+
+// returns the already created object at the next index if it has `type`.
+Obj* SnapshotReader::readObject(ObjType type) {
+  uint32_t index = readValue<uint32_t>();
+  if (index >= objects.size() || objects[index] == nullptr) return nullptr;
+  return objects[index]->type == type ? objects[index] : nullptr;
+}
+
+bool SnapshotReader::readHeapValue(Value* value) {
+  switch (readValue<uint8_t>()) {
+    case CONSTANT_NIL:
+      *value = NIL_VAL;
+      return ok;
+    case CONSTANT_FALSE:
+      *value = BOOL_VAL(false);
+      return ok;
+    case CONSTANT_TRUE:
+      *value = BOOL_VAL(true);
+      return ok;
+    case CONSTANT_NUMBER:
+      *value = packNumber(readValue<double>());
+      return ok;
+    case CONSTANT_STRING: {
+      auto string = readString();
+      *value = OBJ_VAL(string);
+      return string != nullptr;
+    }
+    case CONSTANT_OBJECT: {
+      uint32_t index = readValue<uint32_t>();
+      if (index >= objects.size() || objects[index] == nullptr) return false;
+      *value = OBJ_VAL(objects[index]);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+bool SnapshotReader::readFunction(ObjFunction* function) {
+  uint32_t nameIndex = readValue<uint32_t>();
+  function->arity = readValue<uint32_t>();
+  function->upvalueCount = readValue<uint32_t>();
+  function->cacheCount = readValue<uint32_t>();
+  uint32_t codeLength = readValue<uint32_t>();
+  auto code = read(codeLength);
+  align();
+  auto lines = read(codeLength * sizeof(int));
+  uint32_t constantCount = readValue<uint32_t>();
+  if (!ok || constantCount > remaining()) return false;
+
+  if (nameIndex != UINT32_MAX) {
+    if (nameIndex >= strings.size()) return false;
+    auto name = strings[nameIndex];
+    function->name =
+        new ObjString(name->str.data(), name->str.size(), name->hash);
+  }
+
+  auto& chunk = function->chunk;
+  chunk.code.assign(code, code + codeLength);
+  chunk.lines.resize(codeLength);
+  memcpy(chunk.lines.data(), lines, codeLength * sizeof(int));
+  chunk.constants.values.reserve(constantCount);
+  for (uint32_t i = 0; i < constantCount; i++) {
+    Value value;
+    if (!readHeapValue(&value)) return false;
+    chunk.constants.writeValueArray(value);
+  }
+  return true;
+}
+
+bool SnapshotReader::readClosure(size_t index) {
+  auto function = (ObjFunction*)readObject(OBJ_FUNCTION);
+  uint32_t upvalueCount = readValue<uint32_t>();
+  if (function == nullptr || (int)upvalueCount != function->upvalueCount) {
+    return false;
+  }
+
+  auto closure = allocateClosureObject(function, &vm->objects);
+  for (uint32_t i = 0; i < upvalueCount; i++) {
+    closure->upvalues[i] = (ObjUpvalue*)readObject(OBJ_UPVALUE);
+    if (closure->upvalues[i] == nullptr) return false;
+  }
+  objects[index] = closure;
+  return true;
+}
+
+bool SnapshotReader::readArray(ObjArray* array) {
+  uint32_t count = readValue<uint32_t>();
+  if (!ok || count > remaining()) return false;
+  array->values.resize(count);
+  for (auto& value : array->values) {
+    if (!readHeapValue(&value)) return false;
+  }
+  return true;
+}
+
+bool SnapshotReader::readMap(ObjMap* map) {
+  uint32_t count = readValue<uint32_t>();
+  if (!ok || count > remaining()) return false;
+  for (uint32_t i = 0; i < count; i++) {
+    Value key, value;
+    if (!readHeapValue(&key) || !readHeapValue(&value) || !isMapKey(key)) {
+      return false;
+    }
+    map->set(key, value);
+  }
+  return true;
+}
+
+bool SnapshotReader::readClass(ObjClass* klass) {
+  klass->name = readString();
+  Value initializer;
+  if (klass->name == nullptr || !readHeapValue(&initializer)) return false;
+  if (IS_CLOSURE(initializer)) {
+    klass->initializer = AS_CLOSURE(initializer);
+  } else if (!IS_NIL(initializer)) {
+    return false;
+  }
+  klass->slotHint = readValue<uint32_t>();
+
+  uint32_t methodCount = readValue<uint32_t>();
+  if (!ok || methodCount > remaining()) return false;
+  for (uint32_t i = 0; i < methodCount; i++) {
+    auto name = readString();
+    Value method;
+    if (name == nullptr || !readHeapValue(&method) || !IS_CLOSURE(method)) {
+      return false;
+    }
+    klass->methods.set(name, method);
+  }
+
+  uint32_t shapeCount = readValue<uint32_t>();
+  if (!ok || shapeCount == 0 || shapeCount > remaining()) return false;
+  for (uint32_t i = 1; i < shapeCount; i++) {
+    uint32_t parentIndex = readValue<uint32_t>();
+    auto name = readString();
+    if (parentIndex >= i || name == nullptr) return false;
+    Shape* parent = klass->shapes[parentIndex].get();
+    klass->shapes.emplace_back(new Shape(klass, parent, name));
+    parent->transitions.push_back(klass->shapes.back().get());
+  }
+  return ok;
+}
+
+bool SnapshotReader::readInstance(ObjInstance* instance) {
+  auto& shapes = instance->klass->shapes;
+  uint32_t shapeIndex = readValue<uint32_t>();
+  uint32_t fieldCount = readValue<uint32_t>();
+  if (!ok || shapeIndex >= shapes.size() ||
+      (int)fieldCount != shapes[shapeIndex]->slotCount) {
+    return false;
+  }
+  instance->shape = shapes[shapeIndex].get();
+  instance->fields.resize(fieldCount);
+  for (auto& field : instance->fields) {
+    if (!readHeapValue(&field)) return false;
+  }
+  return true;
+}
+
+bool SnapshotReader::readBoundMethod(ObjBoundMethod* bound) {
+  if (!readHeapValue(&bound->receiver)) return false;
+  bound->method = (ObjClosure*)readObject(OBJ_CLOSURE);
+  return bound->method != nullptr;
+}
+
+bool deserializeHeap(const uint8_t* data, size_t size, VM* vm) {
+  if (vm->frameCount != 0) return false;
+
+  SnapshotReader reader(data, size, vm);
+  if (reader.readValue<uint32_t>() != SNAPSHOT_MAGIC) return false;
+  if (reader.readValue<uint32_t>() != SNAPSHOT_VERSION) return false;
+
+  uint32_t stringCount = reader.readValue<uint32_t>();
+  for (uint32_t i = 0; i < stringCount && reader.ok; i++) {
+    uint32_t hash = reader.readValue<uint32_t>();
+    uint32_t length = reader.readValue<uint32_t>();
+    auto chars = (const char*)reader.read(length);
+    if (!reader.ok) return false;
+    reader.strings.push_back(allocateStringObject(chars, length, hash,
+                                                  &vm->strings, &vm->objects));
+  }
+  reader.align();
+
+  uint32_t objectCount = reader.readValue<uint32_t>();
+  auto tags = reader.read(objectCount);
+  reader.align();
+  if (!reader.ok) return false;
+
+  // everything but closures and natives can be referenced before its payload
+  // is read, so create it up front and fill it in below. instances name
+  // their class ahead of the payloads to be created with it.
+  reader.objects.resize(objectCount, nullptr);
+  for (uint32_t i = 0; i < objectCount; i++) {
+    if (tags[i] == OBJ_FUNCTION) {
+      reader.objects[i] = allocateFunctionObject(&vm->objects);
+    } else if (tags[i] == OBJ_UPVALUE) {
+      auto upvalue = allocateUpvalueObject(nullptr, &vm->objects);
+      upvalue->location = &upvalue->closed;
+      reader.objects[i] = upvalue;
+    } else if (tags[i] == OBJ_ARRAY) {
+      reader.objects[i] = allocateArrayObject(&vm->objects);
+    } else if (tags[i] == OBJ_MAP) {
+      reader.objects[i] = allocateMapObject(&vm->objects);
+    } else if (tags[i] == OBJ_CLASS) {
+      reader.objects[i] = allocateClassObject(nullptr, &vm->objects);
+    } else if (tags[i] == OBJ_BOUND_METHOD) {
+      reader.objects[i] =
+          allocateBoundMethodObject(NIL_VAL, nullptr, &vm->objects);
+    }
+  }
+  for (uint32_t i = 0; i < objectCount; i++) {
+    if (tags[i] != OBJ_INSTANCE) continue;
+    auto klass = (ObjClass*)reader.readObject(OBJ_CLASS);
+    if (klass == nullptr) return false;
+    reader.objects[i] = allocateInstanceObject(klass, &vm->objects);
+  }
+
+  for (uint32_t i = 0; i < objectCount; i++) {
+    switch (tags[i]) {
+      case OBJ_FUNCTION:
+        if (!reader.readFunction((ObjFunction*)reader.objects[i])) {
+          return false;
+        }
+        break;
+      case OBJ_NATIVE: {
+        auto name = reader.readString();
+        Value native;
+        if (name == nullptr || !vm->natives.get(name, &native)) return false;
+        reader.objects[i] = AS_OBJ(native);
+        break;
+      }
+      case OBJ_CLOSURE:
+        if (!reader.readClosure(i)) return false;
+        break;
+      case OBJ_UPVALUE:
+        if (!reader.readHeapValue(&((ObjUpvalue*)reader.objects[i])->closed)) {
+          return false;
+        }
+        break;
+      case OBJ_ARRAY:
+        if (!reader.readArray((ObjArray*)reader.objects[i])) return false;
+        break;
+      case OBJ_MAP:
+        if (!reader.readMap((ObjMap*)reader.objects[i])) return false;
+        break;
+      case OBJ_CLASS:
+        if (!reader.readClass((ObjClass*)reader.objects[i])) return false;
+        break;
+      case OBJ_INSTANCE:
+        if (!reader.readInstance((ObjInstance*)reader.objects[i])) {
+          return false;
+        }
+        break;
+      case OBJ_BOUND_METHOD:
+        if (!reader.readBoundMethod((ObjBoundMethod*)reader.objects[i])) {
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+    reader.align();
+  }
+
+  // closures in the code need the upvalue counts of functions read later.
+  for (uint32_t i = 0; i < objectCount; i++) {
+    if (tags[i] == OBJ_FUNCTION &&
+        !verifyFunction((ObjFunction*)reader.objects[i])) {
+      return false;
+    }
+  }
+
+  uint32_t globalCount = reader.readValue<uint32_t>();
+  for (uint32_t i = 0; i < globalCount; i++) {
+    auto name = reader.readString();
+    Value value;
+    if (name == nullptr || !reader.readHeapValue(&value)) return false;
+    vm->globals.set(name, value);
+  }
+  return reader.ok;
+}
+
+bool writeSnapshotFile(const char* path, VM* vm) {
+  std::vector<uint8_t> image;
+  return serializeHeap(vm, &image) && writeImageFile(path, image);
+}
+
+bool loadSnapshotFile(const char* path, VM* vm) {
+  MappedFile file{};
+  return file.map(path) && deserializeHeap(file.data, file.size, vm);
+}
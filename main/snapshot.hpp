@@ -0,0 +1,29 @@
+#ifndef cpplox_snapshot_h
+#define cpplox_snapshot_h
+
+#include "common.hpp"
+#include "vm.hpp"
+
+// a heap snapshot holds every interned string plus everything reachable from
+// the globals of an idle VM. objects refer to each other by index, so the
+// image can be mapped anywhere and relocated while it is loaded:
+//   header    magic, version, string count
+//   strings   hash, length, bytes
+//   objects   object count, one tag per object, the class of every instance,
+//             then the payloads in tag order: functions, natives (by name),
+//             closures, upvalues, arrays, maps, classes with their methods and
+//             shapes, instances, bound methods. property caches are left out,
+//             they fill again as the loading VM runs
+//   globals   count, then name string index and value
+#define SNAPSHOT_MAGIC 0x53584f4c  // "LOXS"
+#define SNAPSHOT_VERSION 9
+
+// fails if `vm` is running or its heap holds objects that can't be captured.
+bool serializeHeap(VM* vm, std::vector<uint8_t>* image);
+// restores an image into a VM that has not run anything yet.
+bool deserializeHeap(const uint8_t* data, size_t size, VM* vm);
+
+bool writeSnapshotFile(const char* path, VM* vm);
+bool loadSnapshotFile(const char* path, VM* vm);
+
+#endif
@@ -1,5 +1,9 @@
 #include "table.hpp"
 
+#include <string.h>
+
+#include "object.hpp"
+
 bool Table::get(ObjString* key, Value* value) {
   if (count == 0) return false;
 
@@ -34,6 +38,13 @@ bool Table::deleteKey(ObjString* key) {
   return true;
 }
 
+// keys are interned, so a match is nearly always the same object. equal
+// strings from another heap, e.g. a shared Program's constants, still find
+// the entry.
+static inline bool sameKey(ObjString* a, ObjString* b) {
+  return a == b || (a->hash == b->hash && a->str == b->str);
+}
+
 Entry* findEntry(std::vector<Entry>* entries, ObjString* key) {
   uint32_t index = key->hash % entries->capacity();
   Entry* tombstone = NULL;
@@ -46,7 +57,7 @@ Entry* findEntry(std::vector<Entry>* entries, ObjString* key) {
       } else {
         if (tombstone == NULL) tombstone = entry;
       }
-    } else if (entry->key == key) {
+    } else if (sameKey(entry->key, key)) {
       return entry;
     }
     index = (index + 1) % entries->capacity();
@@ -55,18 +66,23 @@ Entry* findEntry(std::vector<Entry>* entries, ObjString* key) {
 }
 
 ObjString* Table::findString(ObjString* target) {
+  return findString(target->str.data(), target->str.size(), target->hash);
+}
+
+ObjString* Table::findString(const char* chars, size_t length,
+                             uint32_t hash) {
   if (count == 0) return nullptr;
 
-  uint32_t index = target->hash % entries->capacity();
+  uint32_t index = hash % entries->capacity();
   while (true) {
     Entry* entry = &(*entries)[index];
 
     if (entry->key == NULL) {
       // Stop if we find an empty non-tombstone entry.
       if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->str.length() == target->str.length() &&
-               entry->key->hash == target->hash &&
-               entry->key->str == target->str) {
+    } else if (entry->key->str.length() == length &&
+               entry->key->hash == hash &&
+               memcmp(entry->key->str.data(), chars, length) == 0) {
       return entry->key;
     }
 
@@ -1,8 +1,9 @@
 #ifndef cpplox_table_h
 #define cpplox_table_h
 
+#include <vector>
+
 #include "common.hpp"
-#include "object.hpp"
 #include "value.hpp"
 
 #define TABLE_INITIAL_CAPACITY 8
@@ -35,6 +36,8 @@ class Table {
   bool deleteKey(ObjString* key);
   void adjustCapacity(int cap);
   ObjString* findString(ObjString* target);
+  // looks characters up without making a string of them first.
+  ObjString* findString(const char* chars, size_t length, uint32_t hash);
   void addAll(Table* src);
 
   void markTable(std::vector<Obj*>& greyStack);
@@ -0,0 +1,69 @@
+#include "token_stream.hpp"
+
+#include <algorithm>
+
+// tokens are published in batches to keep the consumer off the shared
+// counter's cache line.
+#define PUBLISH_BATCH 256
+
+TokenStream::TokenStream(const char* source, size_t length)
+    : source(source),
+      length(length),
+      types(new uint8_t[length + 1]),
+      offsets(new uint32_t[length + 1]),
+      lengths(new uint32_t[length + 1]),
+      lines(new uint32_t[length + 1]),
+      published(0),
+      complete(false),
+      readable(0) {}
+
+TokenStream::~TokenStream() {
+  if (producer.joinable()) producer.join();
+}
+
+void TokenStream::scan() {
+  auto scanner = Scanner(source, length);
+  scanner.vectorized = vectorized;
+
+  size_t count = 0;
+  while (true) {
+    Token token = scanner.scanToken();
+    types[count] = token.type;
+    lengths[count] = token.length;
+    lines[count] = token.line;
+    if (token.type == TOKEN_ERROR) {
+      int error = 0;
+      while (error < SCAN_ERROR_NUMS - 1 && scanErrors[error] != token.start) {
+        error++;
+      }
+      offsets[count] = error;
+    } else {
+      offsets[count] = token.start - source;
+    }
+    count++;
+
+    if (token.type == TOKEN_EOF) break;
+    if (count % PUBLISH_BATCH == 0) {
+      published.store(count, std::memory_order_release);
+    }
+  }
+  published.store(count, std::memory_order_release);
+  complete.store(true, std::memory_order_release);
+}
+
+void TokenStream::scanInBackground() {
+  producer = std::thread([this] { scan(); });
+}
+
+// returns `index`, or the TOKEN_EOF's index if `index` is past it.
+size_t TokenStream::waitFor(size_t index) {
+  while (true) {
+    readable = published.load(std::memory_order_acquire);
+    if (index < readable) return index;
+    if (complete.load(std::memory_order_acquire)) {
+      readable = published.load(std::memory_order_acquire);
+      return std::min(index, readable - 1);
+    }
+    std::this_thread::yield();
+  }
+}
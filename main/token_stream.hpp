@@ -0,0 +1,58 @@
+#ifndef cpplox_token_stream_h
+#define cpplox_token_stream_h
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "common.hpp"
+#include "scanner.hpp"
+
+// the tokens of a whole source in struct-of-arrays form, scanned up front or
+// on a producer thread while the compiler consumes them by index. offsets are
+// relative to the source, except for error tokens whose offset indexes
+// `scanErrors`.
+//
+// every token spans at least one byte, so the arrays are sized for the worst
+// case once and never move; pages that are never written are never touched.
+class TokenStream {
+ public:
+  const char* source;
+  size_t length;
+  std::unique_ptr<uint8_t[]> types;
+  std::unique_ptr<uint32_t[]> offsets;
+  std::unique_ptr<uint32_t[]> lengths;
+  std::unique_ptr<uint32_t[]> lines;
+  // tokens written so far; the last one is TOKEN_EOF once `complete` is set.
+  std::atomic<size_t> published;
+  std::atomic<bool> complete;
+  // what the consumer last saw of `published`, so reads only touch the
+  // atomics once they catch up with it.
+  size_t readable;
+  bool vectorized = true;
+  std::thread producer;
+
+  TokenStream(const char* source, size_t length);
+  ~TokenStream();
+  TokenStream(const TokenStream&) = delete;
+  TokenStream& operator=(const TokenStream&) = delete;
+
+  void scan();
+  void scanInBackground();
+  // blocks until token `index` is scanned. indexes past the end repeat the
+  // TOKEN_EOF.
+  Token at(size_t index) {
+    if (index >= readable) index = waitFor(index);
+
+    Token token;
+    token.type = (TokenType)types[index];
+    token.start = token.type == TOKEN_ERROR ? scanErrors[offsets[index]]
+                                            : source + offsets[index];
+    token.length = lengths[index];
+    token.line = lines[index];
+    return token;
+  }
+  size_t waitFor(size_t index);
+};
+
+#endif
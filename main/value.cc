@@ -1,26 +1,20 @@
 #include "value.hpp"
 
 #include "object.hpp"
+#include "output.hpp"
 
 void ValueArray::writeValueArray(Value value) { values.push_back(value); }
 
+// debug output, e.g. traces and GC logs. it is formatted like `print` but
+// goes through stdio, so it stays in order with the printf() around it.
 void printValue(Value value) {
-  switch (value.type) {
-    case ValueType::VAL_BOOL:
-      printf(AS_BOOL(value) ? "true" : "false");
-      break;
-    case ValueType::VAL_NIL:
-      printf("nil");
-      break;
-    case ValueType::VAL_NUMBER:
-      printf("%g", AS_NUMBER(value));
-      break;
-    case ValueType::VAL_OBJ:
-      printObject(value);
-      break;
-    default:
-      break;
-  }
+  static thread_local std::string text;
+  static thread_local OutputSink debugOutput;
+  debugOutput.redirect(&text);
+  debugOutput.writeValue(value);
+  debugOutput.flush();
+  fwrite(text.data(), 1, text.size(), stdout);
+  text.clear();
 }
 
 Value* ValueArray::peek() {
@@ -30,19 +24,27 @@ Value* ValueArray::peek() {
 }
 
 bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type) return false;
+  if (a.type != b.type) {
+    // an integer and a double holding the same number.
+    return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
+  }
 
   switch (a.type) {
     case ValueType::VAL_BOOL:
       return AS_BOOL(a) == AS_BOOL(b);
     case ValueType::VAL_NUMBER:
       return AS_NUMBER(a) == AS_NUMBER(b);
+    case ValueType::VAL_INT:
+      return AS_INT(a) == AS_INT(b);
     case ValueType::VAL_NIL:
       return true;
     case ValueType::VAL_OBJ:
-      ObjString* aString = ((ObjString*)AS_OBJ(a));
-      ObjString* bString = ((ObjString*)AS_OBJ(b));
-      return aString->str == bString->str;
+      // concatenation makes strings that aren't interned, everything else
+      // is equal only to itself.
+      if (IS_STRING(a) && IS_STRING(b)) {
+        return AS_STRING(a)->str == AS_STRING(b)->str;
+      }
+      return AS_OBJ(a) == AS_OBJ(b);
   }
   return false;  // unreachable
 }
@@ -1,16 +1,23 @@
 #ifndef cpplox_value_h
 #define cpplox_value_h
 
+#include <cmath>
+
 #include "common.hpp"
 
 struct Obj;
 struct ObjString;
 
+// VAL_INT is a number too: the VM keeps whole numbers that fit in 32 bits as
+// integers where it can, because integer arithmetic is cheaper. programs
+// can't tell the two apart, so everything outside the VM's fast paths reads
+// both through IS_NUMBER and AS_NUMBER.
 enum ValueType {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_INT,
 };
 
 struct Value {
@@ -18,24 +25,46 @@ struct Value {
   union {
     bool boolean;
     double number;
+    int32_t integer;
     Obj* obj;
   };
 };
 
+static inline bool isNumber(Value value) {
+  return value.type == VAL_NUMBER || value.type == VAL_INT;
+}
+
+static inline double asNumber(Value value) {
+  return value.type == VAL_INT ? (double)value.integer : value.number;
+}
+
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_NUMBER(value) isNumber(value)
+#define IS_INT(value) ((value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_OBJ(value) ((value).obj)
 #define AS_BOOL(value) ((value).boolean)
-#define AS_NUMBER(value) ((value).number)
+#define AS_NUMBER(value) asNumber(value)
+#define AS_INT(value) ((value).integer)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = object}})
 
+// `number` as an integer if it is one that fits, -0 excepted.
+static inline Value packNumber(double number) {
+  if (number >= INT32_MIN && number <= INT32_MAX &&
+      number == (double)(int32_t)number &&
+      !(number == 0 && std::signbit(number))) {
+    return INT_VAL((int32_t)number);
+  }
+  return NUMBER_VAL(number);
+}
+
 void printValue(Value value);
 
 bool valuesEqual(Value a, Value b);
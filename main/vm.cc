@@ -2,12 +2,18 @@
 
 #include <time.h>
 
-#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <memory>
 
+#include "buffer.hpp"
+#include "channel.hpp"
 #include "common.hpp"
 #include "compiler.hpp"
 #include "debug.hpp"
+#include "hash_map.hpp"
 #include "object.hpp"
+#include "parallel_map.hpp"
 #include "value.hpp"
 
 #define DEBUG_TRACE_EXECUTION
@@ -16,24 +22,112 @@ Value clockNative(int argCount, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-VM vm{};
+// fiber(fn) makes a fiber that will run fn, a function of at most one
+// parameter.
+bool fiberNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_CLOSURE(args[0]) ||
+      AS_CLOSURE(args[0])->function->arity > 1) {
+    vm->runtimeError("fiber() takes a function of at most one parameter.");
+    return false;
+  }
+  auto fiber = allocateFiberObject(AS_CLOSURE(args[0]), &vm->objects);
+  vm->stack_top -= argCount + 1;
+  vm->push(OBJ_VAL(fiber));
+  return true;
+}
+
+// resume(fiber[, value]) runs the fiber until it yields or returns and
+// evaluates to the value it yielded or returned. the first resume passes
+// `value` to the fiber's function.
+bool resumeNative(VM* vm, int argCount, Value* args) {
+  if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) {
+    vm->runtimeError("resume() takes a fiber and an optional value.");
+    return false;
+  }
+  ObjFiber* fiber = AS_FIBER(args[0]);
+  Value value = argCount == 2 ? args[1] : NIL_VAL;
+  vm->stack_top -= argCount + 1;
+  return vm->resumeFiber(fiber, value);
+}
+
+// append(array, value) adds value at the end of the array.
+bool appendNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 2 || !IS_ARRAY(args[0])) {
+    vm->runtimeError("append() takes an array and a value.");
+    return false;
+  }
+  AS_ARRAY(args[0])->values.push_back(args[1]);
+  vm->stack_top -= argCount + 1;
+  vm->push(NIL_VAL);
+  return true;
+}
+
+// isDone(fiber) is true once the fiber's function has returned.
+bool isDoneNative(VM* vm, int argCount, Value* args) {
+  if (argCount != 1 || !IS_FIBER(args[0])) {
+    vm->runtimeError("isDone() takes a fiber.");
+    return false;
+  }
+  bool done = AS_FIBER(args[0])->state == FIBER_DONE;
+  vm->stack_top -= argCount + 1;
+  vm->push(BOOL_VAL(done));
+  return true;
+}
 
 VM::VM()
     : objects(nullptr),
+      grayStack(std::vector<Obj*>()),
       frameCount(0),
-      openUpvalues(nullptr),
-      grayStack(std::vector<Obj*>()) {
+      current(&mainStack),
+      fiber(nullptr),
+      mainStack(FRAMES_MAX) {
+  stack = stack_top = mainStack.values.get();
+  frames = mainStack.frames.get();
+  framesMax = mainStack.framesMax;
   reset_stack();
   defineNative("clock", 5, clockNative);
+  defineNative("fiber", 5, fiberNative);
+  defineNative("resume", 6, resumeNative);
+  defineNative("isDone", 6, isDoneNative);
+  defineNative("append", 6, appendNative);
+  defineChannelNatives(this);
+  defineMapNatives(this);
+  defineBufferNatives(this);
+  defineHashMapNatives(this);
 }
 
 VM::~VM() { freeVM(); }
 
-void VM::reset_stack() { stack_top = stack; }
+void VM::reset_stack() {
+  // an error abandons every fiber from the running one down to the VM's own
+  // stack.
+  ObjFiber* abandoned = fiber;
+  if (fiber != nullptr) switchTo(nullptr);
+  while (abandoned != nullptr) {
+    abandoned->state = FIBER_DONE;
+    releaseStack(abandoned->stack);
+    abandoned->stack = nullptr;
+    auto next = abandoned->caller;
+    abandoned->caller = nullptr;
+    abandoned = next;
+  }
+  stack_top = stack;
+  frameCount = 0;
+}
 
 void VM::initVM() { reset_stack(); };
 
 void VM::freeVM() {
+  // fibers are about to go away, so is any stack they were using.
+  if (fiber != nullptr) switchTo(nullptr);
+  fiber = nullptr;
+  freeStacks.clear();
+  for (auto& fiberStack : fiberStacks) {
+    fiberStack->top = fiberStack->values.get();
+    fiberStack->frameCount = 0;
+    freeStacks.push_back(fiberStack.get());
+  }
+
   auto obj = objects;
   while (obj != NULL) {
     auto next = obj->next;
@@ -41,6 +135,17 @@ void VM::freeVM() {
     obj = next;
   }
   objects = nullptr;
+
+  for (auto& stackClosure : mainStack.stackClosures) {
+    delete stackClosure.closure;
+  }
+  mainStack.stackClosures.clear();
+  for (auto& fiberStack : fiberStacks) {
+    for (auto& stackClosure : fiberStack->stackClosures) {
+      delete stackClosure.closure;
+    }
+    fiberStack->stackClosures.clear();
+  }
 };
 
 void VM::push(Value value) { *(stack_top++) = value; };
@@ -54,6 +159,7 @@ bool VM::isFalsey(Value value) {
 }
 
 void VM::runtimeError(const char* format, ...) {
+  output.flush();
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -63,14 +169,14 @@ void VM::runtimeError(const char* format, ...) {
   CallFrame* frame = &frames[frameCount - 1];
 
   size_t instruction =
-      *(frame->ip - frame->closure->function->chunk.code.front()) - 1;
+      frame->ip - &frame->closure->function->chunk.code.front() - 1;
   int line = frame->closure->function->chunk.lines[instruction];
   fprintf(stderr, "[line %d] in script\n", line);
 
   for (int i = frameCount - 1; i >= 0; i--) {
     CallFrame* frame = &frames[i];
     ObjFunction* function = frame->closure->function;
-    size_t instruction = *(frame->ip - function->chunk.code.front() - 1);
+    size_t instruction = frame->ip - &function->chunk.code.front() - 1;
     fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
@@ -87,6 +193,17 @@ void VM::defineNative(const char* name, int length,
   push(OBJ_VAL(allocateStringObject(name, length, &strings, &objects)));
   push(OBJ_VAL(allocateNativeFnctionObject(function, &objects)));
   globals.set(AS_STRING(stack[0]), stack[1]);
+  natives.set(AS_STRING(stack[0]), stack[1]);
+  pop();
+  pop();
+}
+
+void VM::defineNative(const char* name, int length,
+                      VMNativeFunctionPtr function) {
+  push(OBJ_VAL(allocateStringObject(name, length, &strings, &objects)));
+  push(OBJ_VAL(allocateNativeFnctionObject(function, &objects)));
+  globals.set(AS_STRING(stack[0]), stack[1]);
+  natives.set(AS_STRING(stack[0]), stack[1]);
   pop();
   pop();
 }
@@ -96,30 +213,55 @@ void VM::collectGarbage() {
   printf("-- gc begin\n");
 #endif
 
+  // nothing is swept yet, so clear what the last collection marked, or
+  // whatever it reached would still look reachable.
+  for (auto object = objects; object != nullptr; object = object->next) {
+    object->isMarked = false;
+  }
   markRoots();
   traceReferences();
+  reclaimStacks();
+
+  // frame-owned closures are never swept, so clear their marks here.
+  auto clearMarks = [](FiberStack* fiberStack) {
+    for (auto& stackClosure : fiberStack->stackClosures) {
+      if (stackClosure.closure == nullptr) continue;
+      stackClosure.closure->isMarked = false;
+      for (auto& capture : stackClosure.captures) capture.isMarked = false;
+    }
+  };
+  clearMarks(&mainStack);
+  for (auto& fiberStack : fiberStacks) clearMarks(fiberStack.get());
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
 #endif
 }
 
-void VM::markRoots() {
-  for (Value* slot = stack; slot < stack_top; slot++) {
-    if (!IS_OBJ(*slot)) return;
-    markObject(AS_OBJ(*slot), grayStack);
-  }
-
-  for (int i = 0; i < frameCount; i++) {
-    markObject((Obj*)frames[i].closure, grayStack);
+// a fiber dropped while suspended never finishes, so its stack goes back to
+// the pool once nothing reaches the fiber.
+void VM::reclaimStacks() {
+  for (auto object = objects; object != nullptr; object = object->next) {
+    if (object->isMarked || object->type != OBJ_FIBER) continue;
+    auto dropped = (ObjFiber*)object;
+    if (dropped->stack == nullptr) continue;
+    releaseStack(dropped->stack);
+    dropped->stack = nullptr;
+    dropped->caller = nullptr;
+    dropped->state = FIBER_DONE;
   }
+}
 
-  for (ObjUpvalue* upvalue = openUpvalues; upvalue != NULL;
-       upvalue = upvalue->nextUpValue) {
-    markObject((Obj*)upvalue, grayStack);
-  }
+void VM::markRoots() {
+  // suspended stacks are reached through their fibers.
+  current->top = stack_top;
+  current->frameCount = frameCount;
+  markFiberStack(&mainStack, grayStack);
+  markObject((Obj*)fiber, grayStack);
+  for (auto hostFiber : hostFibers) markObject((Obj*)hostFiber, grayStack);
 
   globals.markTable(grayStack);
+  natives.markTable(grayStack);
 }
 
 void VM::traceReferences() {
@@ -153,6 +295,10 @@ void VM::sweep() {
 #ifdef DEBUG_LOG_GC
       printf("%p free type %d\n", (void*)unreached, unreached->type);
 #endif
+      if (unreached->type == OBJ_FIBER &&
+          ((ObjFiber*)unreached)->stack != nullptr) {
+        releaseStack(((ObjFiber*)unreached)->stack);
+      }
       delete unreached;
     }
   }
@@ -180,6 +326,23 @@ IntepretResult VM::run() {
     double a = AS_NUMBER(pop());                      \
     push(valueType(a OP b));                          \
   } while (false);
+// with two integer operands, computes the exact result in 64 bits and ends
+// the instruction. it stays an integer if it fits in one.
+#define INT_ARITHMETIC(OP)                                               \
+  if (IS_INT(peek(0)) && IS_INT(peek(1))) {                              \
+    int64_t result = (int64_t)AS_INT(peek(1)) OP AS_INT(peek(0));        \
+    stack_top--;                                                         \
+    stack_top[-1] = result == (int32_t)result ? INT_VAL((int32_t)result) \
+                                              : NUMBER_VAL((double)result); \
+    break;                                                               \
+  }
+#define INT_COMPARISON(OP)                            \
+  if (IS_INT(peek(0)) && IS_INT(peek(1))) {           \
+    bool result = AS_INT(peek(1)) OP AS_INT(peek(0)); \
+    stack_top--;                                      \
+    stack_top[-1] = BOOL_VAL(result);                 \
+    break;                                            \
+  }
   uint8_t inst;
   while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
@@ -210,16 +373,25 @@ IntepretResult VM::run() {
           runtimeError("Operand must be a number.");
           return INTERPRET_RUNTIME_ERROR;
         }
+        // negating 0 makes -0, which only a double holds.
+        if (IS_INT(peek(0)) && AS_INT(peek(0)) != 0 &&
+            AS_INT(peek(0)) != INT32_MIN) {
+          stack_top[-1] = INT_VAL(-AS_INT(peek(0)));
+          break;
+        }
         push(NUMBER_VAL(-AS_NUMBER(pop())));
         break;
       }
       case OP_GREATER:
+        INT_COMPARISON(>);
         BINARY_OP(BOOL_VAL, >);
         break;
       case OP_LESS:
+        INT_COMPARISON(<);
         BINARY_OP(BOOL_VAL, <);
         break;
       case OP_ADD: {
+        INT_ARITHMETIC(+);
         if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
@@ -233,10 +405,17 @@ IntepretResult VM::run() {
         break;
       }
       case OP_SUBTRACT: {
+        INT_ARITHMETIC(-);
         BINARY_OP(NUMBER_VAL, -);
         break;
       }
       case OP_MULTIPLY: {
+        // zero times a negative number is -0, which only a double holds.
+        bool negativeZero =
+            IS_INT(peek(0)) && IS_INT(peek(1)) &&
+            (AS_INT(peek(0)) == 0 || AS_INT(peek(1)) == 0) &&
+            (AS_INT(peek(0)) | AS_INT(peek(1))) < 0;
+        if (!negativeZero) INT_ARITHMETIC(*);
         BINARY_OP(NUMBER_VAL, *);
         break;
       }
@@ -254,8 +433,11 @@ IntepretResult VM::run() {
         push(BOOL_VAL(false));
         break;
       case OP_PRINT:
-        printValue(pop());
-        printf("\n");
+        output.writeLine(pop());
+#ifdef DEBUG_TRACE_EXECUTION
+        // keep the trace and the output in order.
+        output.flush();
+#endif
         break;
       case OP_POP:
         pop();
@@ -311,6 +493,12 @@ IntepretResult VM::run() {
 
         frameCount--;
         if (frameCount == 0) {
+          if (fiber != nullptr) {
+            finishFiber(result);
+            if (frameCount == 0) return INTERPRET_OK;
+            frame = &frames[frameCount - 1];
+            break;
+          }
           pop();
           return INTERPRET_OK;
         }
@@ -336,11 +524,33 @@ IntepretResult VM::run() {
         frame->ip -= offset;
         break;
       }
+      case OP_FOR_LOCAL:
+      case OP_FOR_CONSTANT: {
+        Value* counter = &frame->slots[READ_BYTE()];
+        uint8_t operand = READ_BYTE();
+        uint16_t offset = READ_SHORT();
+        Value limit = inst == OP_FOR_LOCAL ? frame->slots[operand]
+                                           : frame->closure->function->chunk
+                                                 .constants.values[operand];
+        bool again;
+        if (IS_INT(*counter) && IS_INT(limit) &&
+            AS_INT(*counter) != INT32_MAX) {
+          *counter = INT_VAL(AS_INT(*counter) + 1);
+          again = AS_INT(*counter) < AS_INT(limit);
+        } else if (!stepLoop(counter, limit, &again)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (again) frame->ip -= offset;
+        break;
+      }
       case OP_CALL: {
+        frame->callStart = frame->ip - 1;
         int argCount = READ_BYTE();
         if (!callValue(peek(argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+        // a native suspended the fiber the host resumed.
+        if (frameCount == 0) return INTERPRET_OK;
         frame = &frames[frameCount - 1];  // switch to new function frame
         break;
       }
@@ -359,6 +569,25 @@ IntepretResult VM::run() {
         }
         break;
       }
+      case OP_STACK_CLOSURE: {
+        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+        ObjClosure* closure = allocateStackClosure(function, stack_top);
+        auto& captures = current->stackClosures[stack_top - stack].captures;
+        push(OBJ_VAL(closure));
+        for (int i = 0; i < closure->upvalueCount; i++) {
+          uint8_t isLocal = READ_BYTE();
+          uint8_t index = READ_BYTE();
+          if (isLocal) {
+            // the captured local outlives this closure, so point at it
+            // directly instead of registering an open upvalue.
+            captures[i].location = frame->slots + index;
+            closure->upvalues[i] = &captures[i];
+          } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+          }
+        }
+        break;
+      }
       case OP_GET_UPVALUE: {
         uint8_t slot = READ_BYTE();
         push(*frame->closure->upvalues[slot]->location);
@@ -373,8 +602,165 @@ IntepretResult VM::run() {
         closeUpvalues(stack_top - 1);
         pop();
         break;
+      case OP_ARRAY: {
+        int count = READ_BYTE();
+        ObjArray* array = allocateArrayObject(&objects);
+        array->values.assign(stack_top - count, stack_top);
+        stack_top -= count;
+        push(OBJ_VAL(array));
+        break;
+      }
+      case OP_GET_INDEX: {
+        if (IS_MAP(peek(1))) {
+          if (!checkKey(peek(0))) return INTERPRET_RUNTIME_ERROR;
+          // a missing key reads as nil.
+          Value value = NIL_VAL;
+          AS_MAP(peek(1))->get(peek(0), &value);
+          stack_top -= 2;
+          push(value);
+          break;
+        }
+        size_t index;
+        if (!checkIndex(peek(1), peek(0), &index)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        Value element = IS_ARRAY(peek(1))
+                            ? AS_ARRAY(peek(1))->values[index]
+                            : NUMBER_VAL(AS_BUFFER(peek(1))->values[index]);
+        stack_top -= 2;
+        push(element);
+        break;
+      }
+      case OP_SET_INDEX: {
+        if (IS_MAP(peek(2))) {
+          if (!checkKey(peek(1))) return INTERPRET_RUNTIME_ERROR;
+          AS_MAP(peek(2))->set(peek(1), peek(0));
+          Value value = pop();
+          stack_top -= 2;
+          push(value);
+          break;
+        }
+        size_t index;
+        if (!checkIndex(peek(2), peek(1), &index)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        Value element = pop();
+        if (IS_ARRAY(peek(1))) {
+          AS_ARRAY(peek(1))->values[index] = element;
+        } else if (IS_NUMBER(element)) {
+          AS_BUFFER(peek(1))->values[index] = AS_NUMBER(element);
+        } else {
+          runtimeError("A buffer can only hold numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        stack_top -= 2;
+        push(element);
+        break;
+      }
+      case OP_CLASS:
+        push(OBJ_VAL(allocateClassObject(READ_STRING(), &objects)));
+        break;
+      case OP_INHERIT: {
+        Value superclass = peek(1);
+        if (!IS_CLASS(superclass)) {
+          runtimeError("Superclass must be a class.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjClass* subclass = AS_CLASS(peek(0));
+        subclass->methods.addAll(&AS_CLASS(superclass)->methods);
+        subclass->initializer = AS_CLASS(superclass)->initializer;
+        pop();
+        break;
+      }
+      case OP_METHOD: {
+        ObjString* name = READ_STRING();
+        ObjClass* klass = AS_CLASS(peek(1));
+        klass->methods.set(name, peek(0));
+        if (name->str == "init") klass->initializer = AS_CLOSURE(peek(0));
+        pop();
+        break;
+      }
+      case OP_GET_PROPERTY: {
+        ObjString* name = READ_STRING();
+        PropertyCache* cache = &frame->closure->caches[READ_SHORT()];
+        if (IS_INSTANCE(peek(0))) {
+          ObjInstance* instance = AS_INSTANCE(peek(0));
+          CacheEntry* entry = cache->find(instance->shape);
+          if (entry != nullptr && entry->slot >= 0) {
+            stack_top[-1] = instance->fields[entry->slot];
+            break;
+          }
+        }
+        if (!getProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+      case OP_SET_PROPERTY: {
+        ObjString* name = READ_STRING();
+        PropertyCache* cache = &frame->closure->caches[READ_SHORT()];
+        if (IS_INSTANCE(peek(1))) {
+          ObjInstance* instance = AS_INSTANCE(peek(1));
+          CacheEntry* entry = cache->find(instance->shape);
+          if (entry != nullptr) {
+            storeField(instance, entry, peek(0));
+            Value value = pop();
+            stack_top[-1] = value;
+            break;
+          }
+        }
+        if (!setProperty(name, cache)) return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+      case OP_INVOKE: {
+        frame->callStart = frame->ip - 1;
+        ObjString* name = READ_STRING();
+        PropertyCache* cache = &frame->closure->caches[READ_SHORT()];
+        int argCount = READ_BYTE();
+        Value receiver = peek(argCount);
+        CacheEntry* entry = IS_INSTANCE(receiver)
+                                ? cache->find(AS_INSTANCE(receiver)->shape)
+                                : nullptr;
+        if (entry != nullptr && entry->slot < 0) {
+          if (!call(AS_CLOSURE(entry->method), argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+        } else if (!invoke(name, cache, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        // a native in a field suspended the fiber the host resumed.
+        if (frameCount == 0) return INTERPRET_OK;
+        frame = &frames[frameCount - 1];
+        break;
+      }
+      case OP_SUPER_INVOKE: {
+        ObjString* name = READ_STRING();
+        int argCount = READ_BYTE();
+        ObjClass* superclass = AS_CLASS(pop());
+        if (!invokeFromClass(superclass, name, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &frames[frameCount - 1];
+        break;
+      }
+      case OP_GET_SUPER: {
+        ObjString* name = READ_STRING();
+        ObjClass* superclass = AS_CLASS(pop());
+        if (!bindMethod(superclass, name)) return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+      case OP_YIELD: {
+        if (fiber == nullptr) {
+          runtimeError("Cannot yield outside a fiber.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        suspendFiber(pop());
+        if (frameCount == 0) return INTERPRET_OK;
+        frame = &frames[frameCount - 1];
+        break;
+      }
     }
   }
+#undef INT_COMPARISON
+#undef INT_ARITHMETIC
 #undef BINARY_OP
 #undef READ_SHORT
 #undef READ_STRING
@@ -390,18 +776,130 @@ IntepretResult VM::interpret(ObjFunction* function) {  // for testing purpose
 }
 
 IntepretResult VM::interpret(const char* source) {
-  std::cout << source << "\n";
+  if (lazyCompile) {
+    sources.emplace_back(source);
+    source = sources.back().c_str();
+  }
+  auto function = compile(source, strlen(source));
+  if (function == nullptr) return IntepretResult::INTERPRET_COMPILE_ERROR;
+
+  return runScript(function);
+}
+
+// compiles with the front end options set on this VM.
+ObjFunction* VM::compile(const char* source, size_t length) {
+  auto compiler = Compiler(source, length, &strings, &objects);
+  compiler.lazy = lazyCompile;
+  compiler.workers = compileWorkers;
+  std::unique_ptr<TokenStream> tokens;
+  if (pretokenize) {
+    tokens.reset(new TokenStream(source, length));
+    tokens->scanInBackground();
+    compiler.parser->tokens = tokens.get();
+  }
 
-  auto compiler = Compiler(source, &strings, &objects);
   auto function = compiler.compile();
-  if (function == nullptr) return IntepretResult::INTERPRET_COMPILE_ERROR;
+  compiler.freeCompiler();
+  return function;
+}
 
+// runs a compiled top-level function, e.g. one loaded from a bytecode image.
+IntepretResult VM::runScript(ObjFunction* function) {
   push(OBJ_VAL(function));
   ObjClosure* closure = allocateClosureObject(function, &objects);
   pop();
   push(OBJ_VAL(closure));
   callValue(OBJ_VAL(closure), 0);
-  return run();
+  auto result = run();
+  output.flush();
+  return result;
+}
+
+// runs a program compiled once for many VMs. only the closure over its
+// script is allocated here.
+IntepretResult VM::runProgram(std::shared_ptr<const Program> program) {
+  programs.push_back(program);
+  return runScript(program->script);
+}
+
+// defines the program's top-level functions as globals without running its
+// script, for VMs that only call into it.
+void VM::loadFunctions(std::shared_ptr<const Program> program) {
+  programs.push_back(program);
+  for (auto constant : program->script->chunk.constants.values) {
+    // a function closing over variables of a block only exists in there.
+    if (!IS_FUNCTION(constant) || AS_FUNCTION(constant)->name == nullptr ||
+        AS_FUNCTION(constant)->upvalueCount > 0) {
+      continue;
+    }
+    // function names aren't interned, the global gets the VM's own string.
+    auto function = AS_FUNCTION(constant);
+    push(OBJ_VAL(allocateStringObject(function->name->str.data(),
+                                      function->name->str.size(), &strings,
+                                      &objects)));
+    push(OBJ_VAL(allocateClosureObject(function, &objects)));
+    globals.set(AS_STRING(peek(1)), peek(0));
+    pop();
+    pop();
+  }
+}
+
+// `index` has to be a whole number within the array or buffer.
+bool VM::checkIndex(Value array, Value index, size_t* slot) {
+  size_t size;
+  if (IS_ARRAY(array)) {
+    size = AS_ARRAY(array)->values.size();
+  } else if (IS_BUFFER(array)) {
+    size = AS_BUFFER(array)->values.size();
+  } else {
+    runtimeError("Only arrays, buffers and maps can be indexed.");
+    return false;
+  }
+  if (IS_INT(index) && AS_INT(index) >= 0 && (size_t)AS_INT(index) < size) {
+    *slot = (size_t)AS_INT(index);
+    return true;
+  }
+  double number = IS_NUMBER(index) ? AS_NUMBER(index) : NAN;
+  if (number != std::floor(number)) {
+    runtimeError("Index must be a whole number.");
+    return false;
+  }
+  if (number < 0 || number >= size) {
+    runtimeError("Index %g is out of bounds for length %zu.", number, size);
+    return false;
+  }
+  *slot = (size_t)number;
+  return true;
+}
+
+// `i = i + 1` and then `i < limit` for a counted loop, other than both
+// operands being integers, with the errors OP_ADD and OP_LESS would report.
+bool VM::stepLoop(Value* counter, Value limit, bool* again) {
+  if (!IS_NUMBER(*counter)) {
+    runtimeError("Operands must be two numbers or two strings.");
+    return false;
+  }
+  if (IS_INT(*counter) && AS_INT(*counter) != INT32_MAX) {
+    *counter = INT_VAL(AS_INT(*counter) + 1);
+  } else {
+    *counter = NUMBER_VAL(AS_NUMBER(*counter) + 1);
+  }
+  if (!IS_NUMBER(limit)) {
+    runtimeError("Operands must benumbers.");
+    return false;
+  }
+  *again = AS_NUMBER(*counter) < AS_NUMBER(limit);
+  return true;
+}
+
+bool VM::checkKey(Value key) {
+  if (isMapKey(key)) return true;
+  if (IS_NUMBER(key)) {
+    runtimeError("A map key cannot be NaN.");
+  } else {
+    runtimeError("A map key must be nil, a boolean, a number or a string.");
+  }
+  return false;
 }
 
 void VM::concatenate() {
@@ -420,13 +918,26 @@ bool VM::callValue(Value callee, int argCount) {
     switch (OBJ_TYPE(callee)) {
       case OBJ_CLOSURE:
         return call(AS_CLOSURE(callee), argCount);
-      case OBJ_NATIVE: {
-        NativeFunctionPtr native = AS_NATIVE(callee);
-        Value result = native(argCount, stack_top - argCount);
-        stack_top -= argCount + 1;
-        push(result);
+      case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        stack_top[-argCount - 1] = bound->receiver;
+        return call(bound->method, argCount);
+      }
+      case OBJ_CLASS: {
+        ObjClass* klass = AS_CLASS(callee);
+        stack_top[-argCount - 1] =
+            OBJ_VAL(allocateInstanceObject(klass, &objects));
+        if (klass->initializer != nullptr) {
+          return call(klass->initializer, argCount);
+        }
+        if (argCount != 0) {
+          runtimeError("Expected 0 arguments but got %d.", argCount);
+          return false;
+        }
         return true;
       }
+      case OBJ_NATIVE:
+        return callNative((ObjNative*)AS_OBJ(callee), argCount);
       default:
         // Non-callable object type.
         break;
@@ -436,14 +947,32 @@ bool VM::callValue(Value callee, int argCount) {
   return false;
 };
 
+// the result replaces the callee, or whatever is below the arguments.
+bool VM::callNative(ObjNative* native, int argCount) {
+  if (native->vmFunc != nullptr) {
+    return native->vmFunc(this, argCount, stack_top - argCount);
+  }
+  Value result = native->func(argCount, stack_top - argCount);
+  stack_top -= argCount + 1;
+  push(result);
+  return true;
+}
+
 bool VM::call(ObjClosure* closure, int argCount) {
+  if (closure->function->lazy != nullptr && !compileLazy(closure->function)) {
+    return false;
+  }
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.", closure->function->arity,
                  argCount);
     return false;
   }
+  // a closure made before its body was compiled has no caches yet.
+  if (closure->caches.size() < (size_t)closure->function->cacheCount) {
+    closure->caches.resize(closure->function->cacheCount);
+  }
 
-  if (frameCount == FRAMES_MAX) {
+  if (frameCount == framesMax) {
     runtimeError("Stack overflow.");
     return false;
   }
@@ -452,36 +981,316 @@ bool VM::call(ObjClosure* closure, int argCount) {
   frame->closure = closure;
   frame->ip = &closure->function->chunk.code.front();
   frame->slots = stack_top - argCount - 1;
+  frame->openUpvalues.clear();
   return true;
 };
 
-ObjUpvalue* VM::captureUpvalue(Value* local) {
-  ObjUpvalue* prevUpvalue = NULL;
-  ObjUpvalue* upvalue = openUpvalues;
+bool VM::compileLazy(ObjFunction* function) {
+  auto compiler = Compiler(function, &strings, &objects);
+  bool compiled = compiler.compileLazyBody();
+  compiler.freeCompiler();
+  if (!compiled) {
+    // e.g. while writing a snapshot, with no frame to report from. the
+    // compiler has already reported why.
+    if (frameCount == 0) return false;
+    runtimeError("Could not compile function '%s'.",
+                 function->name->str.c_str());
+    return false;
+  }
+
+  delete function->lazy;
+  function->lazy = nullptr;
+  return true;
+}
 
-  while (upvalue != NULL && upvalue->location > local) {
-    prevUpvalue = upvalue;
-    upvalue = upvalue->nextUpValue;
+// the slow path of OP_GET_PROPERTY: a field or method the cache doesn't
+// know yet, a method it knows, or the length of an array, buffer or string.
+bool VM::getProperty(ObjString* name, PropertyCache* cache) {
+  Value receiver = peek(0);
+  if (!IS_INSTANCE(receiver)) {
+    if (name->isLength) {
+      if (IS_ARRAY(receiver)) {
+        stack_top[-1] = packNumber((double)AS_ARRAY(receiver)->values.size());
+        return true;
+      } else if (IS_BUFFER(receiver)) {
+        stack_top[-1] = packNumber((double)AS_BUFFER(receiver)->values.size());
+        return true;
+      } else if (IS_STRING(receiver)) {
+        stack_top[-1] = packNumber((double)AS_STRING(receiver)->str.size());
+        return true;
+      } else if (IS_MAP(receiver)) {
+        stack_top[-1] = packNumber((double)AS_MAP(receiver)->count);
+        return true;
+      }
+    }
+    runtimeError("Only instances have properties.");
+    return false;
   }
 
-  if (upvalue != NULL && upvalue->location == local) return upvalue;
-  ObjUpvalue* createdUpvalue = allocateUpvalueObject(local, &objects);
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  CacheEntry* entry = cache->find(instance->shape);
+  if (entry != nullptr) {
+    stack_top[-1] = OBJ_VAL(allocateBoundMethodObject(
+        receiver, AS_CLOSURE(entry->method), &objects));
+    return true;
+  }
 
-  createdUpvalue->next = upvalue;
+  // fields shadow methods.
+  int slot = instance->shape->lookup(name);
+  if (slot >= 0) {
+    cache->add(CacheEntry{instance->shape, slot, nullptr, NIL_VAL});
+    stack_top[-1] = instance->fields[slot];
+    return true;
+  }
+  Value method;
+  if (!instance->klass->methods.get(name, &method)) {
+    runtimeError("Undefined property '%s'.", name->str.c_str());
+    return false;
+  }
+  cache->add(CacheEntry{instance->shape, -1, nullptr, method});
+  stack_top[-1] = OBJ_VAL(
+      allocateBoundMethodObject(receiver, AS_CLOSURE(method), &objects));
+  return true;
+}
+
+// the slow path of OP_SET_PROPERTY: stores into an existing field, or adds
+// one and moves the instance to the next shape.
+bool VM::setProperty(ObjString* name, PropertyCache* cache) {
+  if (!IS_INSTANCE(peek(1))) {
+    runtimeError("Only instances have fields.");
+    return false;
+  }
+  ObjInstance* instance = AS_INSTANCE(peek(1));
+  CacheEntry entry{instance->shape, instance->shape->lookup(name), nullptr,
+                   NIL_VAL};
+  if (entry.slot < 0) {
+    entry.next = instance->shape->transition(name);
+    entry.slot = entry.next->slotCount - 1;
+  }
+  cache->add(entry);
+  storeField(instance, &entry, peek(0));
+  Value value = pop();
+  stack_top[-1] = value;
+  return true;
+}
 
-  if (prevUpvalue == NULL) {
-    openUpvalues = createdUpvalue;
+void VM::storeField(ObjInstance* instance, CacheEntry* entry, Value value) {
+  if (entry->next != nullptr) {
+    instance->shape = entry->next;
+    instance->fields.push_back(value);
   } else {
-    prevUpvalue->next = createdUpvalue;
+    instance->fields[entry->slot] = value;
+  }
+}
+
+// the slow path of OP_INVOKE: a method the cache doesn't know yet, or a
+// field, which is called like any other value.
+bool VM::invoke(ObjString* name, PropertyCache* cache, int argCount) {
+  Value receiver = peek(argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have methods.");
+    return false;
+  }
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  CacheEntry* entry = cache->find(instance->shape);
+  int slot = entry != nullptr ? entry->slot : instance->shape->lookup(name);
+  if (slot >= 0) {
+    if (entry == nullptr) {
+      cache->add(CacheEntry{instance->shape, slot, nullptr, NIL_VAL});
+    }
+    Value callee = instance->fields[slot];
+    // a native keeps the receiver below its arguments, so one that waits
+    // finds it there when the OP_INVOKE runs again.
+    if (IS_NATIVE(callee)) {
+      return callNative((ObjNative*)AS_OBJ(callee), argCount);
+    }
+    stack_top[-argCount - 1] = callee;
+    return callValue(callee, argCount);
+  }
+
+  Value method;
+  if (!instance->klass->methods.get(name, &method)) {
+    runtimeError("Undefined property '%s'.", name->str.c_str());
+    return false;
+  }
+  cache->add(CacheEntry{instance->shape, -1, nullptr, method});
+  return call(AS_CLOSURE(method), argCount);
+}
+
+bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
+  Value method;
+  if (!klass->methods.get(name, &method)) {
+    runtimeError("Undefined property '%s'.", name->str.c_str());
+    return false;
+  }
+  return call(AS_CLOSURE(method), argCount);
+}
+
+// replaces the receiver on top of the stack with `name` bound to it.
+bool VM::bindMethod(ObjClass* klass, ObjString* name) {
+  Value method;
+  if (!klass->methods.get(name, &method)) {
+    runtimeError("Undefined property '%s'.", name->str.c_str());
+    return false;
+  }
+  stack_top[-1] = OBJ_VAL(
+      allocateBoundMethodObject(peek(0), AS_CLOSURE(method), &objects));
+  return true;
+}
+
+ObjClosure* VM::allocateStackClosure(ObjFunction* function, Value* slot) {
+  auto& stackClosures = current->stackClosures;
+  size_t index = slot - stack;
+  if (stackClosures.size() <= index) stackClosures.resize(index + 1);
+
+  auto& stackClosure = stackClosures[index];
+  if (stackClosure.closure == nullptr) {
+    stackClosure.closure = new ObjClosure(function);
+    stackClosure.closure->type = ObjType::OBJ_CLOSURE;
+    stackClosure.closure->next = nullptr;
+  }
+
+  ObjClosure* closure = stackClosure.closure;
+  closure->isMarked = false;
+  closure->function = function;
+  closure->upvalueCount = function->upvalueCount;
+  closure->upvalues.assign(function->upvalueCount, nullptr);
+  // entries of an earlier closure in this slot may name shapes long freed.
+  closure->caches.clear();
+
+  stackClosure.captures.resize(function->upvalueCount, ObjUpvalue(nullptr));
+  // captures kept from an earlier closure in this slot may still be marked.
+  for (auto& capture : stackClosure.captures) {
+    capture.type = ObjType::OBJ_UPVALUE;
+    capture.isMarked = false;
+    capture.next = nullptr;
   }
+  return closure;
+}
+
+ObjUpvalue* VM::captureUpvalue(Value* local) {
+  auto& openUpvalues = frames[frameCount - 1].openUpvalues;
+  auto it = std::lower_bound(
+      openUpvalues.begin(), openUpvalues.end(), local,
+      [](ObjUpvalue* upvalue, Value* location) {
+        return upvalue->location < location;
+      });
+  if (it != openUpvalues.end() && (*it)->location == local) return *it;
+
+  ObjUpvalue* createdUpvalue = allocateUpvalueObject(local, &objects);
+  openUpvalues.insert(it, createdUpvalue);
   return createdUpvalue;
 }
 
+// closes every upvalue of the current frame at or above `last`. these are
+// always at the end of the frame's sorted list.
 void VM::closeUpvalues(Value* last) {
-  while (openUpvalues != NULL && openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = openUpvalues;
+  auto& openUpvalues = frames[frameCount - 1].openUpvalues;
+  while (!openUpvalues.empty() && openUpvalues.back()->location >= last) {
+    ObjUpvalue* upvalue = openUpvalues.back();
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    openUpvalues = upvalue->nextUpValue;
+    openUpvalues.pop_back();
+  }
+}
+
+// saves the running stack and continues on `next`'s, or on the VM's own
+// stack for nullptr. nothing is copied.
+void VM::switchTo(ObjFiber* next) {
+  current->top = stack_top;
+  current->frameCount = frameCount;
+  current = next != nullptr ? next->stack : &mainStack;
+  fiber = next;
+  stack = current->values.get();
+  stack_top = current->top;
+  frames = current->frames.get();
+  frameCount = current->frameCount;
+  framesMax = current->framesMax;
+}
+
+FiberStack* VM::acquireStack() {
+  // stacks of dropped fibers only come back through a collection, so run one
+  // before the pool grows much further.
+  if (freeStacks.empty() && fiberStacks.size() >= nextStackCollection) {
+    collectGarbage();
+    nextStackCollection = std::max(
+        nextStackCollection, 2 * (fiberStacks.size() - freeStacks.size()));
+  }
+  if (!freeStacks.empty()) {
+    auto fiberStack = freeStacks.back();
+    freeStacks.pop_back();
+    return fiberStack;
+  }
+  fiberStacks.emplace_back(new FiberStack(FIBER_FRAMES_MAX));
+  return fiberStacks.back().get();
+}
+
+void VM::releaseStack(FiberStack* fiberStack) {
+  // only an abandoned fiber still has frames, and closures may outlive it.
+  for (int i = 0; i < fiberStack->frameCount; i++) {
+    for (auto upvalue : fiberStack->frames[i].openUpvalues) {
+      upvalue->closed = *upvalue->location;
+      upvalue->location = &upvalue->closed;
+    }
+    fiberStack->frames[i].openUpvalues.clear();
+  }
+  fiberStack->top = fiberStack->values.get();
+  fiberStack->frameCount = 0;
+  freeStacks.push_back(fiberStack);
+}
+
+// continues `target` where it yielded, or starts its function on a stack
+// from the pool.
+bool VM::resumeFiber(ObjFiber* target, Value value) {
+  if (target->state == FIBER_DONE) {
+    runtimeError("Cannot resume a finished fiber.");
+    return false;
+  }
+  if (target->state == FIBER_RUNNING) {
+    runtimeError("Cannot resume a running fiber.");
+    return false;
   }
+
+  bool start = target->state == FIBER_NEW;
+  if (start) target->stack = acquireStack();
+  target->caller = fiber;
+  target->state = FIBER_RUNNING;
+  switchTo(target);
+  if (!start) return true;
+
+  int argCount = target->closure->function->arity;
+  push(OBJ_VAL(target->closure));
+  if (argCount == 1) push(value);
+  return call(target->closure, argCount);
+}
+
+// runs `target` from the host, i.e. with no Lox code running, until it
+// yields, returns or a native suspends it. what it yielded or returned is
+// left on the VM's own stack. `deliver` pushes `value` onto a suspended
+// fiber's stack first, as the result of the native that suspended it.
+IntepretResult VM::runFiber(ObjFiber* target, Value value, bool deliver) {
+  if (!resumeFiber(target, value)) return INTERPRET_RUNTIME_ERROR;
+  if (deliver) push(value);
+  return run();
+}
+
+// returns to whoever resumed the running fiber, handing it `value`.
+void VM::suspendFiber(Value value) {
+  ObjFiber* suspended = fiber;
+  suspended->state = FIBER_SUSPENDED;
+  switchTo(suspended->caller);
+  suspended->caller = nullptr;
+  push(value);
+}
+
+// the running fiber's function returned `result`.
+void VM::finishFiber(Value result) {
+  ObjFiber* finished = fiber;
+  finished->state = FIBER_DONE;
+  stack_top = stack;
+  switchTo(finished->caller);
+  releaseStack(finished->stack);
+  finished->stack = nullptr;
+  finished->caller = nullptr;
+  push(result);
 }
@@ -1,13 +1,26 @@
 #ifndef cpplox_vm_h
 #define cpplox_vm_h
 
+#include <deque>
+#include <string>
+#include <unordered_set>
+
 #include "chunk.hpp"
+#include "mapped_file.hpp"
 #include "object.hpp"
+#include "output.hpp"
+#include "program.hpp"
 #include "table.hpp"
 #include "value.hpp"
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// fibers are as deep as the VM's own stack since scheduler tasks run whole
+// programs on them. stacks are pooled, so many fibers still stay cheap.
+#define FIBER_FRAMES_MAX FRAMES_MAX
+
+class MapPool;
+class Worker;
 
 enum IntepretResult {
   INTERPRET_OK,
@@ -15,24 +28,51 @@ enum IntepretResult {
   INTERPRET_RUNTIME_ERROR,
 };
 
-struct CallFrame {
-  ObjClosure* closure;
-  uint8_t* ip;
-  Value* slots;
-};
-
 class VM {
  public:
-  Value stack[STACK_MAX];
+  // the stack being run, the VM's own or a fiber's. see switchTo().
+  Value* stack;
   Value* stack_top;
   Obj* objects;
   Table strings;
   Table globals;
-  ObjUpvalue* openUpvalues;
+  // natives by the name they were defined with, so snapshots can refer to
+  // them by name.
+  Table natives;
   std::vector<Obj*> grayStack;
+  // when set, interpret() only preparses function bodies and keeps the
+  // source alive until the bodies are compiled on their first call.
+  bool lazyCompile = false;
+  std::deque<std::string> sources;
+  std::deque<MappedFile> mappedSources;
+  // threads compiling top-level function bodies, 0 compiles sequentially.
+  int compileWorkers = 0;
+  // scan the whole source into a token stream on another thread while the
+  // compiler consumes it.
+  bool pretokenize = false;
+  // where `print` writes to.
+  OutputSink output;
+  // the scheduler worker this VM belongs to, if any.
+  Worker* worker = nullptr;
+  // the host's pool parallelMap() runs on. if null, the caller maps alone.
+  MapPool* mapPool = nullptr;
+  // fibers only the host refers to between runs, e.g. a worker's tasks.
+  std::unordered_set<ObjFiber*> hostFibers;
+  // shared programs this VM has closures over.
+  std::vector<std::shared_ptr<const Program>> programs;
 
-  CallFrame frames[FRAMES_MAX];
+  CallFrame* frames;
   int frameCount;
+  int framesMax;
+  FiberStack* current;
+  // the running fiber, nullptr on the VM's own stack.
+  ObjFiber* fiber;
+  FiberStack mainStack;
+  // every fiber stack made so far, and the ones free for the next fiber.
+  std::vector<std::unique_ptr<FiberStack>> fiberStacks;
+  std::vector<FiberStack*> freeStacks;
+  // pool size at which acquireStack() collects before making another stack.
+  size_t nextStackCollection = 8;
 
   VM();
   ~VM();
@@ -41,11 +81,16 @@ class VM {
   IntepretResult run();
   IntepretResult interpret(ObjFunction* function);
   IntepretResult interpret(const char* source);
+  IntepretResult runScript(ObjFunction* function);
+  IntepretResult runProgram(std::shared_ptr<const Program> program);
+  void loadFunctions(std::shared_ptr<const Program> program);
+  ObjFunction* compile(const char* source, size_t length);
   void initVM();
   void freeVM();
   void collectGarbage();
   void markRoots();
   void traceReferences();
+  void reclaimStacks();
   void sweep();
 
   void reset_stack();
@@ -56,18 +101,36 @@ class VM {
 
   bool callValue(Value callee, int argCount);
   bool call(ObjClosure* function, int argCount);
+  bool compileLazy(ObjFunction* function);
 
   void defineNative(const char* name, int length, NativeFunctionPtr function);
+  void defineNative(const char* name, int length,
+                    VMNativeFunctionPtr function);
+
+  void switchTo(ObjFiber* next);
+  FiberStack* acquireStack();
+  void releaseStack(FiberStack* stack);
+  bool resumeFiber(ObjFiber* target, Value value);
+  IntepretResult runFiber(ObjFiber* target, Value value, bool deliver);
+  void suspendFiber(Value value);
+  void finishFiber(Value result);
 
   void concatenate();
+  bool checkIndex(Value array, Value index, size_t* slot);
+  bool checkKey(Value key);
+  bool stepLoop(Value* counter, Value limit, bool* again);
+  bool getProperty(ObjString* name, PropertyCache* cache);
+  bool setProperty(ObjString* name, PropertyCache* cache);
+  void storeField(ObjInstance* instance, CacheEntry* entry, Value value);
+  bool bindMethod(ObjClass* klass, ObjString* name);
+  bool invoke(ObjString* name, PropertyCache* cache, int argCount);
+  bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount);
+  bool callNative(ObjNative* native, int argCount);
   void runtimeError(const char* format, ...);
 
+  ObjClosure* allocateStackClosure(ObjFunction* function, Value* slot);
   ObjUpvalue* captureUpvalue(Value* local);
   void closeUpvalues(Value* last);
 };
 
-void initVM();
-void freeVM();
-
-extern VM vm;
 #endif
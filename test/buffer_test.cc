@@ -0,0 +1,111 @@
+#include "main/buffer.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <string>
+
+#include "main/vm.hpp"
+
+// every kernel set agrees with plain loops, whatever is left over after the
+// last full vector. the values are small integers, so sums are exact.
+TEST(Buffer, kernels) {
+  auto kernels = supportedKernels();
+  ASSERT_GE(kernels.size(), 1);
+  EXPECT_EQ(kernels.back(), bestKernels());
+
+  for (auto set : kernels) {
+    for (size_t count = 0; count < 37; count++) {
+      std::vector<double> a(count), b(count), c(count), out(count);
+      double sum = 0, dot = 0, min = 1e9, max = -1e9;
+      for (size_t i = 0; i < count; i++) {
+        a[i] = (double)((i * 7) % 11) - 5;
+        b[i] = (double)i;
+        c[i] = 0.5;
+        sum += a[i], dot += a[i] * b[i];
+        min = std::min(min, a[i]), max = std::max(max, a[i]);
+      }
+
+      set->add(out.data(), a.data(), b.data(), count);
+      for (size_t i = 0; i < count; i++) EXPECT_EQ(out[i], a[i] + b[i]);
+      set->mul(out.data(), a.data(), b.data(), count);
+      for (size_t i = 0; i < count; i++) EXPECT_EQ(out[i], a[i] * b[i]);
+      set->fma(out.data(), a.data(), b.data(), c.data(), count);
+      for (size_t i = 0; i < count; i++) EXPECT_EQ(out[i], a[i] * b[i] + 0.5);
+      // in place.
+      set->add(a.data(), a.data(), a.data(), count);
+      for (size_t i = 0; i < count; i++) a[i] /= 2;
+
+      EXPECT_EQ(set->sum(a.data(), count), sum) << set->name << count;
+      EXPECT_EQ(set->dot(a.data(), b.data(), count), dot) << set->name;
+      if (count == 0) continue;
+      EXPECT_EQ(set->min(a.data(), count), min) << set->name << count;
+      EXPECT_EQ(set->max(a.data(), count), max) << set->name << count;
+    }
+  }
+}
+
+// the element-wise kernels and min and max give the same bits in every
+// kernel set, on values that don't round exactly, NaN and signed zeros.
+TEST(Buffer, kernelsAgree) {
+  auto scalar = supportedKernels().front();
+  double zero = 0.0, nan = std::nan("");
+  for (auto set : supportedKernels()) {
+    for (size_t count = 1; count < 37; count++) {
+      std::vector<double> a(count), b(count), c(count), out(count);
+      for (size_t i = 0; i < count; i++) {
+        a[i] = 0.1 * (double)(i + 1);
+        b[i] = 10.0 / (double)(i + 3);
+        c[i] = -a[i] * b[i];
+      }
+      set->fma(out.data(), a.data(), b.data(), c.data(), count);
+      for (size_t i = 0; i < count; i++) {
+        EXPECT_EQ(out[i], std::fma(a[i], b[i], c[i])) << set->name << i;
+      }
+
+      for (size_t at = 0; at < count; at++) {
+        std::vector<double> values(count, 1.0);
+        values[at] = nan;
+        EXPECT_TRUE(std::isnan(set->min(values.data(), count))) << set->name;
+        EXPECT_TRUE(std::isnan(set->max(values.data(), count))) << set->name;
+
+        std::fill(values.begin(), values.end(), zero);
+        values[at] = -zero;
+        EXPECT_TRUE(std::signbit(set->min(values.data(), count)));
+        EXPECT_EQ(set->min(values.data(), count), 0.0);
+        std::fill(values.begin(), values.end(), -zero);
+        values[at] = zero;
+        EXPECT_FALSE(std::signbit(set->max(values.data(), count)));
+        EXPECT_EQ(set->max(values.data(), count),
+                  scalar->max(values.data(), count));
+      }
+    }
+  }
+}
+
+TEST(Buffer, natives) {
+  VM vm{};
+  vm.initVM();
+  std::string output;
+  vm.output.redirect(&output);
+  auto result = vm.interpret(
+      "var a = buffer([1, -2, 3, 4.5]); var b = buffer(4); fill(b, 2);"
+      "print a; print a.length; print a[3]; print b[0];"
+      "b[1] = 10; print sum(b); print dot(a, b);"
+      "var out = buffer(4); print sum(add(out, a, b)); print out[1];"
+      "print sum(mul(out, a, b)); print sum(fma(out, a, b, a));"
+      "print min(a); print max(a); print min(buffer(0)); print sum(buffer(0));"
+      "copy(out, a); print out[2] == a[2]; print out == a;");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output,
+            "<buffer>\n4\n4.5\n2\n16\n-3\n22.5\n8\n-3\n3.5\n-2\n4.5\nnil\n0\n"
+            "true\nfalse\n");
+
+  for (auto source : {"buffer(-1);", "buffer(0.5);", "buffer([nil]);",
+                      "buffer(2)[2];", "buffer(2)[0] = nil;",
+                      "fill(buffer(2), nil);", "copy(buffer(2), buffer(3));",
+                      "add(buffer(2), buffer(2), [1, 2]);", "sum(1);",
+                      "dot(buffer(1), buffer(2));"}) {
+    EXPECT_EQ(vm.interpret(source), INTERPRET_RUNTIME_ERROR) << source;
+  }
+}
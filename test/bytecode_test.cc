@@ -0,0 +1,149 @@
+#include "main/bytecode.hpp"
+
+#include <gtest/gtest.h>
+
+#include "main/compiler.hpp"
+
+ObjFunction* compileSource(const char* source, Table* strings, Obj** objs) {
+  auto compiler = new Compiler(source, strings, objs);
+  return compiler->compile();
+}
+
+void expectSameFunction(ObjFunction* expected, ObjFunction* actual) {
+  EXPECT_EQ(expected->arity, actual->arity);
+  EXPECT_EQ(expected->upvalueCount, actual->upvalueCount);
+  EXPECT_EQ(expected->chunk.code, actual->chunk.code);
+  EXPECT_EQ(expected->chunk.lines, actual->chunk.lines);
+  if (expected->name == nullptr) {
+    EXPECT_EQ(actual->name, nullptr);
+  } else {
+    ASSERT_NE(actual->name, nullptr);
+    EXPECT_EQ(expected->name->str, actual->name->str);
+  }
+
+  auto& constants = expected->chunk.constants.values;
+  ASSERT_EQ(constants.size(), actual->chunk.constants.values.size());
+  for (size_t i = 0; i < constants.size(); i++) {
+    auto value = actual->chunk.constants.values[i];
+    if (IS_FUNCTION(constants[i])) {
+      ASSERT_TRUE(IS_FUNCTION(value));
+      expectSameFunction(AS_FUNCTION(constants[i]), AS_FUNCTION(value));
+    } else {
+      EXPECT_TRUE(valuesEqual(constants[i], value));
+    }
+  }
+}
+
+TEST(Bytecode, hashSource) {
+  EXPECT_EQ(hashSource("print 1;", 8), hashSource("print 1;", 8));
+  EXPECT_NE(hashSource("print 1;", 8), hashSource("print 2;", 8));
+}
+
+TEST(Bytecode, roundTrip) {
+  const char* source =
+      "var greeting = \"hello\";"
+      "fun outer(a, b) {"
+      "  var x = a;"
+      "  fun inner() { return x + b; }"
+      "  return inner;"
+      "}"
+      "print outer(1, 2)();"
+      "print greeting;"
+      "print true == nil;";
+  Obj* objs = nullptr;
+  auto script = compileSource(source, new Table{}, &objs);
+  ASSERT_TRUE(script);
+
+  auto image = serializeFunction(script, 1234);
+  uint64_t sourceHash = 0;
+  auto strings = new Table{};
+  Obj* loadedObjs = nullptr;
+  auto loaded = deserializeFunction(image.data(), image.size(), &sourceHash,
+                                    strings, &loadedObjs);
+  ASSERT_TRUE(loaded);
+  EXPECT_EQ(sourceHash, 1234);
+  expectSameFunction(script, loaded);
+
+  // strings are interned with their recorded hash.
+  auto greeting = new ObjString("greeting");
+  auto interned = strings->findString(greeting);
+  ASSERT_TRUE(interned);
+  EXPECT_EQ(interned->hash, greeting->hash);
+}
+
+TEST(Bytecode, rejectsMalformedImage) {
+  Obj* objs = nullptr;
+  auto script = compileSource("print 1 + 2;", new Table{}, &objs);
+  auto image = serializeFunction(script, 1);
+
+  auto truncated = std::vector<uint8_t>(image.begin(), image.end() - 3);
+  EXPECT_EQ(deserializeFunction(truncated.data(), truncated.size(), nullptr,
+                                new Table{}, &objs),
+            nullptr);
+
+  image[0] ^= 0xff;
+  EXPECT_EQ(deserializeFunction(image.data(), image.size(), nullptr,
+                                new Table{}, &objs),
+            nullptr);
+}
+
+TEST(Bytecode, verifiesCode) {
+  Obj* objs = nullptr;
+  auto script = compileSource(
+      "fun f(a) { var b = a; if (b) return b.x; return a; } print f(1);",
+      new Table{}, &objs);
+  ASSERT_TRUE(script);
+  auto f = AS_FUNCTION(script->chunk.constants.values[1]);
+  ASSERT_TRUE(verifyFunction(script));
+  ASSERT_TRUE(verifyFunction(f));
+
+  // changes one byte of f's code and tells whether it still verifies.
+  auto verifies = [&](size_t offset, uint8_t byte) {
+    uint8_t original = f->chunk.code[offset];
+    f->chunk.code[offset] = byte;
+    bool verified = verifyFunction(f);
+    f->chunk.code[offset] = original;
+    return verified;
+  };
+  // f: GET_LOCAL 1, GET_LOCAL 2, JUMP_IF_FALSE, POP, GET_LOCAL 2,
+  //    GET_PROPERTY, RETURN, ...
+  ASSERT_EQ(f->chunk.code[0], OP_GET_LOCAL);
+  ASSERT_EQ(f->chunk.code[4], OP_JUMP_IF_FALSE);
+  ASSERT_EQ(f->chunk.code[10], OP_GET_PROPERTY);
+  // a local above the stack.
+  EXPECT_FALSE(verifies(1, 2));
+  // a jump past the end and into an instruction's operands.
+  EXPECT_FALSE(verifies(5, 0xff));
+  EXPECT_FALSE(verifies(6, f->chunk.code[6] + 2));
+  // a constant that isn't there and a cache that isn't there.
+  EXPECT_FALSE(verifies(11, 200));
+  EXPECT_FALSE(verifies(13, f->cacheCount));
+  // an unknown opcode.
+  EXPECT_FALSE(verifies(0, 0xff));
+  // popping the callee.
+  EXPECT_FALSE(verifies(2, OP_POP));
+
+  // the loader rejects an image with bad code.
+  f->chunk.code[1] = 200;
+  auto image = serializeFunction(script, 1);
+  EXPECT_EQ(deserializeFunction(image.data(), image.size(), nullptr,
+                                new Table{}, &objs),
+            nullptr);
+}
+
+TEST(Bytecode, bytecodeFile) {
+  Obj* objs = nullptr;
+  auto script = compileSource("fun f(a) { return a; } print f(1);",
+                              new Table{}, &objs);
+  std::string path = testing::TempDir() + "bytecode_test.loxc";
+  ASSERT_TRUE(writeBytecodeFile(path.c_str(), script, 42));
+  EXPECT_TRUE(isBytecodeFile(path.c_str()));
+
+  // a different source hash means the image is stale.
+  EXPECT_EQ(loadBytecodeFile(path.c_str(), 43, new Table{}, &objs), nullptr);
+
+  auto loaded = loadBytecodeFile(path.c_str(), 42, new Table{}, &objs);
+  ASSERT_TRUE(loaded);
+  expectSameFunction(script, loaded);
+  remove(path.c_str());
+}
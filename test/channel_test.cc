@@ -0,0 +1,306 @@
+#include "main/channel.hpp"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "main/object.hpp"
+#include "main/scheduler.hpp"
+#include "main/vm.hpp"
+
+static SharedValue number(double value) {
+  SharedValue shared;
+  shared.kind = SHARED_NUMBER;
+  shared.number = value;
+  return shared;
+}
+
+TEST(Channel, ring) {
+  EXPECT_EQ(Channel(1).capacity(), 2);
+  EXPECT_EQ(Channel(5).capacity(), 8);
+
+  Channel channel(4);
+  SharedValue value;
+  EXPECT_FALSE(channel.tryReceive(&value));
+  for (int i = 0; i < 4; i++) {
+    value = number(i);
+    EXPECT_TRUE(channel.trySend(&value));
+  }
+  value = number(4);
+  EXPECT_FALSE(channel.trySend(&value));
+  EXPECT_EQ(value.number, 4);
+
+  // in order, and around the ring more than once.
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(channel.tryReceive(&value));
+    EXPECT_EQ(value.number, i);
+    value = number(i + 4);
+    EXPECT_TRUE(channel.trySend(&value));
+  }
+
+  EXPECT_FALSE(channel.isClosed());
+  channel.close();
+  EXPECT_TRUE(channel.isClosed());
+}
+
+// every value sent by several threads is received exactly once.
+TEST(Channel, mpmc) {
+  const int producers = 4, consumers = 4, count = 20000;
+  Channel channel(64);
+  std::vector<std::thread> threads;
+  std::vector<double> sums(consumers);
+  std::atomic<int> received(0);
+
+  for (int p = 0; p < producers; p++) {
+    threads.emplace_back([&, p] {
+      for (int i = 1; i <= count; i++) {
+        SharedValue value = number(i);
+        while (!channel.trySend(&value)) std::this_thread::yield();
+      }
+    });
+  }
+  for (int c = 0; c < consumers; c++) {
+    threads.emplace_back([&, c] {
+      SharedValue value;
+      while (received.load() < producers * count) {
+        if (channel.tryReceive(&value)) {
+          sums[c] += value.number;
+          received++;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  double total = 0;
+  for (auto sum : sums) total += sum;
+  EXPECT_EQ(total, producers * (double)count * (count + 1) / 2);
+}
+
+// a string's shared storage is made once and handed on. a heap copies the
+// characters only for a string it doesn't hold yet.
+TEST(Channel, strings) {
+  Channel channel(2);
+  VM a{}, b{};
+  a.initVM(), b.initVM();
+  auto string = allocateStringObject("payload", 7, &a.strings, &a.objects);
+
+  SharedValue value;
+  ASSERT_TRUE(SharedValue::from(OBJ_VAL(string), &value));
+  ASSERT_NE(string->shared, nullptr);
+  auto storage = string->shared.get();
+  ASSERT_TRUE(channel.trySend(&value));
+  ASSERT_TRUE(channel.tryReceive(&value));
+  EXPECT_EQ(value.string.get(), storage);
+
+  Value received = value.toValue(&b);
+  ASSERT_TRUE(IS_STRING(received));
+  EXPECT_EQ(AS_STRING(received)->str, "payload");
+  EXPECT_EQ(AS_STRING(received)->shared.get(), storage);
+
+  // sending it on reuses the storage too.
+  SharedValue forwarded;
+  ASSERT_TRUE(SharedValue::from(received, &forwarded));
+  EXPECT_EQ(forwarded.string.get(), storage);
+
+  // receiving it again finds the string `b` already holds.
+  EXPECT_EQ(AS_OBJ(value.toValue(&b)), AS_OBJ(received));
+}
+
+// a buffer's doubles are handed over: the receiver gets the sender's
+// storage and the sender's buffer is left empty.
+TEST(Channel, buffers) {
+  Channel channel(2);
+  VM a{}, b{};
+  a.initVM(), b.initVM();
+  auto buffer = allocateBufferObject(3, &a.objects);
+  buffer->values = {1, 2, 3};
+  auto storage = buffer->values.data();
+
+  SharedValue value;
+  ASSERT_TRUE(SharedValue::from(OBJ_VAL(buffer), &value));
+  EXPECT_TRUE(buffer->values.empty());
+  ASSERT_TRUE(channel.trySend(&value));
+  ASSERT_TRUE(channel.tryReceive(&value));
+
+  Value received = value.take(&b);
+  ASSERT_TRUE(IS_BUFFER(received));
+  EXPECT_EQ(AS_BUFFER(received)->values.data(), storage);
+  EXPECT_EQ(AS_BUFFER(received)->values, (std::vector<double>{1, 2, 3}));
+
+  std::string output;
+  a.output.redirect(&output);
+  ASSERT_EQ(a.interpret("var c = channel(1); var xs = buffer(2); xs[1] = 5;"
+                        "send(c, xs); print xs.length;"
+                        "var ys = receive(c); print ys.length; print ys[1];"),
+            INTERPRET_OK);
+  a.output.flush();
+  EXPECT_EQ(output, "0\n2\n5\n");
+}
+
+// a channel made with a type only takes values of that type.
+TEST(Channel, types) {
+  std::string output;
+  VM vm{};
+  vm.initVM();
+  vm.output.redirect(&output);
+  ASSERT_EQ(vm.interpret("var c = channel(2, \"number\"); send(c, 1);"
+                         "send(c, 2.5); print receive(c) + receive(c);"
+                         "var any = channel(2);"
+                         "send(any, \"a\"); send(any, 1);"),
+            INTERPRET_OK);
+  vm.output.flush();
+  EXPECT_EQ(output, "3.5\n");
+
+  auto typed = std::make_shared<Channel>(2, SHARED_STRING);
+  EXPECT_TRUE(typed->accepts(SHARED_STRING));
+  EXPECT_FALSE(typed->accepts(SHARED_NIL));
+  EXPECT_TRUE(Channel(2).accepts(SHARED_BUFFER));
+
+  for (auto source :
+       {"send(channel(1, \"number\"), \"one\");",
+        "send(channel(1, \"string\"), nil);",
+        "var xs = buffer(1); send(channel(1, \"number\"), xs);",
+        "channel(1, \"closure\");", "channel(1, 2);"}) {
+    EXPECT_EQ(vm.interpret(source), INTERPRET_RUNTIME_ERROR) << source;
+  }
+}
+
+// a waiter only sleeps if nothing changed since it last looked, and every
+// change wakes whoever waits.
+TEST(Channel, waiters) {
+  Channel channel(2);
+  uint64_t version = channel.version();
+  SharedValue value;
+  ASSERT_TRUE(channel.trySend(&value));
+  // changed since `version`, so there's nothing to wait for.
+  EXPECT_FALSE(channel.park(version, [] {}));
+  channel.waitFor(version);
+
+  std::atomic<int> woken{0};
+  version = channel.version();
+  ASSERT_TRUE(channel.park(version, [&] { woken++; }));
+  ASSERT_TRUE(channel.park(version, [&] { woken++; }));
+  ASSERT_TRUE(channel.tryReceive(&value));
+  EXPECT_EQ(woken, 2);
+  // each is woken once.
+  channel.close();
+  EXPECT_EQ(woken, 2);
+
+  Channel empty(2);
+  version = empty.version();
+  std::thread sender([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    SharedValue one;
+    one.kind = SHARED_NUMBER;
+    one.number = 1;
+    empty.trySend(&one);
+  });
+  empty.waitFor(version);
+  ASSERT_TRUE(empty.tryReceive(&value));
+  EXPECT_EQ(value.number, 1);
+  sender.join();
+}
+
+// two isolates on their own threads, joined by channels the host made.
+TEST(Channel, isolates) {
+  // replies are only read once every request is out, so they all fit.
+  auto requests = std::make_shared<Channel>(4);
+  auto replies = std::make_shared<Channel>(16);
+
+  std::string output;
+  std::thread worker([&] {
+    VM vm{};
+    vm.initVM();
+    defineChannel(&vm, "requests", requests);
+    defineChannel(&vm, "replies", replies);
+    vm.interpret(
+        "var name = receive(requests);"
+        "while (name != nil) {"
+        "  send(replies, \"hello \" + name); name = receive(requests); }"
+        "close(replies);");
+  });
+
+  VM vm{};
+  vm.initVM();
+  vm.output.redirect(&output);
+  defineChannel(&vm, "requests", requests);
+  defineChannel(&vm, "replies", replies);
+  ASSERT_EQ(vm.interpret("for (var i = 0; i < 10; i = i + 1) send(requests, "
+                         "\"lox\");"
+                         "close(requests);"
+                         "var reply = receive(replies); var count = 0;"
+                         "while (reply != nil) {"
+                         "  count = count + 1; reply = receive(replies); }"
+                         "print count;"),
+            IntepretResult::INTERPRET_OK);
+  worker.join();
+  vm.output.flush();
+  EXPECT_EQ(output, "10\n");
+}
+
+// tasks waiting on a channel give their worker to the others, so even a
+// single worker gets through more values than the channel holds.
+TEST(Channel, tasks) {
+  const char* source =
+      "fun produce(out) {"
+      "  for (var i = 1; i <= 25; i = i + 1) send(out, i); return nil; }"
+      "fun spawnAll(n, out) { if (n == 0) return nil;"
+      "  spawn(produce, out); spawnAll(n - 1, out); }"
+      "var results = channel(2);"
+      "spawnAll(4, results);"
+      "var total = 0;"
+      "for (var i = 0; i < 100; i = i + 1) total = total + receive(results);"
+      "print total;"
+      "var names = channel(4); send(names, \"a\"); close(names);"
+      "print receive(names); print receive(names); print names;";
+  auto program = Program::compile(source, strlen(source));
+  ASSERT_NE(program, nullptr);
+  for (int workers : {1, 3}) {
+    std::string output;
+    Scheduler scheduler(program, workers);
+    scheduler.scriptVm->output.redirect(&output);
+    EXPECT_TRUE(scheduler.run());
+    EXPECT_EQ(output, "1300\na\nnil\n<channel>\n") << workers;
+  }
+}
+
+// a receive called through a field waits and runs its OP_INVOKE again.
+TEST(Channel, invoke) {
+  const char* source =
+      "fun produce(out) {"
+      "  for (var i = 1; i <= 25; i = i + 1) send(out, i); return nil; }"
+      "class Inbox {} var inbox = Inbox(); inbox.receive = receive;"
+      "var results = channel(2);"
+      "spawn(produce, results); spawn(produce, results);"
+      "var total = 0;"
+      "for (var i = 0; i < 50; i = i + 1)"
+      "  total = total + inbox.receive(results);"
+      "print total;";
+  auto program = Program::compile(source, strlen(source));
+  ASSERT_NE(program, nullptr);
+  std::string output;
+  Scheduler scheduler(program, 1);
+  scheduler.scriptVm->output.redirect(&output);
+  EXPECT_TRUE(scheduler.run());
+  EXPECT_EQ(output, "650\n");
+}
+
+TEST(Channel, errors) {
+  VM vm{};
+  vm.initVM();
+  EXPECT_EQ(vm.interpret("channel(0);"), INTERPRET_RUNTIME_ERROR);
+  EXPECT_EQ(vm.interpret("channel(0/0);"), INTERPRET_RUNTIME_ERROR);
+  EXPECT_EQ(vm.interpret("send(1, 2);"), INTERPRET_RUNTIME_ERROR);
+  EXPECT_EQ(vm.interpret("fun f() {} send(channel(1), f);"),
+            INTERPRET_RUNTIME_ERROR);
+  EXPECT_EQ(vm.interpret("var c = channel(1); close(c); send(c, 1);"),
+            INTERPRET_RUNTIME_ERROR);
+  EXPECT_EQ(vm.interpret("receive(nil);"), INTERPRET_RUNTIME_ERROR);
+}
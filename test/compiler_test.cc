@@ -2,12 +2,22 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+
 #include "main/value.hpp"
 
 Obj* tmpObj = new Obj{};
 
 #define NEW_COMPILER(source) new Compiler(source, new Table{}, &tmpObj)
 
+TEST(Compiler, sourceLength) {
+  const char* source = "print 1;print";
+  auto compiler = new Compiler(source, (size_t)8, new Table{}, &tmpObj);
+  auto script = compiler->compile();
+  ASSERT_TRUE(script);
+  EXPECT_EQ(script->chunk.code[2], OptCode::OP_PRINT);
+}
+
 TEST(Compiler, check) {
   auto compiler = NEW_COMPILER("true");
   compiler->advance();
@@ -119,6 +129,18 @@ TEST(Compiler, printStatement) {
   EXPECT_EQ(compiler->function->chunk.code[2], OptCode::OP_PRINT);
 }
 
+TEST(Compiler, yieldStatement) {
+  auto compiler = NEW_COMPILER("1.1; ;");
+  compiler->advance();
+  compiler->yieldStatement();
+  compiler->yieldStatement();
+  ASSERT_EQ(compiler->function->chunk.code.size(), 5);
+  EXPECT_EQ(compiler->function->chunk.code[0], OptCode::OP_CONSTANT);
+  EXPECT_EQ(compiler->function->chunk.code[2], OptCode::OP_YIELD);
+  EXPECT_EQ(compiler->function->chunk.code[3], OptCode::OP_NIL);
+  EXPECT_EQ(compiler->function->chunk.code[4], OptCode::OP_YIELD);
+}
+
 TEST(Compiler, defineVariable) {
   {  // global variable
     auto compiler = NEW_COMPILER("");
@@ -194,8 +216,9 @@ TEST(Compiler, binary) {
     compiler->advance();                                                       \
     compiler->expression();                                                    \
     EXPECT_EQ(compiler->function->chunk.constants.values.size(), 2);           \
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[0].number, 1); \
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[1].number, 2); \
+    auto& constants = compiler->function->chunk.constants.values;              \
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[0]), 1);                              \
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[1]), 2);                              \
     EXPECT_EQ(compiler->function->chunk.code.size(), is_pair ? 6 : 5);         \
     EXPECT_EQ(compiler->function->chunk.code[0], OptCode::OP_CONSTANT);        \
     EXPECT_EQ(compiler->function->chunk.code[1], 0);                           \
@@ -226,7 +249,8 @@ TEST(Compiler, unary) {
     compiler->advance();  // previous on -
     unary(compiler, false);
     EXPECT_EQ(compiler->function->chunk.constants.values.size(), 1);
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.peek()->number, 100);
+    EXPECT_DOUBLE_EQ(AS_NUMBER(*compiler->function->chunk.constants.peek()),
+                     100);
     EXPECT_EQ(compiler->function->chunk.code.size(), 3);
     EXPECT_EQ(compiler->function->chunk.code[0], OptCode::OP_CONSTANT);
     EXPECT_EQ(compiler->function->chunk.code[1], 0);
@@ -279,7 +303,7 @@ TEST(Compiler, namedVariable) {
     ASSERT_EQ(
         ((ObjString*)(compiler->function->chunk.constants.values[0].obj))->str,
         "variable");
-    ASSERT_DOUBLE_EQ(compiler->function->chunk.constants.values[1].number,
+    ASSERT_DOUBLE_EQ(AS_NUMBER(compiler->function->chunk.constants.values[1]),
                      1000.1);
     ASSERT_EQ(compiler->function->chunk.code.size(), 4);
     ASSERT_EQ(compiler->function->chunk.code[0], OptCode::OP_CONSTANT);
@@ -308,10 +332,11 @@ TEST(Compiler, expression) {
     auto compiler = NEW_COMPILER("1+(2*3)");
     compiler->advance();  // current on 1
     compiler->expression();
-    EXPECT_EQ(compiler->function->chunk.constants.values.size(), 3);
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[0].number, 1);
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[1].number, 2);
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[2].number, 3);
+    auto& constants = compiler->function->chunk.constants.values;
+    EXPECT_EQ(constants.size(), 3);
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[0]), 1);
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[1]), 2);
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[2]), 3);
 
     EXPECT_EQ(compiler->function->chunk.code.size(), 8);
     EXPECT_EQ(compiler->function->chunk.code[0], OptCode::OP_CONSTANT);
@@ -330,11 +355,12 @@ TEST(Compiler, expression) {
     auto compiler = NEW_COMPILER("1+(2*3-1.1)");
     compiler->advance();  // current on 1
     compiler->expression();
-    EXPECT_EQ(compiler->function->chunk.constants.values.size(), 4);
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[0].number, 1);
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[1].number, 2);
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[2].number, 3);
-    EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.values[3].number, 1.1);
+    auto& constants = compiler->function->chunk.constants.values;
+    EXPECT_EQ(constants.size(), 4);
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[0]), 1);
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[1]), 2);
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[2]), 3);
+    EXPECT_DOUBLE_EQ(AS_NUMBER(constants[3]), 1.1);
 
     EXPECT_EQ(compiler->function->chunk.code.size(), 11);
     EXPECT_EQ(compiler->function->chunk.code[0], OptCode::OP_CONSTANT);
@@ -358,7 +384,8 @@ TEST(Compiler, expression) {
 TEST(Compiler, parsePrecedence) {
   auto compiler = NEW_COMPILER("-1.1+1000");
   compiler->advance();  // current on -
-  compiler->parsePrecedence(Precedence::PREC_TERM);
+  // '+' binds looser than factor, so parsing stops after the unary.
+  compiler->parsePrecedence(Precedence::PREC_FACTOR);
   EXPECT_EQ(compiler->function->chunk.constants.values.size(), 1);
   EXPECT_DOUBLE_EQ(compiler->function->chunk.constants.peek()->number, 1.1);
 
@@ -509,7 +536,7 @@ TEST(Compiler, compileFunction) {
   ASSERT_EQ(function->chunk.code[0], OptCode::OP_CONSTANT);
   ASSERT_EQ(function->chunk.code[1], 0);
   ASSERT_EQ(function->chunk.constants.values.size(), 1);
-  ASSERT_EQ(function->chunk.constants.values[0].number, 100);
+  ASSERT_EQ(AS_NUMBER(function->chunk.constants.values[0]), 100);
 }
 
 TEST(Compiler, argumentList) {
@@ -533,3 +560,226 @@ TEST(Compiler, call) {
   ASSERT_EQ(compiler->function->chunk.code[0], OptCode::OP_CALL);
   ASSERT_EQ(compiler->function->chunk.code[1], 0);
 }
+
+TEST(Compiler, array) {
+  auto compiler = NEW_COMPILER("[1, 2,][0] = [][0]; print \"ab\".length;");
+  compiler->advance();
+  compiler->statement();
+  auto& code = compiler->function->chunk.code;
+  std::vector<uint8_t> expected = {
+      OP_CONSTANT, 0, OP_CONSTANT, 1, OP_ARRAY,     2, OP_CONSTANT, 2,
+      OP_ARRAY,    0, OP_CONSTANT, 3, OP_GET_INDEX, OP_SET_INDEX, OP_POP};
+  EXPECT_EQ(code, expected);
+  compiler->statement();
+  EXPECT_EQ(code[code.size() - 5], OP_GET_PROPERTY);
+  EXPECT_FALSE(compiler->parser->hadError);
+
+  for (auto source : {"[1, 2;", "a[1;"}) {
+    auto failing = NEW_COMPILER(source);
+    EXPECT_EQ(failing->compile(), nullptr) << source;
+  }
+}
+
+TEST(Compiler, classes) {
+  auto compiler = NEW_COMPILER("class A < B { init() { this.x = 1; } }");
+  auto script = compiler->compile();
+  ASSERT_TRUE(script);
+  auto& code = script->chunk.code;
+  // class, its global, the superclass, `super` and the inheriting class.
+  std::vector<uint8_t> head = {OP_CLASS,      0, OP_DEFINE_GLOBAL, 0,
+                               OP_GET_GLOBAL, 1, OP_GET_GLOBAL,    2,
+                               OP_INHERIT};
+  EXPECT_EQ(std::vector<uint8_t>(code.begin(), code.begin() + head.size()),
+            head);
+
+  ObjFunction* init = nullptr;
+  for (auto constant : script->chunk.constants.values) {
+    if (IS_FUNCTION(constant)) init = AS_FUNCTION(constant);
+  }
+  ASSERT_TRUE(init);
+  EXPECT_EQ(init->name->str, "init");
+  EXPECT_EQ(init->cacheCount, 1);
+  // this, the constant, then the property with its cache. initializers
+  // return `this`.
+  std::vector<uint8_t> body = {OP_GET_LOCAL,     0, OP_CONSTANT,  1,
+                               OP_SET_PROPERTY,  0, 0,            0,
+                               OP_POP,           OP_GET_LOCAL,  0,
+                               OP_RETURN};
+  EXPECT_EQ(init->chunk.code, body);
+
+  // methods are called without binding them.
+  compiler = NEW_COMPILER("a.f(1, 2);");
+  compiler->advance();
+  compiler->statement();
+  std::vector<uint8_t> invoke = {OP_GET_GLOBAL, 0, OP_CONSTANT, 2,
+                                 OP_CONSTANT,   3, OP_INVOKE,   1,
+                                 0,             0, 2,           OP_POP};
+  EXPECT_EQ(compiler->function->chunk.code, invoke);
+
+  for (auto source : {"this;", "fun f() { this; }", "super.a;",
+                      "class A { f() { super.f; } }", "class A < A {}",
+                      "class A { init() { return 1; } }", "a.;"}) {
+    auto failing = NEW_COMPILER(source);
+    EXPECT_EQ(failing->compile(), nullptr) << source;
+  }
+}
+
+TEST(Compiler, countedLoop) {
+  auto compile = [](const char* source) {
+    auto compiler = NEW_COMPILER(source);
+    auto script = compiler->compile();
+    EXPECT_TRUE(script) << source;
+    return script->chunk.code;
+  };
+  // the test before the first iteration, the body and the fused step back to
+  // it, then the way out past the condition's pop.
+  std::vector<uint8_t> expected = {
+      OP_CONSTANT,     0, OP_GET_LOCAL, 1, OP_CONSTANT, 1, OP_LESS,
+      OP_JUMP_IF_FALSE, 0, 12,          OP_POP,      OP_GET_LOCAL, 1,
+      OP_PRINT,        OP_FOR_CONSTANT, 1, 1,        0,            8,
+      OP_JUMP,         0, 1,            OP_POP,      OP_POP,       OP_NIL,
+      OP_RETURN};
+  EXPECT_EQ(compile("for (var i = 0; i < 10; i = i + 1) print i;"), expected);
+
+  auto contains = [](std::vector<uint8_t> code, uint8_t instruction) {
+    return std::find(code.begin(), code.end(), instruction) != code.end();
+  };
+  EXPECT_TRUE(contains(compile("{ var n = 3; for (var i = 0; i < n; i = i + 1) "
+                               "{ print i; } }"),
+                       OP_FOR_LOCAL));
+  // anything else is an ordinary loop.
+  for (auto source : {"for (var i = 0; i < 10; i = i + 2) {}",
+                      "for (var i = 0; i <= 10; i = i + 1) {}",
+                      "var n = 10; for (var i = 0; i < n; i = i + 1) {}",
+                      "for (var i = 0; i < [1].length; i = i + 1) {}",
+                      "{ var j = 0; for (var i = 0; i < 9; j = j + 1) {} }",
+                      "for (var i = 0; i < 10; i = 1 + i) {}",
+                      "for (var i = 0; i < i; i = i + 1) {}"}) {
+    auto code = compile(source);
+    EXPECT_FALSE(contains(code, OP_FOR_CONSTANT)) << source;
+    EXPECT_FALSE(contains(code, OP_FOR_LOCAL)) << source;
+  }
+}
+
+TEST(Compiler, stackClosure) {
+#define run(src, exp)                                                    \
+  {                                                                      \
+    auto compiler = NEW_COMPILER(src);                                   \
+    auto script = compiler->compile();                                   \
+    ASSERT_TRUE(script);                                                 \
+    ObjFunction* outer = AS_FUNCTION(script->chunk.constants.values[1]); \
+    EXPECT_EQ(outer->chunk.code[0], exp);                                \
+  }
+  // only ever called.
+  run("fun outer() { fun helper(a) { return a; } helper(1); }",
+      OptCode::OP_STACK_CLOSURE);
+  // recursion through its own upvalue.
+  run("fun outer() { fun helper(a) { return helper(a); } helper(1); }",
+      OptCode::OP_STACK_CLOSURE);
+  // returned.
+  run("fun outer() { fun helper() {} return helper; }", OptCode::OP_CLOSURE);
+  // stored.
+  run("fun outer() { fun helper() {} var a = helper; }", OptCode::OP_CLOSURE);
+  // captured by another closure.
+  run("fun outer() { fun helper() {} fun other() { helper(); } }",
+      OptCode::OP_CLOSURE);
+  // a nested closure shares one of its upvalues.
+  run("fun outer(x) { fun helper() { fun f() { x; } } helper(); }",
+      OptCode::OP_CLOSURE);
+#undef run
+}
+
+TEST(Compiler, lazy) {
+  auto compiler = NEW_COMPILER(
+      "fun outer(a, b) {"
+      "  var x = a;"
+      "  fun inner() { return x + b + y; }"
+      "  return inner;"
+      "}");
+  compiler->lazy = true;
+  auto script = compiler->compile();
+  ASSERT_TRUE(script);
+
+  // only the parameters were parsed.
+  ObjFunction* outer = AS_FUNCTION(script->chunk.constants.values[1]);
+  ASSERT_NE(outer->lazy, nullptr);
+  EXPECT_EQ(outer->arity, 2);
+  EXPECT_EQ(outer->chunk.count(), 0);
+
+  Table strings{};
+  Obj* objects = nullptr;
+  auto body = Compiler(outer, &strings, &objects);
+  ASSERT_TRUE(body.compileLazyBody());
+  EXPECT_EQ(outer->arity, 2);
+  EXPECT_GT(outer->chunk.count(), 0);
+
+  // `inner` is preparsed in turn, capturing `x` and `b` but not the global.
+  ObjFunction* inner = nullptr;
+  for (auto value : outer->chunk.constants.values) {
+    if (IS_FUNCTION(value)) inner = AS_FUNCTION(value);
+  }
+  ASSERT_NE(inner, nullptr);
+  ASSERT_NE(inner->lazy, nullptr);
+  EXPECT_EQ(inner->upvalueCount, 2);
+  ASSERT_EQ(inner->lazy->upvalueNames.size(), 2);
+  EXPECT_EQ(std::string(inner->lazy->upvalueNames[0].start, 1), "x");
+  EXPECT_EQ(std::string(inner->lazy->upvalueNames[1].start, 1), "b");
+}
+
+// unlike the bytecode test's helper, the two functions intern their strings in
+// different tables, so strings compare by contents.
+static void expectSameFunction(ObjFunction* expected, ObjFunction* actual) {
+  ASSERT_EQ(expected->arity, actual->arity);
+  ASSERT_EQ(expected->upvalueCount, actual->upvalueCount);
+  EXPECT_EQ(actual->lazy, nullptr);
+  EXPECT_EQ(expected->chunk.code, actual->chunk.code);
+  EXPECT_EQ(expected->chunk.lines, actual->chunk.lines);
+  auto& constants = expected->chunk.constants.values;
+  ASSERT_EQ(constants.size(), actual->chunk.constants.values.size());
+  for (size_t i = 0; i < constants.size(); i++) {
+    Value a = constants[i], b = actual->chunk.constants.values[i];
+    ASSERT_EQ(a.type, b.type);
+    if (IS_STRING(a)) {
+      EXPECT_EQ(AS_STRING(a)->str, AS_STRING(b)->str);
+    } else if (IS_FUNCTION(a)) {
+      expectSameFunction(AS_FUNCTION(a), AS_FUNCTION(b));
+    } else {
+      EXPECT_TRUE(valuesEqual(a, b));
+    }
+  }
+}
+
+TEST(Compiler, parallel) {
+  std::string source = "var total = 0;\n";
+  for (int i = 0; i < 32; i++) {
+    auto n = std::to_string(i);
+    source += "fun f" + n + "(a, b) {\n  var s = \"s" + n + "\";\n" +
+              "  fun inner() { return a + b + " + n + "; }\n" +
+              "  if (a > b) { return inner(); }\n  return \"shared\";\n}\n" +
+              "total = total + f" + n + "(" + n + ", 1);\n";
+  }
+  source += "{ var x = 1; fun local() { return x; } }\n";
+
+  Table sequentialStrings{}, parallelStrings{};
+  Obj* objects = nullptr;
+  auto sequential = Compiler(source.c_str(), &sequentialStrings, &objects);
+  auto expected = sequential.compile();
+  ASSERT_TRUE(expected);
+
+  auto parallel = Compiler(source.c_str(), &parallelStrings, &objects);
+  parallel.workers = 4;
+  auto actual = parallel.compile();
+  ASSERT_TRUE(actual);
+  expectSameFunction(expected, actual);
+
+  // strings interned by the workers were merged into the table.
+  auto name = new ObjString("s31", 3);
+  EXPECT_NE(parallelStrings.findString(name), nullptr);
+  EXPECT_EQ(parallelStrings.count, sequentialStrings.count);
+
+  // errors inside a deferred body fail the whole compile.
+  Table strings{};
+  auto broken = Compiler("fun f() { var; }", &strings, &objects);
+  broken.workers = 2;
+  EXPECT_EQ(broken.compile(), nullptr);
+}
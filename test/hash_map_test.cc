@@ -0,0 +1,102 @@
+#include "main/hash_map.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <string>
+
+#include "main/object.hpp"
+#include "main/vm.hpp"
+
+TEST(HashMap, objMap) {
+  Obj* objects = nullptr;
+  ObjMap* map = allocateMapObject(&objects);
+  Value value;
+  EXPECT_FALSE(map->get(NIL_VAL, &value));
+  EXPECT_FALSE(map->remove(NIL_VAL));
+
+  // equal keys are the same key: strings by content, 0 and -0.
+  ObjString a("key", 3), b("key", 3);
+  map->set(OBJ_VAL(&a), NUMBER_VAL(1));
+  map->set(OBJ_VAL(&b), NUMBER_VAL(2));
+  map->set(NUMBER_VAL(0), BOOL_VAL(true));
+  map->set(NUMBER_VAL(-0.0), BOOL_VAL(false));
+  map->set(NIL_VAL, NUMBER_VAL(3));
+  map->set(BOOL_VAL(false), NUMBER_VAL(4));
+  EXPECT_EQ(map->count, 4);
+  ASSERT_TRUE(map->get(OBJ_VAL(&a), &value));
+  EXPECT_EQ(AS_NUMBER(value), 2);
+  ASSERT_TRUE(map->get(NUMBER_VAL(0), &value));
+  EXPECT_FALSE(AS_BOOL(value));
+  EXPECT_FALSE(map->get(BOOL_VAL(true), &value));
+
+  // removing most keys compacts the entries and keeps the order of the rest.
+  for (int i = 0; i < 1000; i++) {
+    map->set(NUMBER_VAL((double)(i + 1)), NUMBER_VAL((double)i));
+  }
+  EXPECT_EQ(map->count, 1004);
+  for (int i = 0; i < 1000; i++) {
+    if (i % 10 != 0) {
+      EXPECT_TRUE(map->remove(NUMBER_VAL((double)(i + 1))));
+    }
+  }
+  EXPECT_FALSE(map->remove(NUMBER_VAL(2)));
+  EXPECT_EQ(map->count, 104);
+  EXPECT_LT(map->entries.size(), 300);
+  EXPECT_TRUE(valuesEqual(map->entries[0].key, OBJ_VAL(&a)));
+  double previous = 0;
+  for (size_t i = 4; i < map->entries.size(); i++) {
+    if (map->entries[i].removed) continue;
+    EXPECT_GT(AS_NUMBER(map->entries[i].key), previous);
+    previous = AS_NUMBER(map->entries[i].key);
+  }
+  for (int i = 0; i < 1000; i += 10) {
+    ASSERT_TRUE(map->get(NUMBER_VAL((double)(i + 1)), &value));
+    EXPECT_EQ(AS_NUMBER(value), i);
+  }
+  // a removed key can come back, at the end.
+  map->set(NUMBER_VAL(2), NIL_VAL);
+  EXPECT_TRUE(valuesEqual(map->entries.back().key, NUMBER_VAL(2)));
+
+  EXPECT_TRUE(isMapKey(NUMBER_VAL(1.5)));
+  EXPECT_FALSE(isMapKey(NUMBER_VAL(NAN)));
+  EXPECT_FALSE(isMapKey(OBJ_VAL(map)));
+  delete map;
+}
+
+TEST(HashMap, natives) {
+  VM vm{};
+  vm.initVM();
+  std::string output;
+  vm.output.redirect(&output);
+  ASSERT_EQ(vm.interpret("var counts = map();"
+                         "var words = [\"a\", \"b\", \"a\"];"
+                         "for (var i = 0; i < words.length; i = i + 1) {"
+                         "  var w = words[i];"
+                         "  if (has(counts, w)) counts[w] = counts[w] + 1;"
+                         "  else counts[w] = 1; }"),
+            INTERPRET_OK);
+  // the map lives on in a global across collections.
+  auto result = vm.interpret(
+      "print counts; print counts.length; print counts[\"c\"];"
+      "counts[nil] = [1]; counts[true] = 2; print remove(counts, \"a\");"
+      "print remove(counts, \"a\"); print keys(counts); print values(counts);"
+      "print map() == map();");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output,
+            "{a: 2, b: 1}\n2\nnil\ntrue\nfalse\n[b, nil, true]\n[1, [1], 2]\n"
+            "false\n");
+
+  for (auto source : {"map()[map()];", "map()[0/0] = 1;", "map(1);",
+                      "has(map());", "remove([], 1);", "keys(1);",
+                      "var m = map(); m[[]] = 1;"}) {
+    EXPECT_EQ(vm.interpret(source), INTERPRET_RUNTIME_ERROR) << source;
+  }
+
+  // a map that holds itself prints the inner reference as {...}.
+  output.clear();
+  result = vm.interpret(
+      "var m = map(); m[1] = m; print m; var a = [m]; m[2] = a; print a;");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output, "{1: {...}}\n[{1: {...}, 2: [...]}]\n");
+}
@@ -0,0 +1,112 @@
+#include "main/number.hpp"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <string>
+
+TEST(Number, parseNumber) {
+  struct Case {
+    std::string text;
+    double expected;
+  };
+  for (auto c : std::vector<Case>{
+           {"0", 0},
+           {"1", 1},
+           {"42", 42},
+           {"3.25", 3.25},
+           {"0.1", 0.1},
+           {"00012.50", 12.5},
+           {"9007199254740993", 9007199254740992},
+           {"17976931348623157" + std::string(292, '0'),
+            1.7976931348623157e308},
+       }) {
+    double actual;
+    EXPECT_TRUE(parseNumber(c.text.data(), c.text.size(), &actual)) << c.text;
+    EXPECT_EQ(c.expected, actual) << c.text;
+  }
+
+  // only the span is read.
+  double actual;
+  EXPECT_TRUE(parseNumber("12345", 2, &actual));
+  EXPECT_EQ(12, actual);
+
+  std::string overflow(400, '9');
+  EXPECT_TRUE(parseNumber(overflow.data(), overflow.size(), &actual));
+  EXPECT_EQ(HUGE_VAL, actual);
+
+  std::string underflow = "0." + std::string(400, '0') + "1";
+  EXPECT_TRUE(parseNumber(underflow.data(), underflow.size(), &actual));
+  EXPECT_EQ(0, actual);
+  EXPECT_FALSE(std::signbit(actual));
+  std::string denormal = "0." + std::string(323, '0') + "5";
+  EXPECT_TRUE(parseNumber(denormal.data(), denormal.size(), &actual));
+  EXPECT_EQ(std::numeric_limits<double>::denorm_min(), actual);
+
+  for (std::string invalid : {"", "-1", "1e5", "inf", "nan", "1.2.3", "0x10",
+                              "12a"}) {
+    EXPECT_FALSE(parseNumber(invalid.data(), invalid.size(), &actual))
+        << invalid;
+  }
+}
+
+TEST(Number, formatNumber) {
+  struct Case {
+    double value;
+    std::string expected;
+  };
+  for (auto c : std::vector<Case>{
+           {0, "0"},
+           {-0.0, "-0"},
+           {1, "1"},
+           {-42, "-42"},
+           {3.25, "3.25"},
+           {0.1, "0.1"},
+           {0.1 + 0.2, "0.30000000000000004"},
+           {123456789, "123456789"},
+           {1e21, "1e+21"},
+           {1.5e-7, "1.5e-07"},
+           {HUGE_VAL, "inf"},
+           {-HUGE_VAL, "-inf"},
+       }) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    EXPECT_EQ(c.expected,
+              std::string(buffer, formatNumber(c.value, buffer)));
+  }
+}
+
+TEST(Number, roundTrip) {
+  std::mt19937_64 random(1);
+  char buffer[NUMBER_BUFFER_SIZE];
+  for (int i = 0; i < 100000; i++) {
+    // any finite double, positive so it is also a literal when fixed.
+    uint64_t bits = random() & ~(1ull << 63);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    if (!std::isfinite(value)) continue;
+
+    int length = formatNumber(value, buffer);
+    ASSERT_LE(length, NUMBER_BUFFER_SIZE);
+    EXPECT_EQ(value, strtod(std::string(buffer, length).c_str(), nullptr));
+  }
+
+  for (int i = 0; i < 100000; i++) {
+    // literals as scripts write them: integers and short fractions.
+    std::string literal = std::to_string(random() % 1000000000) + "." +
+                          std::to_string(random() % 100000);
+    double value;
+    ASSERT_TRUE(parseNumber(literal.data(), literal.size(), &value));
+    EXPECT_EQ(strtod(literal.c_str(), nullptr), value) << literal;
+
+    int length = formatNumber(value, buffer);
+    double parsed;
+    // fixed output of a literal parses back as a literal.
+    if (std::string(buffer, length).find('e') == std::string::npos) {
+      ASSERT_TRUE(parseNumber(buffer, length, &parsed));
+      EXPECT_EQ(value, parsed);
+    }
+  }
+}
@@ -13,6 +13,16 @@ TEST(Object, isObjType) {
   EXPECT_FALSE(isObjType(Value{.type = ValueType::VAL_NIL}, OBJ_STRING));
 }
 
+// however a string is made, it knows whether it is "length".
+TEST(Object, isLength) {
+  EXPECT_TRUE(ObjString("length").isLength);
+  EXPECT_TRUE(ObjString("length", 6).isLength);
+  EXPECT_TRUE(ObjString("length", 6, hashString("length", 6)).isLength);
+  EXPECT_FALSE(ObjString("lengths").isLength);
+  EXPECT_FALSE(ObjString("lengte", 6).isLength);
+  EXPECT_FALSE(ObjString().isLength);
+}
+
 TEST(Object, allocateStringObject) {
   auto strings = new Table{};
   Obj* objs = new Obj{};
@@ -84,7 +94,6 @@ TEST(Object, allocateUpvalueObject) {
   auto upvalue = allocateUpvalueObject(location, list);
   ASSERT_EQ(*list, upvalue);
   ASSERT_EQ(upvalue->location, location);
-  ASSERT_EQ(upvalue->nextUpValue, nullptr);
   ASSERT_EQ(upvalue->closed.type, ValueType::VAL_NIL);
 }
 
@@ -92,7 +101,8 @@ TEST(Object, markObject) {
   std::vector<Obj*> stack{};
   markObject(nullptr, stack);
 
-  auto obj = new Obj{};
+  // the gc log prints the object, so it has to be a complete one.
+  Obj* obj = new ObjFunction{};
   obj->isMarked = false;
   markObject(obj, stack);
   ASSERT_TRUE(obj->isMarked);
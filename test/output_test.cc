@@ -0,0 +1,72 @@
+#include "main/output.hpp"
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "main/object.hpp"
+
+// reads whatever is in the pipe without blocking on an empty one.
+std::string drain(int fd) {
+  std::string read;
+  char chunk[4096];
+  ssize_t n;
+  while ((n = ::read(fd, chunk, sizeof(chunk))) > 0) read.append(chunk, n);
+  return read;
+}
+
+TEST(OutputSink, writeValue) {
+  std::string memory;
+  auto sink = new OutputSink();
+  sink->redirect(&memory);
+
+  auto name = new ObjString("f");
+  auto function = new ObjFunction();
+  function->type = OBJ_FUNCTION;
+  function->name = name;
+  for (auto value : {NUMBER_VAL(1.5), NUMBER_VAL(-0.0), BOOL_VAL(true),
+                     BOOL_VAL(false), NIL_VAL, OBJ_VAL(new ObjString("abc")),
+                     OBJ_VAL(function)}) {
+    sink->writeValue(value);
+    sink->write(" ", 1);
+  }
+  sink->writeLine(NUMBER_VAL(7));
+  EXPECT_EQ(memory, "");
+  sink->flush();
+  EXPECT_EQ(memory, "1.5 -0 true false nil abc <fn f> 7\n");
+
+  // longer writes bypass the buffer, a full buffer goes out on its own.
+  memory.clear();
+  std::string large(OUTPUT_BUFFER_SIZE * 2 + 1, 'x');
+  sink->write("y", 1);
+  sink->write(large.data(), large.size());
+  EXPECT_EQ(memory, "y" + large);
+  for (int i = 0; i < OUTPUT_BUFFER_SIZE; i++) sink->writeLine(NUMBER_VAL(1));
+  EXPECT_GT(memory.size(), 1 + large.size());
+  sink->flush();
+  EXPECT_EQ(memory.size(), 1 + large.size() + OUTPUT_BUFFER_SIZE * 2);
+  delete sink;
+}
+
+TEST(OutputSink, flushMode) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  ASSERT_EQ(fcntl(fds[0], F_SETFL, O_NONBLOCK), 0);
+  auto sink = new OutputSink();
+
+  sink->redirect(fds[1], FLUSH_LINE);
+  sink->writeValue(NUMBER_VAL(1));
+  EXPECT_EQ(drain(fds[0]), "");
+  sink->writeLine(NUMBER_VAL(2));
+  EXPECT_EQ(drain(fds[0]), "12\n");
+
+  sink->redirect(fds[1], FLUSH_BLOCK);
+  sink->writeLine(NUMBER_VAL(3));
+  EXPECT_EQ(drain(fds[0]), "");
+  sink->flush();
+  EXPECT_EQ(drain(fds[0]), "3\n");
+
+  delete sink;
+  close(fds[0]);
+  close(fds[1]);
+}
@@ -0,0 +1,151 @@
+#include "main/parallel_map.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "main/scheduler.hpp"
+#include "main/vm.hpp"
+
+// runs `source` on a VM whose parallelMap() uses `pool`.
+static std::string run(const char* source, MapPool* pool,
+                       IntepretResult expected = INTERPRET_OK) {
+  std::string output;
+  VM vm{};
+  vm.initVM();
+  vm.mapPool = pool;
+  vm.output.redirect(&output);
+  EXPECT_EQ(vm.interpret(source), expected);
+  vm.output.flush();
+  return output;
+}
+
+static const char* squares =
+    "fun square(x) { return x * x; }"
+    "fun offset(x) { return square(x) + 1; }"
+    "var results = parallelMap(offset, 100);"
+    "var total = 0; var first = receive(results); var last = first;"
+    "var ordered = true; var value = first;"
+    "while (value != nil) {"
+    "  if (value < last) ordered = false;"
+    "  total = total + value; last = value; value = receive(results); }"
+    "print first; print last; print total; print ordered;";
+
+TEST(ParallelMap, ordered) {
+  for (int threads : {0, 1, 3}) {
+    MapPool pool(threads);
+    EXPECT_EQ(pool.size(), threads + 1);
+    EXPECT_EQ(run(squares, &pool), "1\n9802\n328450\ntrue\n") << threads;
+  }
+  // a VM the host gave no pool maps on its own thread.
+  EXPECT_EQ(run(squares, nullptr), "1\n9802\n328450\ntrue\n");
+}
+
+// functions nobody has called yet are compiled before they are copied.
+TEST(ParallelMap, lazy) {
+  MapPool pool(2);
+  std::string output;
+  VM vm{};
+  vm.initVM();
+  vm.lazyCompile = true;
+  vm.mapPool = &pool;
+  vm.output.redirect(&output);
+  EXPECT_EQ(vm.interpret(squares), INTERPRET_OK);
+  const char* nested =
+      "fun plusOne(x) { fun add(y) { return y + 1; } return add(x); }"
+      "print parallelMap(plusOne, [1, 2]);";
+  EXPECT_EQ(vm.interpret(nested), INTERPRET_OK);
+  EXPECT_EQ(vm.interpret("fun bad(x) { return x +; } parallelMap(bad, 3);"),
+            INTERPRET_RUNTIME_ERROR);
+  vm.output.flush();
+  EXPECT_EQ(output, "1\n9802\n328450\ntrue\n[2, 3]\n");
+}
+
+TEST(ParallelMap, items) {
+  MapPool pool(2);
+  const char* strings =
+      "fun greet(name) { return \"hi \" + name; }"
+      "var names = channel(4);"
+      "send(names, \"a\"); send(names, \"b\"); send(names, \"c\");"
+      "close(names);"
+      "var greetings = parallelMap(greet, names);"
+      "print receive(greetings); print receive(greetings);"
+      "print receive(greetings); print receive(greetings);"
+      "print receive(parallelMap(greet, 0));";
+  EXPECT_EQ(run(strings, &pool), "hi a\nhi b\nhi c\nnil\nnil\n");
+
+  // a mapped function can map too.
+  const char* nested =
+      "fun double(x) { return x * 2; }"
+      "fun sum(n) { var results = parallelMap(double, n); var total = 0;"
+      "  var value = receive(results);"
+      "  while (value != nil) { total = total + value; value = "
+      "receive(results); }"
+      "  return total; }"
+      "var sums = parallelMap(sum, 4);"
+      "print receive(sums); print receive(sums); print receive(sums); "
+      "print receive(sums);";
+  EXPECT_EQ(run(nested, &pool), "0\n0\n2\n6\n");
+}
+
+TEST(ParallelMap, arrays) {
+  MapPool pool(2);
+  const char* source =
+      "fun shout(word) { return word + \"!\"; }"
+      "print parallelMap(shout, [\"a\", \"b\", \"c\"]);"
+      "print parallelMap(shout, []);";
+  EXPECT_EQ(run(source, &pool), "[a!, b!, c!]\n[]\n");
+  EXPECT_EQ(run("fun f(x) { return x; } parallelMap(f, [[1]]);", &pool,
+                INTERPRET_RUNTIME_ERROR),
+            "");
+  EXPECT_EQ(run("fun f(x) { return [x]; } parallelMap(f, [1]);", &pool,
+                INTERPRET_RUNTIME_ERROR),
+            "");
+}
+
+TEST(ParallelMap, errors) {
+  MapPool pool(2);
+  const char* failing =
+      "fun check(x) { if (x == 42) return nil + x; return x; }"
+      "print \"before\"; parallelMap(check, 100); print \"after\";";
+  EXPECT_EQ(run(failing, &pool, INTERPRET_RUNTIME_ERROR), "before\n");
+
+  EXPECT_EQ(run("fun f(x) { return f; } parallelMap(f, 3);", &pool,
+                INTERPRET_RUNTIME_ERROR),
+            "");
+  EXPECT_EQ(run("fun f(x) { yield x; } parallelMap(f, 3);", &pool,
+                INTERPRET_RUNTIME_ERROR),
+            "");
+  EXPECT_EQ(run("fun f() {} parallelMap(f, 3);", &pool,
+                INTERPRET_RUNTIME_ERROR),
+            "");
+  EXPECT_EQ(run("fun f(x) {} parallelMap(f, -1);", &pool,
+                INTERPRET_RUNTIME_ERROR),
+            "");
+  const char* closure =
+      "fun outer() { var y = 1; fun inner(x) { return x + y; } return inner; }"
+      "parallelMap(outer(), 3);";
+  EXPECT_EQ(run(closure, &pool, INTERPRET_RUNTIME_ERROR), "");
+}
+
+// a task can't wait for a channel to be closed, its worker may be the one
+// that has to feed it.
+TEST(ParallelMap, channelsInTasks) {
+  const char* source =
+      "fun square(x) { return x * x; }"
+      "fun feed(c) { send(c, 2); send(c, 3); close(c); }"
+      "var closed = channel(4); feed(closed);"
+      "print receive(parallelMap(square, closed));"
+      "fun fill(c) { send(c, 2); }"
+      "var open = channel(4); spawn(fill, open);"
+      "parallelMap(square, open);";
+  auto program = Program::compile(source, strlen(source));
+  ASSERT_NE(program, nullptr);
+  for (int workers : {1, 2}) {
+    std::string output;
+    Scheduler scheduler(program, workers);
+    scheduler.scriptVm->output.redirect(&output);
+    EXPECT_FALSE(scheduler.run()) << workers;
+    EXPECT_EQ(output, "4\n") << workers;
+  }
+}
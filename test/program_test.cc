@@ -0,0 +1,95 @@
+#include "main/program.hpp"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "main/vm.hpp"
+
+static const char* source =
+    "var total = 0;"
+    "fun add(n) { total = total + n; return total; }"
+    "fun counter() { var count = 0;"
+    "  fun increment() { count = count + 1; return count; }"
+    "  return increment; }"
+    "var next = counter();"
+    "for (var i = 0; i < 4; i = i + 1) add(i);"
+    "print \"total \" + \"is\"; print total; print next(); print next();"
+    "print clock() >= 0;";
+
+TEST(Program, compile) {
+  EXPECT_EQ(Program::compile("var;", 4), nullptr);
+
+  auto program = Program::compile(source, strlen(source));
+  ASSERT_NE(program, nullptr);
+  EXPECT_EQ(program->script->name, nullptr);
+
+  std::string output;
+  {
+    VM vm_local{};
+    vm_local.initVM();
+    vm_local.output.redirect(&output);
+    ASSERT_EQ(vm_local.runProgram(program), IntepretResult::INTERPRET_OK);
+    EXPECT_EQ(program.use_count(), 2);
+
+    // the program's functions stay out of the VM's heap.
+    for (auto obj = vm_local.objects; obj != nullptr; obj = obj->next) {
+      EXPECT_NE(obj, (Obj*)program->script);
+    }
+
+    // globals are the VM's own, under the program's names.
+    Value total;
+    auto name = allocateStringObject("total", 5, &vm_local.strings,
+                                     &vm_local.objects);
+    ASSERT_TRUE(vm_local.globals.get(name, &total));
+    EXPECT_EQ(AS_NUMBER(total), 6);
+  }
+  EXPECT_EQ(output, "total is\n6\n1\n2\ntrue\n");
+  EXPECT_EQ(program.use_count(), 1);
+}
+
+// the program's "length" isn't the one in the VM's strings.
+TEST(Program, length) {
+  const char* lengths =
+      "var a = [1, 2]; print a.length; print \"abc\".length;"
+      "print buffer(4).length; var m = map(); m[1] = 2; print m.length;";
+  auto program = Program::compile(lengths, strlen(lengths));
+  ASSERT_NE(program, nullptr);
+  VM vm{};
+  vm.initVM();
+  std::string output;
+  vm.output.redirect(&output);
+  ASSERT_EQ(vm.runProgram(program), IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output, "2\n3\n4\n1\n");
+}
+
+// one compiled program shared by VMs on several threads, each with its own
+// globals.
+TEST(Program, shared) {
+  auto program = Program::compile(source, strlen(source));
+  ASSERT_NE(program, nullptr);
+
+  const int count = 4;
+  std::vector<std::string> outputs(count);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < count; i++) {
+    threads.emplace_back([&program](std::string* output) {
+      auto vm = std::make_unique<VM>();
+      vm->initVM();
+      vm->output.redirect(output);
+      // twice, so the second run sees the globals of the first.
+      EXPECT_EQ(vm->runProgram(program), IntepretResult::INTERPRET_OK);
+      EXPECT_EQ(vm->runProgram(program), IntepretResult::INTERPRET_OK);
+      vm->output.flush();
+    }, &outputs[i]);
+  }
+  for (auto& thread : threads) thread.join();
+
+  for (auto& output : outputs) {
+    EXPECT_EQ(output, "total is\n6\n1\n2\ntrue\ntotal is\n6\n1\n2\ntrue\n");
+  }
+  EXPECT_EQ(program.use_count(), 1);
+}
@@ -20,6 +20,10 @@ TEST(Scanner, skipWhitespace) {
   run("\nvsavsa", 2);
   run("   //asdfasdfa", 1);
   run("/1", 1);
+  run("// a\n  // b\n\n a", 4);
+  run("                                        \n\n\n\n\n\n\n\n\n\n\n\n\n\n"
+      "                                  a",
+      15);
 #undef run
 }
 
@@ -48,6 +52,16 @@ TEST(Scanner, number) {
     EXPECT_EQ(actual.start, source);
     EXPECT_EQ(actual.length, 5);
   }
+  {  // fraction
+    const char* source = "12.345;";
+    auto actual = Scanner(source).number();
+    EXPECT_EQ(actual.length, 6);
+  }
+  {  // trailing dot
+    const char* source = "12.a";
+    auto actual = Scanner(source).number();
+    EXPECT_EQ(actual.length, 2);
+  }
 }
 TEST(Scanner, identifier) {
   {  // identifier
@@ -111,6 +125,8 @@ TEST(Scanner, identifierType) {
   run("varr", 4, TokenType::TOKEN_IDENTIFIER);
   run("while", 5, TokenType::TOKEN_WHILE);
   run("whilee", 6, TokenType::TOKEN_IDENTIFIER);
+  run("yield", 5, TokenType::TOKEN_YIELD);
+  run("yielded", 7, TokenType::TOKEN_IDENTIFIER);
 #undef run
 }
 
@@ -233,6 +249,8 @@ TEST(Scanner, scanToken) {
   run_switch(")", TokenType::TOKEN_RIGHT_PAREN);
   run_switch(" \n {", TokenType::TOKEN_LEFT_BRACE);
   run_switch("}", TokenType::TOKEN_RIGHT_BRACE);
+  run_switch("[", TokenType::TOKEN_LEFT_BRACKET);
+  run_switch(" ]", TokenType::TOKEN_RIGHT_BRACKET);
   run_switch(" ;", TokenType::TOKEN_SEMICOLON);
   run_switch("\r,", TokenType::TOKEN_COMMA);
   run_switch(".", TokenType::TOKEN_DOT);
@@ -252,6 +270,46 @@ TEST(Scanner, scanToken) {
 #undef run_switch
 }
 
+TEST(Scanner, bounded) {
+  // nothing past the length is read, the buffer isn't NUL terminated.
+  const char source[] = {'v', 'a', 'r', ' ', 'x', 'y', '"', 'z'};
+  auto sc = Scanner(source, (size_t)5);
+  EXPECT_EQ(sc.scanToken().type, TokenType::TOKEN_VAR);
+  auto name = sc.scanToken();
+  EXPECT_EQ(name.type, TokenType::TOKEN_IDENTIFIER);
+  EXPECT_EQ(name.length, 1);
+  EXPECT_EQ(sc.scanToken().type, TokenType::TOKEN_EOF);
+  EXPECT_EQ(sc.peek(), '\0');
+
+  sc = Scanner(source + 6, (size_t)2);
+  EXPECT_EQ(sc.scanToken().type, TokenType::TOKEN_ERROR);
+}
+
+TEST(Scanner, vectorized) {
+  std::string source;
+  for (int i = 0; i < 40; i++) {
+    source += std::string(i, ' ') + "var " + std::string(i + 1, 'x') + "_9 = " +
+              std::string(i + 1, '7') + "." + std::string(i % 5 + 1, '3') +
+              ";\t\r\n// comment " + std::string(i * 3, '/') + "\n\"" +
+              std::string(i, 's') + "\n" + std::string(i, '{') + "\" " +
+              std::string(i % 7, '\n') + "\xc3\xa9";
+  }
+
+  auto scalar = Scanner(source.c_str());
+  scalar.vectorized = false;
+  auto vectorized = Scanner(source.c_str());
+  while (true) {
+    Token expected = scalar.scanToken();
+    Token actual = vectorized.scanToken();
+    ASSERT_EQ(actual.type, expected.type);
+    ASSERT_EQ(actual.start, expected.start);
+    ASSERT_EQ(actual.length, expected.length);
+    ASSERT_EQ(actual.line, expected.line);
+    if (expected.type == TOKEN_EOF) break;
+  }
+  EXPECT_GT(scalar.line, 40 * 3);
+}
+
 Token* getTokenFromString(std::string str) {
   auto ret = new Token{};
   ret->length = str.size();
@@ -0,0 +1,135 @@
+#include "main/scheduler.hpp"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+// runs `source` on `workers` workers and returns what the script printed.
+static std::string runTasks(const char* source, int workers, bool* ok) {
+  auto program = Program::compile(source, strlen(source));
+  EXPECT_NE(program, nullptr);
+  std::string output;
+  Scheduler scheduler(program, workers);
+  scheduler.scriptVm->output.redirect(&output);
+  *ok = scheduler.run();
+  // a failed script abandons the tasks left.
+  if (*ok) {
+    EXPECT_EQ(scheduler.unfinished.load(), 0);
+  }
+  return output;
+}
+
+static const char* fib =
+    "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }"
+    "fun tree(n) {"
+    "  if (n < 8) return fib(n);"
+    "  var a = spawn(tree, n - 1); var b = spawn(tree, n - 2);"
+    "  return join(a) + join(b); }"
+    "fun sum(count) { if (count == 0) return 0;"
+    "  var task = spawn(fib, count);"
+    "  var rest = sum(count - 1);"
+    "  return join(task) + rest; }"
+    "print sum(10); print join(spawn(tree, 14));";
+
+TEST(Scheduler, spawnJoin) {
+  for (int workers : {1, 2, 4}) {
+    bool ok;
+    EXPECT_EQ(runTasks(fib, workers, &ok), "143\n377\n") << workers;
+    EXPECT_TRUE(ok);
+  }
+}
+
+TEST(Scheduler, values) {
+  const char* source =
+      "fun greet(name) { return \"hello \" + name; }"
+      "fun first(task) { return join(task); }"
+      "fun none() {}"
+      "var task = spawn(greet, \"lox\");"
+      "print join(spawn(first, task)); print join(task);"
+      "print join(spawn(none)); print join(spawn(first, spawn(none))) == nil;"
+      "print spawn(none);";
+  bool ok;
+  EXPECT_EQ(runTasks(source, 4, &ok),
+            "hello lox\nhello lox\nnil\ntrue\n<task>\n");
+  EXPECT_TRUE(ok);
+}
+
+// a task that yields lets the others run and carries on afterwards.
+TEST(Scheduler, yield) {
+  const char* source =
+      "fun count(n) { var total = 0;"
+      "  for (var i = 0; i < n; i = i + 1) { total = total + i; yield; }"
+      "  return total; }"
+      "var a = spawn(count, 5); var b = spawn(count, 10);"
+      "print join(a) + join(b);";
+  bool ok;
+  EXPECT_EQ(runTasks(source, 1, &ok), "55\n");
+  EXPECT_TRUE(ok);
+}
+
+// a task sees the same globals whichever worker runs it, even the one that
+// runs the script.
+TEST(Scheduler, globals) {
+  const char* source =
+      "var base = 10; fun f(x) { if (base) return x; }"
+      "var a = spawn(f, 1); var b = spawn(f, 2); var c = spawn(f, 3);"
+      "print join(a); print join(b); print join(c);";
+  for (int workers : {1, 4}) {
+    for (int run = 0; run < 5; run++) {
+      bool ok;
+      EXPECT_EQ(runTasks(source, workers, &ok), "") << workers;
+      EXPECT_FALSE(ok);
+    }
+  }
+
+  const char* functions =
+      "fun base() { return 10; } fun f(x) { return base() + x; }"
+      "var a = spawn(f, 1); var b = spawn(f, 2); var c = spawn(f, 3);"
+      "print join(a); print join(b); print join(c);";
+  for (int workers : {1, 4}) {
+    bool ok;
+    EXPECT_EQ(runTasks(functions, workers, &ok), "11\n12\n13\n") << workers;
+    EXPECT_TRUE(ok);
+  }
+}
+
+TEST(Scheduler, errors) {
+  bool ok;
+  // a failed task fails whoever joins it.
+  const char* failing =
+      "fun fail() { return nil + 1; }"
+      "fun wait(task) { return join(task); }"
+      "print \"before\"; print join(spawn(wait, spawn(fail)));"
+      "print \"after\";";
+  EXPECT_EQ(runTasks(failing, 2, &ok), "before\n");
+  EXPECT_FALSE(ok);
+
+  // only shareable values cross between workers.
+  EXPECT_EQ(runTasks("fun f(x) { return x; } spawn(f, f);", 2, &ok), "");
+  EXPECT_FALSE(ok);
+  EXPECT_EQ(runTasks("fun f() { return f; } join(spawn(f));", 2, &ok), "");
+  EXPECT_FALSE(ok);
+
+  const char* closure =
+      "fun outer() { var x = 1; fun inner() { return x; } return inner; }"
+      "spawn(outer());";
+  EXPECT_EQ(runTasks(closure, 1, &ok), "");
+  EXPECT_FALSE(ok);
+
+  const char* nested =
+      "fun f() {} fun g() { join(spawn(f)); }"
+      "var task = fiber(g); resume(task);";
+  EXPECT_EQ(runTasks(nested, 1, &ok), "");
+  EXPECT_FALSE(ok);
+
+  EXPECT_EQ(runTasks("join(1);", 1, &ok), "");
+  EXPECT_FALSE(ok);
+
+  // g closes over a block variable, so tasks never see it as a global.
+  const char* blockClosure =
+      "fun h() { return g(); }"
+      "{ var x = 1; fun g() { return x; } print g(); }"
+      "print join(spawn(h));";
+  EXPECT_EQ(runTasks(blockClosure, 2, &ok), "1\n");
+  EXPECT_FALSE(ok);
+}
@@ -0,0 +1,176 @@
+#include "main/snapshot.hpp"
+
+#include <gtest/gtest.h>
+
+#include "main/object.hpp"
+
+Value getGlobal(VM* vm, const char* name) {
+  Value value = NIL_VAL;
+  auto key = allocateStringObject(name, strlen(name), &vm->strings,
+                                  &vm->objects);
+  vm->globals.get(key, &value);
+  return value;
+}
+
+TEST(Snapshot, roundTrip) {
+  auto prelude = new VM{};
+  ASSERT_EQ(prelude->interpret("var greeting = \"hello\";"
+                               "var count = 3;"
+                               "var now = clock;"
+                               "fun makeCounter() {"
+                               "  var n = 0;"
+                               "  fun next() { n = n + 1; return n; }"
+                               "  return next;"
+                               "}"
+                               "var counter = makeCounter();"
+                               "counter();"),
+            INTERPRET_OK);
+
+  std::vector<uint8_t> image;
+  ASSERT_TRUE(serializeHeap(prelude, &image));
+
+  auto vm = new VM{};
+  ASSERT_TRUE(deserializeHeap(image.data(), image.size(), vm));
+  EXPECT_EQ(AS_STRING(getGlobal(vm, "greeting"))->str, "hello");
+  EXPECT_DOUBLE_EQ(AS_NUMBER(getGlobal(vm, "count")), 3);
+  // natives are relinked to the new VM's own natives.
+  EXPECT_EQ(AS_OBJ(getGlobal(vm, "now")), AS_OBJ(getGlobal(vm, "clock")));
+
+  // the closed over upvalue carries its state into the new VM.
+  ASSERT_EQ(vm->interpret("var next = counter();"), INTERPRET_OK);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(getGlobal(vm, "next")), 2);
+  EXPECT_TRUE(IS_CLOSURE(getGlobal(vm, "makeCounter")));
+}
+
+TEST(Snapshot, rejectsMalformedImage) {
+  auto prelude = new VM{};
+  ASSERT_EQ(prelude->interpret("var a = 1;"), INTERPRET_OK);
+  std::vector<uint8_t> image;
+  ASSERT_TRUE(serializeHeap(prelude, &image));
+
+  image.resize(image.size() - 4);
+  EXPECT_FALSE(deserializeHeap(image.data(), image.size(), new VM{}));
+}
+
+TEST(Snapshot, snapshotFile) {
+  auto prelude = new VM{};
+  ASSERT_EQ(prelude->interpret("fun twice(a) { return a * 2; }"),
+            INTERPRET_OK);
+  std::string path = testing::TempDir() + "snapshot_test.snap";
+  ASSERT_TRUE(writeSnapshotFile(path.c_str(), prelude));
+
+  auto vm = new VM{};
+  ASSERT_TRUE(loadSnapshotFile(path.c_str(), vm));
+  ASSERT_EQ(vm->interpret("var result = twice(21);"), INTERPRET_OK);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(getGlobal(vm, "result")), 42);
+  remove(path.c_str());
+}
+
+TEST(Snapshot, lazyBodyThatDoesNotCompile) {
+  auto prelude = new VM{};
+  prelude->lazyCompile = true;
+  ASSERT_EQ(prelude->interpret("fun bad() { var = ; }"), INTERPRET_OK);
+
+  // the body is compiled with no frame running, so there's nothing to
+  // report a runtime error from.
+  std::vector<uint8_t> image;
+  EXPECT_FALSE(serializeHeap(prelude, &image));
+  EXPECT_EQ(prelude->frameCount, 0);
+}
+
+TEST(Snapshot, arrays) {
+  auto prelude = new VM{};
+  ASSERT_EQ(prelude->interpret("var xs = [1, 2, 3];"
+                               "var nested = [xs, \"a\", nil];"
+                               "append(xs, xs);"),
+            INTERPRET_OK);
+  std::vector<uint8_t> image;
+  ASSERT_TRUE(serializeHeap(prelude, &image));
+
+  auto vm = new VM{};
+  ASSERT_TRUE(deserializeHeap(image.data(), image.size(), vm));
+  auto xs = AS_ARRAY(getGlobal(vm, "xs"));
+  ASSERT_EQ(xs->values.size(), 4u);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(xs->values[2]), 3);
+  // an array that holds itself still does, and is shared with `nested`.
+  EXPECT_EQ(AS_OBJ(xs->values[3]), (Obj*)xs);
+  EXPECT_EQ(AS_OBJ(AS_ARRAY(getGlobal(vm, "nested"))->values[0]), (Obj*)xs);
+
+  ASSERT_EQ(vm->interpret("xs[0] = 10; var first = nested[0][0];"),
+            INTERPRET_OK);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(getGlobal(vm, "first")), 10);
+}
+
+TEST(Snapshot, classes) {
+  auto prelude = new VM{};
+  ASSERT_EQ(prelude->interpret("class Point {"
+                               "  init(x, y) { this.x = x; this.y = y; }"
+                               "  sum() { return this.x + this.y; }"
+                               "}"
+                               "class Named < Point {"
+                               "  name() { return \"p\"; }"
+                               "}"
+                               "var a = Point(1, 2);"
+                               "a.next = a;"
+                               "var b = Named(3, 4);"
+                               "var sum = a.sum;"
+                               "var total = a.sum() + b.sum();"),
+            INTERPRET_OK);
+  std::vector<uint8_t> image;
+  ASSERT_TRUE(serializeHeap(prelude, &image));
+
+  auto vm = new VM{};
+  ASSERT_TRUE(deserializeHeap(image.data(), image.size(), vm));
+  auto a = AS_INSTANCE(getGlobal(vm, "a"));
+  EXPECT_EQ(a->klass, AS_CLASS(getGlobal(vm, "Point")));
+  ASSERT_EQ(a->fields.size(), 3u);
+  EXPECT_EQ(AS_OBJ(a->fields[2]), (Obj*)a);
+
+  // instances with the same fields share a shape again, and new fields
+  // follow the transitions the prelude made.
+  ASSERT_EQ(vm->interpret("var c = Point(5, 6);"
+                          "var d = Named(7, 8);"
+                          "c.next = c;"
+                          "var sums = [a.sum(), b.sum(), c.sum(), d.sum(),"
+                          "            sum(), d.name(), a.next.x];"),
+            INTERPRET_OK);
+  auto c = AS_INSTANCE(getGlobal(vm, "c"));
+  EXPECT_EQ(c->shape, a->shape);
+  EXPECT_EQ(c->klass->shapes.size(), a->klass->shapes.size());
+  auto sums = AS_ARRAY(getGlobal(vm, "sums"))->values;
+  EXPECT_DOUBLE_EQ(AS_NUMBER(sums[0]), 3);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(sums[1]), 7);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(sums[2]), 11);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(sums[3]), 15);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(sums[4]), 3);
+  EXPECT_EQ(AS_STRING(sums[5])->str, "p");
+  EXPECT_DOUBLE_EQ(AS_NUMBER(sums[6]), 1);
+}
+
+TEST(Snapshot, maps) {
+  auto prelude = new VM{};
+  ASSERT_EQ(prelude->interpret("var m = map();"
+                               "m[\"b\"] = 1; m[\"gone\"] = 0; m[2] = \"two\";"
+                               "m[nil] = m; m[\"a\"] = [3];"
+                               "remove(m, \"gone\");"),
+            INTERPRET_OK);
+  std::vector<uint8_t> image;
+  ASSERT_TRUE(serializeHeap(prelude, &image));
+
+  auto vm = new VM{};
+  ASSERT_TRUE(deserializeHeap(image.data(), image.size(), vm));
+  auto m = AS_MAP(getGlobal(vm, "m"));
+  EXPECT_EQ(m->count, 4u);
+  Value self;
+  ASSERT_TRUE(m->get(NIL_VAL, &self));
+  EXPECT_EQ(AS_OBJ(self), (Obj*)m);
+
+  // keys keep their insertion order and are found through the new index.
+  std::string output;
+  vm->output.redirect(&output);
+  ASSERT_EQ(vm->interpret("print keys(m); print m[2]; print m[\"a\"][0];"
+                          "print has(m, \"gone\");"),
+            INTERPRET_OK);
+  vm->output.flush();
+  EXPECT_EQ(output, "[b, 2, nil, a]\ntwo\n3\nfalse\n");
+}
@@ -2,6 +2,8 @@
 
 #include <gtest/gtest.h>
 
+#include "main/object.hpp"
+
 TEST(Table, get) {
   auto table = Table{};
   auto exists = new ObjString("aaa");
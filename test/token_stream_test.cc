@@ -0,0 +1,70 @@
+#include "main/token_stream.hpp"
+
+#include <gtest/gtest.h>
+
+#include "main/compiler.hpp"
+
+static const char* source =
+    "fun add(a, b) {\n"
+    "  // sum\n"
+    "  return a + b * 2.5;\n"
+    "}\n"
+    "print add(1, 2) >= 3 and \"yes\";\n"
+    "@ \"unterminated";
+
+TEST(TokenStream, scan) {
+  TokenStream tokens(source, strlen(source));
+  tokens.scan();
+  ASSERT_TRUE(tokens.complete);
+
+  auto scanner = Scanner(source);
+  for (size_t i = 0;; i++) {
+    Token expected = scanner.scanToken();
+    Token actual = tokens.at(i);
+    ASSERT_EQ(actual.type, expected.type);
+    ASSERT_EQ(actual.start, expected.start);
+    ASSERT_EQ(actual.length, expected.length);
+    ASSERT_EQ(actual.line, expected.line);
+    if (expected.type == TOKEN_EOF) {
+      EXPECT_EQ(tokens.published, i + 1);
+      break;
+    }
+  }
+
+  // reading past the end keeps returning TOKEN_EOF.
+  EXPECT_EQ(tokens.at(tokens.published + 10).type, TOKEN_EOF);
+}
+
+TEST(TokenStream, empty) {
+  TokenStream tokens(source, 0);
+  tokens.scanInBackground();
+  EXPECT_EQ(tokens.at(0).type, TOKEN_EOF);
+  EXPECT_EQ(tokens.at(1).type, TOKEN_EOF);
+}
+
+TEST(TokenStream, compile) {
+  std::string script;
+  for (int i = 0; i < 200; i++) {
+    script += "{\n  var a = " + std::to_string(i) +
+              ";\n  var b = a * a + a - a / a;\n  print b;\n}\n";
+  }
+
+  Table strings{};
+  Obj* objects = nullptr;
+  auto direct = Compiler(script.c_str(), &strings, &objects);
+  auto expected = direct.compile();
+  ASSERT_TRUE(expected);
+
+  // the compiler consumes tokens while the producer is still scanning.
+  TokenStream tokens(script.c_str(), script.size());
+  tokens.scanInBackground();
+  auto streamed = Compiler(script.c_str(), &strings, &objects);
+  streamed.parser->tokens = &tokens;
+  auto actual = streamed.compile();
+  ASSERT_TRUE(actual);
+
+  EXPECT_EQ(actual->chunk.code, expected->chunk.code);
+  EXPECT_EQ(actual->chunk.lines, expected->chunk.lines);
+  EXPECT_EQ(actual->chunk.constants.values.size(),
+            expected->chunk.constants.values.size());
+}
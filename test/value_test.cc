@@ -24,4 +24,30 @@ TEST(Value, valuesEqual) {
                           OBJ_VAL(new ObjString("abcd"))));
   EXPECT_FALSE(valuesEqual(OBJ_VAL(new ObjString("abcd")),
                            OBJ_VAL(new ObjString("aaa"))));
+
+  // other objects are only equal to themselves.
+  Obj* objects = nullptr;
+  auto a = allocateArrayObject(&objects), b = allocateArrayObject(&objects);
+  EXPECT_TRUE(valuesEqual(OBJ_VAL(a), OBJ_VAL(a)));
+  EXPECT_FALSE(valuesEqual(OBJ_VAL(a), OBJ_VAL(b)));
+  EXPECT_FALSE(valuesEqual(OBJ_VAL(a), OBJ_VAL(new ObjString(""))));
+  delete a;
+  delete b;
+}
+
+TEST(Value, integers) {
+  EXPECT_TRUE(IS_INT(packNumber(42)));
+  EXPECT_TRUE(IS_INT(packNumber(-2147483648.0)));
+  EXPECT_FALSE(IS_INT(packNumber(2147483648.0)));
+  EXPECT_FALSE(IS_INT(packNumber(0.5)));
+  EXPECT_FALSE(IS_INT(packNumber(-0.0)));
+  EXPECT_TRUE(IS_INT(packNumber(0)));
+
+  // to everything but the VM's fast paths, an integer is just a number.
+  EXPECT_TRUE(IS_NUMBER(INT_VAL(3)));
+  EXPECT_EQ(AS_NUMBER(INT_VAL(-3)), -3.0);
+  EXPECT_TRUE(valuesEqual(INT_VAL(3), NUMBER_VAL(3)));
+  EXPECT_TRUE(valuesEqual(NUMBER_VAL(0), INT_VAL(0)));
+  EXPECT_FALSE(valuesEqual(INT_VAL(3), NUMBER_VAL(3.5)));
+  EXPECT_FALSE(valuesEqual(INT_VAL(1), BOOL_VAL(true)));
 }
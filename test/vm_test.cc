@@ -2,6 +2,9 @@
 
 #include <gtest/gtest.h>
 
+#include <memory>
+#include <thread>
+
 #include "main/object.hpp"
 #include "main/value.hpp"
 
@@ -24,13 +27,16 @@ TEST(VM, OP_DEFINE_GLOBAL) {
   auto c = Chunk{};
   c.write_chunk(OptCode::OP_DEFINE_GLOBAL, 123);
   c.write_chunk(c.add_const(OBJ_VAL(variable)), 123);
+  // the script's return value.
+  c.write_chunk(OptCode::OP_NIL, 123);
   c.write_chunk(OptCode::OP_RETURN, 123);
   VM vm_local{};
   vm_local.interpret(CHUNK_AS_FUNC(c));
   vm_local.push(NUMBER_VAL(1.2));
   vm_local.run();
 
-  ASSERT_EQ(vm_local.globals.count, 2);
+  // the natives plus the new global.
+  ASSERT_EQ(vm_local.globals.count, vm_local.natives.count + 1);
   Value actual;
   ASSERT_TRUE(vm_local.globals.get(variable, &actual));
   EXPECT_DOUBLE_EQ(actual.number, 1.2);
@@ -115,15 +121,16 @@ TEST(VM, pop) {
 
 TEST(VM, binary_op) {
   VM vm_local;
-#define run(OP_CODE, v1, v2)              \
-  {                                       \
-    vm_local.initVM();                    \
-    auto c = Chunk{};                     \
-    c.write_chunk(OP_CODE, 123);          \
-    vm_local.interpret(CHUNK_AS_FUNC(c)); \
-    vm_local.push(NUMBER_VAL(v1));        \
-    vm_local.push(NUMBER_VAL(v2));        \
-    vm_local.run();                       \
+#define run(OP_CODE, v1, v2)                \
+  {                                         \
+    vm_local.initVM();                      \
+    auto c = Chunk{};                       \
+    c.write_chunk(OP_CODE, 123);            \
+    c.write_chunk(OptCode::OP_RETURN, 123); \
+    vm_local.interpret(CHUNK_AS_FUNC(c));   \
+    vm_local.push(NUMBER_VAL(v1));          \
+    vm_local.push(NUMBER_VAL(v2));          \
+    vm_local.run();                         \
   }
 
   // add
@@ -144,27 +151,27 @@ TEST(VM, binary_op) {
 
   // ==
   run(OptCode::OP_EQUAL, 10, 100);
-  EXPECT_FALSE((vm_local.stack_top - 1)->boolean);
+  EXPECT_FALSE(vm_local.stack[1].boolean);
 
   // ==
   run(OptCode::OP_EQUAL, 100, 100);
-  EXPECT_TRUE((vm_local.stack_top - 1)->boolean);
+  EXPECT_TRUE(vm_local.stack[1].boolean);
 
   // >
   run(OptCode::OP_GREATER, 100, 10);
-  EXPECT_TRUE((vm_local.stack_top - 1)->boolean);
+  EXPECT_TRUE(vm_local.stack[1].boolean);
 
   // >
   run(OptCode::OP_GREATER, 10, 100);
-  EXPECT_FALSE((vm_local.stack_top - 1)->boolean);
+  EXPECT_FALSE(vm_local.stack[1].boolean);
 
   // <
   run(OptCode::OP_LESS, 10, 100);
-  EXPECT_TRUE((vm_local.stack_top - 1)->boolean);
+  EXPECT_TRUE(vm_local.stack[1].boolean);
 
   // <
   run(OptCode::OP_LESS, 100, 10);
-  EXPECT_FALSE((vm_local.stack_top - 1)->boolean);
+  EXPECT_FALSE(vm_local.stack[1].boolean);
 #undef run
 }
 
@@ -198,3 +205,396 @@ TEST(VM, freeVM) {
   vm_local.freeVM();
   EXPECT_EQ(vm_local.objects, nullptr);
 }
+
+TEST(VM, OP_STACK_CLOSURE) {
+  VM vm_local{};
+  vm_local.initVM();
+  auto result = vm_local.interpret(
+      "var result;"
+      "fun outer() {"
+      "  var x = 2;"
+      "  fun helper(y) { return x * y; }"
+      "  result = helper(21);"
+      "}"
+      "outer();");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+
+  Value actual;
+  auto name = allocateStringObject("result", 6, &vm_local.strings,
+                                   &vm_local.objects);
+  ASSERT_TRUE(vm_local.globals.get(name, &actual));
+  EXPECT_DOUBLE_EQ(AS_NUMBER(actual), 42);
+
+  // only the script and `outer` are heap closures.
+  int closures = 0;
+  for (Obj* obj = vm_local.objects; obj != nullptr; obj = obj->next) {
+    if (obj->type == OBJ_CLOSURE) closures++;
+  }
+  EXPECT_EQ(closures, 2);
+}
+
+TEST(VM, lazyCompile) {
+  VM vm_local{};
+  vm_local.initVM();
+  vm_local.lazyCompile = true;
+  auto result = vm_local.interpret(
+      "fun unused() { return 1; }"
+      "fun make(a) {"
+      "  var x = a;"
+      "  fun twice() { return x * 2; }"
+      "  return twice;"
+      "}"
+      "var result = make(21)();");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+
+  Value actual;
+  auto name = allocateStringObject("result", 6, &vm_local.strings,
+                                   &vm_local.objects);
+  ASSERT_TRUE(vm_local.globals.get(name, &actual));
+  EXPECT_DOUBLE_EQ(AS_NUMBER(actual), 42);
+
+  name = allocateStringObject("unused", 6, &vm_local.strings,
+                              &vm_local.objects);
+  ASSERT_TRUE(vm_local.globals.get(name, &actual));
+  EXPECT_NE(AS_CLOSURE(actual)->function->lazy, nullptr);
+  name = allocateStringObject("make", 4, &vm_local.strings, &vm_local.objects);
+  ASSERT_TRUE(vm_local.globals.get(name, &actual));
+  EXPECT_EQ(AS_CLOSURE(actual)->function->lazy, nullptr);
+
+  // errors in a body surface on its first call.
+  result = vm_local.interpret("fun broken() { var; } broken();");
+  EXPECT_EQ(result, IntepretResult::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST(VM, captureUpvalue) {
+  VM vm_local{};
+  vm_local.initVM();
+  vm_local.interpret(CHUNK_AS_FUNC(Chunk{}));
+  auto frame = CURRENT_FRAME(vm_local);
+  for (int i = 0; i < 8; i++) vm_local.push(NUMBER_VAL((double)i));
+
+  auto third = vm_local.captureUpvalue(frame->slots + 3);
+  vm_local.captureUpvalue(frame->slots + 7);
+  vm_local.captureUpvalue(frame->slots + 1);
+  vm_local.captureUpvalue(frame->slots + 5);
+  EXPECT_EQ(vm_local.captureUpvalue(frame->slots + 3), third);
+
+  ASSERT_EQ(frame->openUpvalues.size(), 4);
+  EXPECT_EQ(frame->openUpvalues[0]->location, frame->slots + 1);
+  EXPECT_EQ(frame->openUpvalues[1]->location, frame->slots + 3);
+  EXPECT_EQ(frame->openUpvalues[2]->location, frame->slots + 5);
+  EXPECT_EQ(frame->openUpvalues[3]->location, frame->slots + 7);
+
+  vm_local.closeUpvalues(frame->slots + 3);
+  ASSERT_EQ(frame->openUpvalues.size(), 1);
+  EXPECT_EQ(third->location, &third->closed);
+  EXPECT_DOUBLE_EQ(third->closed.number, 2);
+}
+
+TEST(VM, print) {
+  VM vm_local{};
+  vm_local.initVM();
+  std::string output;
+  vm_local.output.redirect(&output);
+  auto result = vm_local.interpret(
+      "print 1 + 2; print \"a\" + \"b\"; print !nil; print nil;"
+      "fun f() {} print f; print clock;");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output, "3\nab\ntrue\nnil\n<fn f>\n<native fn>\n");
+}
+
+TEST(VM, arrays) {
+  VM vm_local{};
+  vm_local.initVM();
+  std::string output;
+  vm_local.output.redirect(&output);
+  auto result = vm_local.interpret(
+      "var a = [1, \"two\", [3]]; print a; print a.length;"
+      "a[0] = a[2][0] = 4; print a[0]; print a;"
+      "var b = []; for (var i = 0; i < 100; i = i + 1) append(b, i * i);"
+      "print b.length; print b[99]; print \"four\".length;"
+      "print a == a; print [] == [];");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output,
+            "[1, two, [3]]\n3\n4\n[4, two, [4]]\n100\n9801\n4\ntrue\n"
+            "false\n");
+
+  for (auto source : {"[1][1];", "[1][-1];", "[1][0.5];", "[1][\"0\"];",
+                      "nil[0];", "var x = 1; x[0] = 1;", "print nil.length;",
+                      "append(1, 2);"}) {
+    EXPECT_EQ(vm_local.interpret(source), INTERPRET_RUNTIME_ERROR) << source;
+  }
+
+  // an array that holds itself prints the inner reference as [...].
+  output.clear();
+  result = vm_local.interpret("var c = [1]; append(c, c); print c; print [c];");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output, "[1, [...]]\n[[1, [...]]]\n");
+}
+
+TEST(VM, classes) {
+  const char* source =
+      "class Point { init(x, y) { this.x = x; this.y = y; }"
+      "  sum() { return this.x + this.y; }"
+      "  adder() { fun add(n) { return this.x + n; } return add; } }"
+      "class Point3 < Point { init(x, y, z) { super.init(x, y); this.z = z; }"
+      "  sum() { return super.sum() + this.z; } }"
+      "var p = Point(1, 2); var q = Point(3, 4); var r = Point3(1, 2, 3);"
+      "print p.sum(); print q.sum(); print r.sum(); print p.adder()(10);"
+      "var sum = q.sum; q.x = 10; print sum(); print Point; print p; print sum;"
+      "fun getX(o) { return o.x; }"
+      "for (var i = 0; i < 3; i = i + 1) print getX(p) + getX(q);"
+      "class Empty {} var e = Empty(); e.name = \"e\"; print e.name;";
+  for (bool lazy : {false, true}) {
+    VM vm{};
+    vm.initVM();
+    vm.lazyCompile = lazy;
+    std::string output;
+    vm.output.redirect(&output);
+    ASSERT_EQ(vm.interpret(source), IntepretResult::INTERPRET_OK);
+    EXPECT_EQ(output,
+              "3\n7\n6\n11\n14\nPoint\nPoint instance\n<fn sum>\n11\n11\n11\n"
+              "e\n");
+
+    auto global = [&vm](const char* name) {
+      Value value;
+      vm.globals.get(allocateStringObject(name, strlen(name), &vm.strings,
+                                          &vm.objects),
+                     &value);
+      return value;
+    };
+    // instances given the same fields in the same order share a shape, so
+    // getX has seen a single one.
+    ObjInstance* p = AS_INSTANCE(global("p"));
+    EXPECT_EQ(p->shape, AS_INSTANCE(global("q"))->shape);
+    EXPECT_NE(p->shape, AS_INSTANCE(global("r"))->shape);
+    EXPECT_EQ(p->fields.size(), 2);
+    ObjClosure* getX = AS_CLOSURE(global("getX"));
+    ASSERT_EQ(getX->caches.size(), 1);
+    EXPECT_EQ(getX->caches[0].count, 1);
+  }
+
+  VM vm{};
+  vm.initVM();
+  for (auto source :
+       {"class A {} A().x;", "class A {} A(1);", "class A { init(a) {} } A();",
+        "var B = 1; class A < B {}", "1.x;", "1.x = 2;", "nil.length;",
+        "class A {} A().f();"}) {
+    EXPECT_EQ(vm.interpret(source), INTERPRET_RUNTIME_ERROR) << source;
+  }
+}
+
+// integer arithmetic prints exactly what doubles would.
+TEST(VM, integers) {
+  VM vm{};
+  vm.initVM();
+  std::string output;
+  vm.output.redirect(&output);
+  auto result = vm.interpret(
+      "print 2147483647 + 1; print -2147483648 - 1; print 65536 * 65536;"
+      "print 0 * -1; print -3 * 0; print -0; print -(1 - 1); print 7 - 10;"
+      "print 1 == 1.0; print 3 < 3.5; print 2 > 1; print 1 / 2; print -5 * 3;"
+      "print 3 + 0.25; print 1 / (0 * -1); print -2147483648 * -1;"
+      "var n = 0; for (var i = 0; i < 10; i = i + 1) n = n + i; print n;"
+      "var m = map(); m[1] = \"one\"; print m[1.0];");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output,
+            "2147483648\n-2147483649\n4294967296\n-0\n-0\n-0\n-0\n-3\n"
+            "true\ntrue\ntrue\n0.5\n-15\n3.25\n-inf\n2147483648\n45\none\n");
+
+  // the counter stayed an integer all along.
+  Value n;
+  vm.globals.get(allocateStringObject("n", 1, &vm.strings, &vm.objects), &n);
+  EXPECT_TRUE(IS_INT(n));
+}
+
+// fused loops do what the same loops written any other way do.
+TEST(VM, countedLoop) {
+  const char* loops[][2] = {
+      {"for (var i = 0; i < 5; i = i + 1) print i;",
+       "var i = 0; while (i < 5) { print i; i = i + 1; }"},
+      {"for (var i = 0.5; i < 3; i = i + 1) print i;",
+       "var i = 0.5; while (i < 3) { print i; i = i + 1; }"},
+      {"for (var i = 10; i < 5; i = i + 1) print i;", "var unused;"},
+      // assigning the variable or the limit in the body.
+      {"{ var n = 10; for (var i = 0; i < n; i = i + 1) { i = i * 2; n = n - 1;"
+       " print i; } }",
+       "var n = 10; var i = 0; while (i < n) { i = i * 2; n = n - 1; print i;"
+       " i = i + 1; }"},
+      // closures see the variable as it changes.
+      {"{ var f; for (var i = 0; i < 3; i = i + 1) { fun g() { return i; }"
+       " f = g; } print f(); }",
+       "print 3;"},
+      {"for (var i = 2147483646; i < 2147483649; i = i + 1) print i;",
+       "print 2147483646; print 2147483647; print 2147483648;"},
+      {"fun f() { var sum = 0;"
+       " for (var i = 0; i < 1000; i = i + 1) sum = sum + i; return sum; }"
+       " print f();",
+       "print 499500;"},
+  };
+  for (auto& loop : loops) {
+    std::string fused, plain;
+    VM vm{};
+    vm.initVM();
+    vm.output.redirect(&fused);
+    ASSERT_EQ(vm.interpret(loop[0]), INTERPRET_OK) << loop[0];
+    vm.output.redirect(&plain);
+    ASSERT_EQ(vm.interpret(loop[1]), INTERPRET_OK) << loop[1];
+    EXPECT_EQ(fused, plain) << loop[0];
+  }
+
+  VM vm{};
+  vm.initVM();
+  for (auto source :
+       {"for (var i = 0; i < 3; i = i + 1) i = \"a\";",
+        "{ var n = 3; for (var i = 0; i < n; i = i + 1) n = nil; }"}) {
+    EXPECT_EQ(vm.interpret(source), INTERPRET_RUNTIME_ERROR) << source;
+  }
+}
+
+// objects on the heap, garbage or not.
+static size_t countObjects(VM* vm) {
+  size_t count = 0;
+  for (Obj* object = vm->objects; object != nullptr; object = object->next) {
+    count++;
+  }
+  return count;
+}
+
+TEST(VM, invoke) {
+  VM vm{};
+  vm.initVM();
+  std::string output;
+  vm.output.redirect(&output);
+  auto result = vm.interpret(
+      "class Counter { init() { this.n = 0; }"
+      "  add(by) { this.n = this.n + by; return this; } }"
+      "class Tens < Counter { add(by) { return super.add(by * 10); } }"
+      "var c = Counter(); print c.add(1).add(2).n;"
+      "var t = Tens(); t.add(1); print t.n;"
+      "fun twice(x) { return 2 * x; } c.f = twice; print c.f(3);"
+      "c.push = append; var a = []; c.push(a, 1); print a;"
+      "c.make = Counter; print c.make().n;");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_EQ(output, "3\n10\n6\n[1]\n0\n");
+
+  // a method call allocates nothing, however many times it runs.
+  auto allocated = [&vm](const char* loop, int count) {
+    std::string source = "for (var i = 0; i < " + std::to_string(count) +
+                         "; i = i + 1) " + loop;
+    size_t before = countObjects(&vm);
+    EXPECT_EQ(vm.interpret(source.c_str()), INTERPRET_OK);
+    return countObjects(&vm) - before;
+  };
+  EXPECT_EQ(allocated("c.add(1);", 10), allocated("c.add(1);", 1000));
+  EXPECT_LT(allocated("c.add;", 10), allocated("c.add;", 1000));
+
+  for (auto source : {"c.missing();", "nil.f();", "c.n();", "c.add();",
+                      "class A < Counter { f() { super.missing(); } } "
+                      "A().f();"}) {
+    EXPECT_EQ(vm.interpret(source), INTERPRET_RUNTIME_ERROR) << source;
+  }
+}
+
+// every VM owns its heap, strings and globals, so one per thread needs no
+// locking and behaves exactly like running them one after another.
+TEST(VM, isolates) {
+  const char* source =
+      "var greeting = \"hello\";"
+      "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }"
+      "fun counter() { var count = 0;"
+      "  fun increment() { count = count + 1; return count; }"
+      "  return increment; }"
+      "var next = counter();"
+      "for (var i = 0; i < 3; i = i + 1) print greeting + \" \" + \"world\";"
+      "print fib(12); print next(); print next();";
+
+  auto run = [source](int id, std::string* output) {
+    auto vm = std::make_unique<VM>();
+    vm->initVM();
+    vm->lazyCompile = id % 2 == 1;
+    vm->output.redirect(output);
+    EXPECT_EQ(vm->interpret(source), IntepretResult::INTERPRET_OK);
+    vm->output.flush();
+  };
+
+  const int count = 4;
+  std::string expected;
+  run(0, &expected);
+  EXPECT_EQ(expected, "hello world\nhello world\nhello world\n144\n1\n2\n");
+
+  std::vector<std::string> outputs(count);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < count; i++) threads.emplace_back(run, i, &outputs[i]);
+  for (auto& thread : threads) thread.join();
+  for (auto& output : outputs) EXPECT_EQ(output, expected);
+}
+
+TEST(VM, fibers) {
+  VM vm_local{};
+  vm_local.initVM();
+  std::string output;
+  vm_local.output.redirect(&output);
+  auto result = vm_local.interpret(
+      "fun range(n) {"
+      "  for (var i = 0; i < n; i = i + 1) yield i;"
+      "  return \"done\";"
+      "}"
+      // a pipeline: squares pulls from a fiber it was handed.
+      "fun squares(source) {"
+      "  while (true) {"
+      "    var value = resume(source);"
+      "    if (isDone(source)) return nil;"
+      "    yield value * value;"
+      "  }"
+      "}"
+      "var numbers = fiber(range);"
+      "resume(numbers, 3);"
+      "var squared = fiber(squares);"
+      "print resume(squared, numbers);"
+      "print resume(squared);"
+      "print resume(squared);"
+      "print isDone(squared);"
+      "print isDone(numbers);"
+      // closures over a suspended fiber's locals keep working.
+      "fun counter() { var count = 0;"
+      "  fun increment() { count = count + 1; return count; }"
+      "  yield increment; yield nil; }"
+      "var counting = fiber(counter);"
+      "var increment = resume(counting);"
+      "increment(); print increment();"
+      "resume(counting); resume(counting); print increment();");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  vm_local.output.flush();
+  EXPECT_EQ(output, "1\n4\nnil\ntrue\ntrue\n2\n3\n");
+
+  // finished fibers hand their stacks on.
+  EXPECT_LE(vm_local.fiberStacks.size(), 2);
+  EXPECT_EQ(vm_local.freeStacks.size(), vm_local.fiberStacks.size());
+  result = vm_local.interpret(
+      "for (var i = 0; i < 100; i = i + 1) {"
+      "  fun once() { yield 1; } var f = fiber(once); resume(f); resume(f);"
+      "}");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_LE(vm_local.fiberStacks.size(), 2);
+  // so do suspended ones nothing refers to any more.
+  result = vm_local.interpret(
+      "for (var i = 0; i < 100; i = i + 1) {"
+      "  fun once() { yield 1; } var f = fiber(once); resume(f);"
+      "}");
+  ASSERT_EQ(result, IntepretResult::INTERPRET_OK);
+  EXPECT_LE(vm_local.fiberStacks.size(), 16);
+
+  for (auto source : {"yield 1;", "fun f() {} var done = fiber(f);"
+                                  "resume(done); resume(done);",
+                      "fun f() { resume(self); } var self = fiber(f);"
+                      "resume(self);",
+                      "fun f(a, b) {} fiber(f);", "resume(1);"}) {
+    EXPECT_EQ(vm_local.interpret(source),
+              IntepretResult::INTERPRET_RUNTIME_ERROR)
+        << source;
+    // an error leaves the VM on its own stack.
+    EXPECT_EQ(vm_local.fiber, nullptr);
+    EXPECT_EQ(vm_local.stack, vm_local.mainStack.values.get());
+  }
+}